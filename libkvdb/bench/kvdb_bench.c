@@ -0,0 +1,469 @@
+#define _GNU_SOURCE
+// kvdb 性能基准：YCSB A–F 风格的负载，输出一行 JSON 的吞吐量与延迟分位数。
+//
+//   ./kvdb_bench -w a -n 100000 -o 200000 -t 4 -r zipfian -k 24 -v uniform:100-1000 -s none
+//
+// 先用 -t 个线程装载 -n 条记录（phase "load"），再执行 -o 次操作（phase "run"），各输出一行。
+// 键与值的长度可以是固定值 N，或 uniform:MIN-MAX、zipf:MIN-MAX 分布
+
+#include <kvdb.h>
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <glob.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ZIPF_THETA 0.99     // 与 YCSB 默认的 Zipf 常数相同
+#define KEY_MIN 16          // 键的前 16 字节是记录编号哈希的十六进制，保证不同记录的键不同
+#define SCAN_MAX 100        // 负载 E 每次扫描 1..SCAN_MAX 个键
+#define HIST_SUB_BITS 4     // 直方图每个 2 的幂区间再分 16 格，相对误差不超过 1/16
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum op_type { OP_READ, OP_UPDATE, OP_INSERT, OP_SCAN, OP_RMW, OP_TYPES };
+static const char *op_names[OP_TYPES] = { "read", "update", "insert", "scan", "rmw" };
+
+// 负载：各操作所占的比例与选键的分布
+struct workload {
+    char name;
+    double mix[OP_TYPES];
+    const char *dist;
+};
+
+static const struct workload workloads[] = {
+    { 'a', { [OP_READ] = 0.50, [OP_UPDATE] = 0.50 }, "zipfian" },
+    { 'b', { [OP_READ] = 0.95, [OP_UPDATE] = 0.05 }, "zipfian" },
+    { 'c', { [OP_READ] = 1.00 }, "zipfian" },
+    { 'd', { [OP_READ] = 0.95, [OP_INSERT] = 0.05 }, "latest" },
+    { 'e', { [OP_SCAN] = 0.95, [OP_INSERT] = 0.05 }, "zipfian" },
+    { 'f', { [OP_READ] = 0.50, [OP_RMW] = 0.50 }, "zipfian" },
+};
+
+// xorshift64* 随机数
+static uint64_t rng_next(uint64_t *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ull;
+}
+
+static double rng_double(uint64_t *s) {
+    return (rng_next(s) >> 11) * (1.0 / (1ull << 53));
+}
+
+static uint64_t fnv64(uint64_t v) {
+    uint64_t h = 14695981039346656037ull;
+    for (int i = 0; i < 8; i++) {
+        h = (h ^ (v & 0xff)) * 1099511628211ull;
+        v >>= 8;
+    }
+    return h;
+}
+
+// [0, n) 上的 Zipf 分布（Gray 等人的方法，与 YCSB 的 ZipfianGenerator 相同），0 最热
+struct zipf {
+    uint64_t n;
+    double zetan, alpha, eta, half_pow;
+};
+
+static void zipf_init(struct zipf *z, uint64_t n) {
+    double zeta2 = 1.0 + pow(0.5, ZIPF_THETA);
+    z->n = n;
+    z->zetan = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+        z->zetan += 1.0 / pow((double)i, ZIPF_THETA);
+    }
+    z->alpha = 1.0 / (1.0 - ZIPF_THETA);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - ZIPF_THETA)) / (1.0 - zeta2 / z->zetan);
+    z->half_pow = 1.0 + pow(0.5, ZIPF_THETA);
+}
+
+static uint64_t zipf_next(const struct zipf *z, uint64_t *rng) {
+    double u = rng_double(rng);
+    double uz = u * z->zetan;
+    if (uz < 1.0) return 0;
+    if (uz < z->half_pow) return 1;
+    uint64_t v = (uint64_t)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return v < z->n ? v : z->n - 1;
+}
+
+// 长度分布：固定、均匀或 Zipf（短的更常见）
+struct size_dist {
+    enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_ZIPF } kind;
+    size_t min, max;
+    struct zipf zipf;
+};
+
+static int parse_size(struct size_dist *d, const char *spec) {
+    const char *range = spec;
+    d->kind = SIZE_FIXED;
+    if (strncmp(spec, "uniform:", 8) == 0) {
+        d->kind = SIZE_UNIFORM;
+        range = spec + 8;
+    } else if (strncmp(spec, "zipf:", 5) == 0) {
+        d->kind = SIZE_ZIPF;
+        range = spec + 5;
+    }
+    char *end;
+    d->min = d->max = strtoul(range, &end, 10);
+    if (d->kind != SIZE_FIXED) {
+        if (*end != '-') return -1;
+        d->max = strtoul(end + 1, &end, 10);
+    }
+    if (*end != '\0' || d->min == 0 || d->max < d->min) return -1;
+    if (d->kind == SIZE_ZIPF) zipf_init(&d->zipf, d->max - d->min + 1);
+    return 0;
+}
+
+static size_t size_next(const struct size_dist *d, uint64_t *rng) {
+    switch (d->kind) {
+    case SIZE_UNIFORM: return d->min + rng_next(rng) % (d->max - d->min + 1);
+    case SIZE_ZIPF: return d->min + zipf_next(&d->zipf, rng);
+    default: return d->min;
+    }
+}
+
+// 延迟直方图（纳秒）：小于 16 的值各占一格，之后每个 2 的幂区间分 HIST_SUB 格
+struct hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+static void hist_add(struct hist *h, uint64_t v) {
+    size_t idx = v;
+    if (v >= HIST_SUB) {
+        int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+        idx = (size_t)(shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+    }
+    h->buckets[idx]++;
+    h->count++;
+    if (v > h->max) h->max = v;
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src) {
+    for (size_t i = 0; i < HIST_BUCKETS; i++) dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+// 分位数 q 所在格的上界（不超过最大值）
+static uint64_t hist_quantile(const struct hist *h, double q) {
+    uint64_t rank = (uint64_t)ceil(q * h->count), seen = 0;
+    if (rank == 0) rank = 1;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t upper = i + 1;
+            if (i >= HIST_SUB) {
+                int shift = i / HIST_SUB - 1;
+                upper = (uint64_t)(HIST_SUB + i % HIST_SUB + 1) << shift;
+            }
+            return upper - 1 < h->max ? upper - 1 : h->max;
+        }
+    }
+    return h->max;
+}
+
+static struct {
+    const struct workload *wl;
+    const char *dist;           // 选键的分布：uniform、zipfian 或 latest
+    struct size_dist key_size, value_size;
+    uint64_t records, ops;
+    int threads;
+    struct zipf zipf;
+    uint64_t inserted;          // 已插入的记录数，负载 D/E 的插入从 records 开始递增
+    struct kvdb_t db;
+    const char *values;         // 值的来源：一段以 '\0' 结尾的可打印字符，取它的后缀
+} bench;
+
+struct worker {
+    pthread_t thread;
+    uint64_t rng;
+    uint64_t begin, end;        // 装载阶段负责的记录编号
+    uint64_t ops;
+    uint64_t errors;
+    struct hist hist[OP_TYPES];
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 第 id 条记录的键：编号哈希的十六进制，长度由以 id 为种子的随机数决定，多出的部分补 '.'
+static void make_key(char *key, uint64_t id) {
+    uint64_t h = fnv64(id), seed = h | 1;
+    size_t len = size_next(&bench.key_size, &seed);
+    snprintf(key, KEY_MIN + 1, "%016llx", (unsigned long long)h);
+    memset(key + KEY_MIN, '.', len - KEY_MIN);
+    key[len] = '\0';
+}
+
+static const char *make_value(uint64_t *rng) {
+    return bench.values + bench.value_size.max - size_next(&bench.value_size, rng);
+}
+
+// 按负载的分布选一条已有的记录；zipfian 打散热点，latest 偏向最近插入的记录
+static uint64_t choose_key(uint64_t *rng) {
+    if (strcmp(bench.dist, "uniform") == 0) {
+        return rng_next(rng) % bench.records;
+    }
+    uint64_t rank = zipf_next(&bench.zipf, rng);
+    if (strcmp(bench.dist, "latest") == 0) {
+        uint64_t last = __atomic_load_n(&bench.inserted, __ATOMIC_RELAXED);
+        return rank < last ? last - 1 - rank : 0;
+    }
+    return fnv64(rank) % bench.records;
+}
+
+static enum op_type choose_op(uint64_t *rng) {
+    double u = rng_double(rng), sum = 0;
+    for (int t = 0; t < OP_TYPES; t++) {
+        sum += bench.wl->mix[t];
+        if (u < sum) return t;
+    }
+    return OP_READ;
+}
+
+static int do_op(struct worker *w, enum op_type op, char *key, char *buf, size_t length) {
+    switch (op) {
+    case OP_READ:
+        make_key(key, choose_key(&w->rng));
+        return kvdb_get(&bench.db, key, buf, length) < 0 ? -1 : 0;
+    case OP_UPDATE:
+        make_key(key, choose_key(&w->rng));
+        return kvdb_put(&bench.db, key, make_value(&w->rng));
+    case OP_INSERT:
+        make_key(key, __atomic_fetch_add(&bench.inserted, 1, __ATOMIC_RELAXED));
+        return kvdb_put(&bench.db, key, make_value(&w->rng));
+    case OP_SCAN: {
+        make_key(key, choose_key(&w->rng));
+        struct kvdb_iter *it = kvdb_iter_open(&bench.db, key, NULL);
+        if (!it) return -1;
+        int n = 1 + rng_next(&w->rng) % SCAN_MAX, rc = 1;
+        const char *k, *v;
+        size_t klen, vlen;
+        while (n-- > 0 && (rc = kvdb_iter_next(it, &k, &klen, &v, &vlen)) == 1);
+        kvdb_iter_close(it);
+        return rc < 0 ? -1 : 0;
+    }
+    case OP_RMW:
+        make_key(key, choose_key(&w->rng));
+        if (kvdb_get(&bench.db, key, buf, length) < 0) return -1;
+        return kvdb_put(&bench.db, key, make_value(&w->rng));
+    default:
+        return -1;
+    }
+}
+
+static void *load_worker(void *arg) {
+    struct worker *w = arg;
+    char key[bench.key_size.max + 1];
+    for (uint64_t id = w->begin; id < w->end; id++) {
+        make_key(key, id);
+        uint64_t start = now_ns();
+        if (kvdb_put(&bench.db, key, make_value(&w->rng)) < 0) w->errors++;
+        hist_add(&w->hist[OP_INSERT], now_ns() - start);
+    }
+    return NULL;
+}
+
+static void *run_worker(void *arg) {
+    struct worker *w = arg;
+    char key[bench.key_size.max + 1];
+    size_t length = bench.value_size.max + 1;
+    char *buf = malloc(length);
+    for (uint64_t i = 0; buf && i < w->ops; i++) {
+        enum op_type op = choose_op(&w->rng);
+        uint64_t start = now_ns();
+        if (do_op(w, op, key, buf, length) < 0) w->errors++;
+        hist_add(&w->hist[op], now_ns() - start);
+    }
+    free(buf);
+    return NULL;
+}
+
+// 运行一个阶段并输出一行 JSON
+static int run_phase(const char *phase, void *(*fn)(void *), struct worker *workers, const char *config) {
+    static struct kvdb_stats before, after;
+    kvdb_stats(&bench.db, &before);
+    uint64_t start = now_ns();
+    for (int i = 0; i < bench.threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, fn, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    for (int i = 0; i < bench.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double secs = (now_ns() - start) / 1e9;
+    kvdb_stats(&bench.db, &after);
+
+    static struct hist total[OP_TYPES];
+    uint64_t ops = 0, errors = 0;
+    memset(total, 0, sizeof(total));
+    for (int i = 0; i < bench.threads; i++) {
+        for (int t = 0; t < OP_TYPES; t++) hist_merge(&total[t], &workers[i].hist[t]);
+        errors += workers[i].errors;
+    }
+    for (int t = 0; t < OP_TYPES; t++) ops += total[t].count;
+
+    printf("{\"phase\":\"%s\",%s,\"ops\":%llu,\"errors\":%llu,\"seconds\":%.3f,\"ops_per_sec\":%.0f,\"latency_ns\":{",
+           phase, config, (unsigned long long)ops, (unsigned long long)errors, secs, ops / secs);
+    for (int t = 0, first = 1; t < OP_TYPES; t++) {
+        if (total[t].count == 0) continue;
+        printf("%s\"%s\":{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+               first ? "" : ",", op_names[t], (unsigned long long)total[t].count,
+               (unsigned long long)hist_quantile(&total[t], 0.50),
+               (unsigned long long)hist_quantile(&total[t], 0.99),
+               (unsigned long long)hist_quantile(&total[t], 0.999),
+               (unsigned long long)total[t].max);
+        first = 0;
+    }
+    // 引擎内部的提交统计：本阶段的增量，缓冲区高水位为打开以来的最大值
+    uint64_t syncs = after.syncs - before.syncs;
+    printf("},\"engine\":{\"flushes\":%llu,\"syncs\":%llu,\"sync_avg_ns\":%llu,"
+           "\"bytes_written\":%llu,\"buffer_high_water\":%llu,\"dead_bytes\":%llu}}\n",
+           (unsigned long long)(after.flushes - before.flushes), (unsigned long long)syncs,
+           (unsigned long long)(syncs ? (after.sync_ns - before.sync_ns) / syncs : 0),
+           (unsigned long long)(after.bytes_written - before.bytes_written),
+           (unsigned long long)after.buffer_high_water, (unsigned long long)after.dead_bytes);
+    fflush(stdout);
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -w a|b|c|d|e|f      YCSB workload (default a)\n"
+            "  -n RECORDS          records loaded before the run (default 100000)\n"
+            "  -o OPS              operations in the run phase (default 100000)\n"
+            "  -t THREADS          client threads (default 1)\n"
+            "  -r DIST             key choice: uniform|zipfian|latest (default: per workload)\n"
+            "  -k SIZE             key size, N|uniform:MIN-MAX|zipf:MIN-MAX, MIN >= %d (default 24)\n"
+            "  -v SIZE             value size, same format (default 100)\n"
+            "  -s batch|commit|interval|none  durability (default batch)\n"
+            "  -e log|lsm          storage engine (default log)\n"
+            "  -z                  LZ value compression\n"
+            "  -c BYTES            value cache size (default 0)\n"
+            "  -S SHARDS           sharded directory mode with SHARDS shards\n"
+            "  -p PATH             database path (default /tmp/kvdb_bench.db); removed first\n",
+            prog, KEY_MIN);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = "/tmp/kvdb_bench.db", *wl_name = "a", *durability = "batch", *engine = "log";
+    const char *key_spec = "24", *value_spec = "100";
+    struct kvdb_options opts = { 0 };
+    int sharded = 0, opt;
+    bench.records = bench.ops = 100000;
+    bench.threads = 1;
+    while ((opt = getopt(argc, argv, "w:n:o:t:r:k:v:s:e:zc:S:p:h")) != -1) {
+        switch (opt) {
+        case 'w': wl_name = optarg; break;
+        case 'n': bench.records = strtoull(optarg, NULL, 10); break;
+        case 'o': bench.ops = strtoull(optarg, NULL, 10); break;
+        case 't': bench.threads = atoi(optarg); break;
+        case 'r': bench.dist = optarg; break;
+        case 'k': key_spec = optarg; break;
+        case 'v': value_spec = optarg; break;
+        case 's': durability = optarg; break;
+        case 'e': engine = optarg; break;
+        case 'z': opts.compression = KVDB_COMPRESS_LZ; break;
+        case 'c': opts.cache_bytes = strtoull(optarg, NULL, 10); break;
+        case 'S': sharded = 1; opts.shards = atoi(optarg); break;
+        case 'p': path = optarg; break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (strlen(wl_name) == 1 && workloads[i].name == wl_name[0]) bench.wl = &workloads[i];
+    }
+    if (!bench.dist && bench.wl) bench.dist = bench.wl->dist;
+    if (!bench.wl || bench.records == 0 || bench.threads <= 0 || optind < argc ||
+        (strcmp(bench.dist, "uniform") && strcmp(bench.dist, "zipfian") && strcmp(bench.dist, "latest")) ||
+        parse_size(&bench.key_size, key_spec) < 0 || bench.key_size.min < KEY_MIN ||
+        parse_size(&bench.value_size, value_spec) < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (strcmp(durability, "batch") == 0) opts.durability = KVDB_SYNC_BATCH;
+    else if (strcmp(durability, "none") == 0) opts.durability = KVDB_SYNC_NONE;
+    else if (strcmp(durability, "interval") == 0) opts.durability = KVDB_SYNC_INTERVAL;
+    else if (strcmp(durability, "commit") == 0) opts.durability = KVDB_SYNC_COMMIT;
+    else { usage(argv[0]); return EXIT_FAILURE; }
+    if (strcmp(engine, "lsm") == 0) opts.engine = KVDB_ENGINE_LSM;
+    else if (strcmp(engine, "log") != 0) { usage(argv[0]); return EXIT_FAILURE; }
+
+    // 从空库开始：删除旧的文件或分片目录（LSM 引擎还有 path.sst.* 等文件）
+    char pattern[4096];
+    glob_t old;
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    snprintf(pattern, sizeof(pattern), "%s.sst.*", path);
+    if (glob(pattern, 0, NULL, &old) == 0) {
+        for (size_t i = 0; i < old.gl_pathc; i++) unlink(old.gl_pathv[i]);
+        globfree(&old);
+    }
+    if (sharded && mkdir(path, 0755) < 0) {
+        fprintf(stderr, "mkdir %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (kvdb_open_opts(&bench.db, path, &opts) < 0) {
+        fprintf(stderr, "kvdb_open_opts %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    char *values = malloc(bench.value_size.max + 1);
+    struct worker *workers = calloc(bench.threads, sizeof(struct worker));
+    if (!values || !workers) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < bench.value_size.max; i++) values[i] = 'a' + i * 7 % 26;
+    values[bench.value_size.max] = '\0';
+    bench.values = values;
+    zipf_init(&bench.zipf, bench.records);
+    bench.inserted = bench.records;
+
+    char config[512];
+    snprintf(config, sizeof(config),
+             "\"workload\":\"%c\",\"dist\":\"%s\",\"records\":%llu,\"threads\":%d,"
+             "\"key_size\":\"%s\",\"value_size\":\"%s\",\"durability\":\"%s\",\"engine\":\"%s\","
+             "\"compression\":%d,\"cache_bytes\":%zu,\"shards\":%u",
+             bench.wl->name, bench.dist, (unsigned long long)bench.records, bench.threads,
+             key_spec, value_spec, durability, engine, opts.compression == KVDB_COMPRESS_LZ,
+             opts.cache_bytes, sharded ? opts.shards : 0);
+
+    for (int i = 0; i < bench.threads; i++) {
+        workers[i].rng = fnv64(i + 1) | 1;
+        workers[i].begin = bench.records * i / bench.threads;
+        workers[i].end = bench.records * (i + 1) / bench.threads;
+        workers[i].ops = bench.ops * (i + 1) / bench.threads - bench.ops * i / bench.threads;
+    }
+    int ret = run_phase("load", load_worker, workers, config);
+    for (int i = 0; ret == 0 && i < bench.threads; i++) {
+        workers[i].errors = 0;
+        memset(workers[i].hist, 0, sizeof(workers[i].hist));
+    }
+    if (ret == 0) ret = run_phase("run", run_worker, workers, config);
+
+    if (kvdb_close(&bench.db) < 0) ret = -1;
+    free(workers);
+    free(values);
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
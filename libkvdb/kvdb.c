@@ -1,55 +1,316 @@
+#define _GNU_SOURCE
 #include "kvdb.h"
+#include "kvdb_lsm.h"
+#include "kvdb_lz.h"
+#include "kvdb_cache.h"
+#include "kvdb_uring.h"
+#include "kvdb_metrics.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
 
-// 键值对条目结构
-struct entry {
-    char *key;
-    char *value;
-    size_t key_len;
-    size_t value_len;
+// 日志格式：8 字节魔数，之后是记录 [crc][key_len][value_len][key][value]，
+// crc 是其后长度字段、键与值的 CRC32C。
+// key_len 的最高位表示值是压缩存储的：value 为 [原长度][压缩数据]，value_len 是压缩后的长度；
+// 次高位表示删除标记：键在此之后不存在，value_len 为 0
+#define LOG_MAGIC "KVDBLOG2"
+#define LOG_HDR_SIZE 8
+
+struct rec_hdr {
+    uint32_t crc;
+    uint32_t key_len;
+    uint32_t value_len;
 };
 
+#define REC_CRC_SIZE sizeof(uint32_t)
+#define REC_HDR_SIZE sizeof(struct rec_hdr)
+#define REC_SIZE(key_len, value_len) (REC_HDR_SIZE + (uint64_t)(key_len) + (value_len))
+#define REC_COMPRESSED 0x80000000u
+#define REC_TOMBSTONE 0x40000000u
+#define REC_FLAGS (REC_COMPRESSED | REC_TOMBSTONE)
+
+// 索引槽的 value_len 取此值时键已删除，offset 指向删除标记
+#define SLOT_DELETED UINT32_MAX
+
+// 旧格式（没有魔数与校验和）的记录头：[key_len][value_len]
+#define LEGACY_HDR_SIZE (2 * sizeof(uint32_t))
+
+#define INDEX_INIT_CAPACITY 1024
+#define MAP_MIN_SIZE (1 << 20)    // 映射区最小预留大小
+#define COPY_CHUNK_SIZE (1 << 20) // 压缩时每次写出的块大小
+#define LARGE_VALUE_SIZE (64 << 10) // 不小于 64KB 的值绕过缓冲区直接写入文件
+#define COMPRESS_MIN_SIZE 64      // 短于 64 字节的值不压缩
+#define PACK_STACK_SIZE 4096      // 不超过 4KB 的值在栈上压缩
+#define BATCH_PREFETCH 16         // 批量读取时提前预取的索引槽位数
+#define ITER_BATCH_SIZE (64 << 10) // 迭代器每批取出的结果大小
+#define ITER_CHUNK 32             // 迭代器每次查找并复制的键数
+#define ITER_COLD_BATCHES 8       // 复制时发生读盘缺页后，接下来这么多批都提前预读
+#define GROUP_COMMIT_SIZE 8192    // 一组提交攒够 8KB 即不再等待
+#define SYNC_INTERVAL_MS 100      // KVDB_SYNC_INTERVAL 的默认落盘间隔
+
+#define READER_STRIPES 64         // 读者计数的分片数
+
+#define SHARD_META "SHARDS"           // 分片目录中记录分片数的文件
+#define SHARD_MAX 256                 // 分片数上限
+
+#define AIO_DEFAULT_DEPTH 64       // 异步句柄默认同时进行的读请求数
 
+#define HISTORY_INIT_BUCKETS 256   // 旧版本表的初始桶数
+#define VIEW_LATEST UINT64_MAX        // 不通过快照读取时的可见范围：日志中的全部记录
+
+#define COMPACT_SUFFIX ".compact"     // 压缩时临时文件的后缀
+#define COMPACT_MIN_SIZE (1 << 20)    // 日志小于 1MB 时不自动压缩
+#define COMPACT_DEAD_PERCENT 50       // 失效字节超过日志长度的一半时自动压缩
+#define COMPACT_CATCHUP_SIZE (1 << 20) // 压缩追赶到新写入不多于 1MB 时持锁完成
+#define COMPACT_CATCHUP_ROUNDS 8      // 压缩在锁外追赶新写入的最多轮数
+
+// 精确写入辅助函数
+int kvdb_write_exact(int fd, const void *buf, size_t count, off_t offset) {
+    size_t written = 0;
+    const char *p = buf;
+    while (written < count) {
+        ssize_t n = pwrite(fd, p + written, count - written, offset + written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
 
-// 精确读取辅助函数
-static ssize_t read_exact(int fd, void *buf, size_t count) {
-    size_t bytes_read = 0;
-    char *p = buf;
-    while (bytes_read < count) {
-        ssize_t n = read(fd, p + bytes_read, count - bytes_read);
+// 精确写入 iov 描述的全部数据
+static int writev_exact(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+    while (iovcnt > 0) {
+        ssize_t n = pwritev(fd, iov, iovcnt, offset);
         if (n < 0) {
             if (errno == EINTR) continue;
             return -1;
         }
-        if (n == 0) break; // EOF
-        bytes_read += n;
+        offset += n;
+        // 跳过已写完的部分
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------------------
+// 无锁读：读者登记（类似 SRCU）
+//
+// 读者进入时按当前 epoch 的奇偶在自己线程所在的分片上计数，离开时减去；
+// 写者替换索引、映射或文件后调用 reader_sync：翻转 epoch 并等待旧奇偶的计数归零，
+// 翻转两次后，所有可能看到旧指针的读者都已离开，可以释放旧对象。
+// 读者从不在登记期间获取 db->lock，因此写者可以持锁等待。
+
+struct kvdb_reader {
+    long active[2];     // epoch 为偶数/奇数时进入的读者数
+} __attribute__((aligned(64)));
+
+static __thread unsigned reader_id = ~0u;
+static unsigned next_reader_id;
+
+static struct kvdb_reader *reader_stripe(struct kvdb_t *db) {
+    if (reader_id == ~0u) {
+        reader_id = __atomic_fetch_add(&next_reader_id, 1, __ATOMIC_RELAXED);
+    }
+    return &db->readers[reader_id % READER_STRIPES];
+}
+
+// 进入读者区间，返回离开时需要的奇偶
+static int reader_enter(struct kvdb_t *db) {
+    struct kvdb_reader *r = reader_stripe(db);
+    int idx = __atomic_load_n(&db->epoch, __ATOMIC_RELAXED) & 1;
+    __atomic_fetch_add(&r->active[idx], 1, __ATOMIC_RELAXED);
+    // 与 reader_sync 中的屏障配对：要么写者看到本次计数，要么本读者看到新指针
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return idx;
+}
+
+static void reader_exit(struct kvdb_t *db, int idx) {
+    __atomic_fetch_sub(&reader_stripe(db)->active[idx], 1, __ATOMIC_RELEASE);
+}
+
+// 等待替换前进入的读者全部离开（调用时持有 db->lock，新指针已经发布）
+static void reader_sync(struct kvdb_t *db) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int round = 0; round < 2; round++) {
+        int idx = __atomic_fetch_add(&db->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        for (;;) {
+            long active = 0;
+            for (int i = 0; i < READER_STRIPES; i++) {
+                active += __atomic_load_n(&db->readers[i].active[idx], __ATOMIC_ACQUIRE);
+            }
+            if (active == 0) break;
+            sched_yield();
+        }
+    }
+}
+
+// 读者看到的一致快照：记录偏移小于 file_end 时可以直接从 map 读取
+struct read_view {
+    const struct kvdb_index *index;
+    const char *map;
+    uint64_t file_end;
+    unsigned long generation;   // 这一组所属的日志文件
+};
+
+// 读取快照（在读者区间内调用）。写者先发布 map 再发布 file_end，
+// 所以先读 file_end 再读 map 时映射一定覆盖 file_end；压缩替换三者时用 generation 重试
+static void view_load(struct kvdb_t *db, struct read_view *v) {
+    for (;;) {
+        unsigned long gen = __atomic_load_n(&db->generation, __ATOMIC_ACQUIRE);
+        if (gen & 1) continue;
+        v->file_end = __atomic_load_n(&db->file_end, __ATOMIC_ACQUIRE);
+        v->map = __atomic_load_n(&db->map, __ATOMIC_ACQUIRE);
+        v->index = __atomic_load_n(&db->index, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&db->generation, __ATOMIC_RELAXED) == gen) {
+            v->generation = gen;
+            return;
+        }
+    }
+}
+
+// 发布新的日志文件长度（写者调用，此前 map 必须已覆盖 end）
+static void set_file_end(struct kvdb_t *db, uint64_t end) {
+    __atomic_store_n(&db->file_end, end, __ATOMIC_RELEASE);
+}
+
+// ------------------------------------------------------------------------
+// CRC32C（Castagnoli 多项式）：CPU 支持 SSE4.2 时用 crc32 指令，否则查表
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c >> 1) ^ (0x82f63b78 & -(c & 1));
+        }
+        crc32c_table[i] = c;
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init_table);
+    while (len--) {
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+// 在 crc 的基础上继续计算 data 的 CRC32C，crc 初值为 0
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_hw(crc, data, len);
+    }
+#endif
+    return ~crc32c_sw(crc, data, len);
+}
+
+// 能覆盖 size 字节日志的映射区大小
+static size_t map_capacity_for(uint64_t size) {
+    size_t capacity = MAP_MIN_SIZE;
+    while (capacity < size) capacity *= 2;
+    return capacity;
+}
+
+// 让映射覆盖 [0, end)：预留区域内文件增长无需重新映射，超出时建立更大的新映射，
+// 读者离开后再解除旧映射（不用 mremap，正在读旧映射的读者不受影响）
+struct kvdb_retired_map {
+    char *map;
+    size_t capacity;
+    struct kvdb_retired_map *next;
+};
+
+// 解除被替换的映射（读者已经离开）；还有未释放的引用时推迟到最后一个引用释放
+// （调用时持有 db->lock）
+static void map_retire(struct kvdb_t *db, char *map, size_t capacity) {
+    if (db->refs == 0) {
+        munmap(map, capacity);
+        return;
+    }
+    struct kvdb_retired_map *r = malloc(sizeof(struct kvdb_retired_map));
+    if (!r) {
+        return; // 内存不足时宁可不解除，引用仍然有效
+    }
+    r->map = map;
+    r->capacity = capacity;
+    r->next = db->retired;
+    db->retired = r;
+}
+
+static void map_retired_free(struct kvdb_t *db) {
+    while (db->retired) {
+        struct kvdb_retired_map *r = db->retired;
+        db->retired = r->next;
+        munmap(r->map, r->capacity);
+        free(r);
     }
-    return bytes_read;
 }
 
-// 刷新缓冲区到磁盘
-static int flush_buffer(struct kvdb_t *db) {
-    if (db->buffer.size == 0) {
-        return 0; // 空缓冲区无需刷新
+static int map_extend(struct kvdb_t *db, uint64_t end) {
+    if (end <= db->map_capacity) {
+        return 0;
     }
-    
-    // 写入数据
-    ssize_t written = write(db->fd, db->buffer.data, db->buffer.size);
-    if (written != (ssize_t)db->buffer.size) {
+
+    size_t capacity = map_capacity_for(end);
+    char *map = mmap(NULL, capacity, PROT_READ, MAP_SHARED, db->fd, 0);
+    if (map == MAP_FAILED) {
         return -1;
     }
-    
-    // 重置缓冲区
-    db->buffer.size = 0;
-    
-    // 数据落盘
-    return fdatasync(db->fd);
+
+    char *old_map = db->map;
+    size_t old_capacity = db->map_capacity;
+    __atomic_store_n(&db->map, map, __ATOMIC_RELEASE);
+    db->map_capacity = capacity;
+    if (old_map) {
+        reader_sync(db);
+        map_retire(db, old_map, old_capacity);
+    }
+    return 0;
 }
 
 // 扩展缓冲区
@@ -58,200 +319,3157 @@ static int expand_buffer(struct write_buffer *buf, size_t min_capacity) {
     if (new_capacity < min_capacity) {
         new_capacity = min_capacity;
     }
-    
+
     char *new_data = realloc(buf->data, new_capacity);
     if (!new_data) {
         return -1;
     }
-    
+
     buf->data = new_data;
     buf->capacity = new_capacity;
     return 0;
 }
 
-// 追加数据到缓冲区
-static int append_to_buffer(struct write_buffer *buf, const void *data, size_t len) {
-    size_t needed = buf->size + len;
-    if (needed > buf->capacity) {
-        if (expand_buffer(buf, needed) < 0) {
-            return -1;
-        }
+// 追加一条记录；空间预先分配，追加本身不会失败
+static int reserve_record(struct write_buffer *buf, size_t rec_size) {
+    if (buf->size + rec_size > buf->capacity) {
+        return expand_buffer(buf, buf->size + rec_size);
     }
-    
-    memcpy(buf->data + buf->size, data, len);
-    buf->size += len;
     return 0;
 }
 
-int kvdb_open(struct kvdb_t *db, const char *path) {
-    // 初始化缓冲区
-    memset(&db->buffer, 0, sizeof(db->buffer));
-    
-    // 打开数据库文件
-    int fd = open(path, O_RDWR | O_CREAT, 0666);
-    if (fd < 0) return -1;
-    
-    // 复制路径字符串
-    char *path_copy = strdup(path);
-    if (!path_copy) {
-        close(fd);
+int kvdb_buffer_append(struct write_buffer *buf, const void *data, size_t len) {
+    if (reserve_record(buf, len) < 0) {
         return -1;
     }
-    
-    db->fd = fd;
-    db->path = path_copy;
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
     return 0;
 }
 
-int kvdb_put(struct kvdb_t *db, const char *key, const char *value) {
-    // 获取键值长度
-    uint32_t key_len = strlen(key);
-    uint32_t value_len = strlen(value);
-    
-    // 检查缓冲区是否有足够空间
-    size_t total_size = sizeof(key_len) + sizeof(value_len) + key_len + value_len;
-    
-    // 如果超过阈值或空间不足，刷新缓冲区
-    if (db->buffer.size + total_size > db->buffer.capacity || 
-        db->buffer.size > 8192) { // 8KB刷新阈值
-        if (flush_buffer(db) < 0) {
+// flags 是 key_len 中的标志位（REC_COMPRESSED、REC_TOMBSTONE）
+static void append_record(struct write_buffer *buf, const char *key, uint32_t key_len,
+                          const char *value, uint32_t value_len, uint32_t flags) {
+    // 空间已预留，直接写入，不再逐段检查容量；校验和在复制完成后计算
+    char *p = buf->data + buf->size;
+    uint64_t rec_size = REC_SIZE(key_len, value_len);
+    struct rec_hdr hdr = { 0, key_len | flags, value_len };
+    memcpy(p, &hdr, REC_HDR_SIZE);
+    memcpy(p + REC_HDR_SIZE, key, key_len);
+    memcpy(p + REC_HDR_SIZE + key_len, value, value_len);
+    hdr.crc = crc32c(0, p + REC_CRC_SIZE, rec_size - REC_CRC_SIZE);
+    memcpy(p, &hdr.crc, REC_CRC_SIZE);
+    buf->size += rec_size;
+}
+
+// 读取记录头，返回值是否压缩存储（标志位从 key_len 中去掉）
+static int read_hdr(const char *rec, struct rec_hdr *hdr) {
+    memcpy(hdr, rec, REC_HDR_SIZE);
+    int compressed = (hdr->key_len & REC_COMPRESSED) != 0;
+    hdr->key_len &= ~REC_FLAGS;
+    return compressed;
+}
+
+// 记录是否是删除标记
+static int rec_tombstone(const char *rec) {
+    uint32_t key_len;
+    memcpy(&key_len, rec + REC_CRC_SIZE, sizeof(key_len));
+    return (key_len & REC_TOMBSTONE) != 0;
+}
+
+// 记录中值的实际长度
+static uint32_t rec_value_len(const char *rec) {
+    struct rec_hdr hdr;
+    if (!read_hdr(rec, &hdr)) {
+        return hdr.value_len;
+    }
+    uint32_t raw_len;
+    memcpy(&raw_len, rec + REC_HDR_SIZE + hdr.key_len, sizeof(raw_len));
+    return raw_len;
+}
+
+// 把记录中的值复制到 buf（压缩的值边解压边复制），最多 length 字节，返回值的实际长度
+static uint32_t rec_read_value(const char *rec, void *buf, size_t length) {
+    struct rec_hdr hdr;
+    int compressed = read_hdr(rec, &hdr);
+    const char *value = rec + REC_HDR_SIZE + hdr.key_len;
+    uint32_t value_len = hdr.value_len;
+    if (compressed) {
+        memcpy(&value_len, value, sizeof(value_len));
+    }
+    if (length > value_len) {
+        length = value_len;
+    }
+    if (length == 0) {
+        return value_len;
+    }
+    if (compressed) {
+        // 记录写入时由本进程生成或在打开时通过了校验，解压不会失败
+        kvdb_lz_decompress(value + sizeof(uint32_t), hdr.value_len - sizeof(uint32_t), buf, length);
+    } else {
+        memcpy(buf, value, length);
+    }
+    return value_len;
+}
+
+// 把值压缩为 [原长度][压缩数据] 存入 out（容量为 value_len）；能省下至少 1/8 时返回结果长度，否则返回 0
+static uint32_t compress_value(const char *value, uint32_t value_len, char *out) {
+    size_t cap = value_len - value_len / 8;
+    size_t n = kvdb_lz_compress(value, value_len, out + sizeof(uint32_t), cap - sizeof(uint32_t));
+    if (n == 0) {
+        return 0;
+    }
+    memcpy(out, &value_len, sizeof(value_len));
+    return n + sizeof(uint32_t);
+}
+
+// 日志的逻辑长度：文件 + 正在提交的一组 + 缓冲区
+static uint64_t log_end(struct kvdb_t *db) {
+    return db->file_end + db->flushing.size + db->buffer.size;
+}
+
+// 日志中 offset 处的数据：已写入文件的部分位于映射区，其余位于提交中的组或缓冲区
+static const char *log_ptr(struct kvdb_t *db, uint64_t offset) {
+    if (offset < db->file_end) {
+        return db->map + offset;
+    }
+    offset -= db->file_end;
+    if (offset < db->flushing.size) {
+        return db->flushing.data + offset;
+    }
+    return db->buffer.data + (offset - db->flushing.size);
+}
+
+// 当前时间之后 us 微秒的单调时钟时刻
+static struct timespec deadline_after(uint64_t us) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += us / 1000000;
+    deadline.tv_nsec += (long)(us % 1000000) * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    return deadline;
+}
+
+// 记录一次从 start 开始的写入并落盘（wal 没有统计）
+static void metrics_sync(struct kvdb_t *db, uint64_t start) {
+    struct kvdb_metrics *m = db->metrics;
+    if (!m) return;
+    uint64_t ns = kvdb_metrics_now() - start;
+    __atomic_fetch_add(&m->syncs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->sync_ns, ns, __ATOMIC_RELAXED);
+    kvdb_metrics_record(&m->sync_latency, ns);
+}
+
+// 记录 n 次读取，共返回 bytes 字节的值
+static void metrics_get(struct kvdb_t *db, uint64_t n, uint64_t bytes) {
+    struct metrics_stripe *stripe = kvdb_metrics_stripe(db->metrics);
+    __atomic_fetch_add(&stripe->gets, n, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stripe->bytes_read, bytes, __ATOMIC_RELAXED);
+}
+
+// flushing 中的一组已写出（rc 为写入与落盘的结果）：发布新的文件长度并唤醒本组所有等待者
+// （调用时持有 db->lock）
+static int commit_finish(struct kvdb_t *db, int rc, int sync) {
+    uint64_t size = db->flushing.size;
+    if (rc == 0) {
+        rc = map_extend(db, db->file_end + size);
+    }
+    if (rc == 0 && db->metrics) {
+        struct kvdb_metrics *m = db->metrics;
+        __atomic_fetch_add(&m->bytes_written, size, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&m->flushes, 1, __ATOMIC_RELAXED);
+        if (size > m->buffer_high_water) {
+            __atomic_store_n(&m->buffer_high_water, size, __ATOMIC_RELAXED);
+        }
+    }
+    if (rc == 0) {
+        set_file_end(db, db->file_end + size);
+        db->flushing.size = 0;
+        if (sync) {
+            db->synced_end = db->file_end;
+        }
+    }
+    if (rc < 0) {
+        // 本组保留在 flushing 中供读取，之后的写操作都返回错误
+        db->io_error = errno ? errno : EIO;
+    }
+
+    db->committing = 0;
+    pthread_cond_broadcast(&db->commit_cond);
+    return rc;
+}
+
+// 作为 leader 把缓冲区中的一组记录写入文件，sync 时再落盘（调用时持有 db->lock）
+static int commit_group(struct kvdb_t *db, int sync) {
+    db->committing = 1;
+
+    // 最多等待 commit_latency_us，让更多 put 加入本组
+    if (sync && db->opts.commit_latency_us > 0 && db->buffer.size < GROUP_COMMIT_SIZE) {
+        struct timespec deadline = deadline_after(db->opts.commit_latency_us);
+        while (db->buffer.size < GROUP_COMMIT_SIZE &&
+               pthread_cond_timedwait(&db->group_cond, &db->lock, &deadline) != ETIMEDOUT)
+            ;
+    }
+
+    // 交换缓冲区：leader 在锁外写出本组，其他线程继续向新的 buffer 追加
+    struct write_buffer group = db->buffer;
+    db->buffer = db->flushing;
+    db->flushing = group;
+
+    pthread_mutex_unlock(&db->lock);
+    uint64_t start = kvdb_metrics_now();
+    int rc = kvdb_write_exact(db->fd, group.data, group.size, db->file_end);
+    if (rc == 0 && sync) {
+        rc = fdatasync(db->fd);
+        metrics_sync(db, start);
+    }
+    pthread_mutex_lock(&db->lock);
+    return commit_finish(db, rc, sync);
+}
+
+// 等待日志 [0, end) 写入文件（sync 时还要落盘）；没有 leader 时自己成为 leader
+// （调用时持有 db->lock）
+static int commit_wait(struct kvdb_t *db, uint64_t end, int sync) {
+    while ((sync ? db->synced_end : db->file_end) < end) {
+        if (db->io_error) {
+            errno = db->io_error;
+            return -1;
+        }
+        if (db->committing) {
+            pthread_cond_wait(&db->commit_cond, &db->lock);
+        } else if (commit_group(db, sync) < 0) {
             return -1;
         }
     }
-    
-    // 追加数据到缓冲区
-    if (append_to_buffer(&db->buffer, &key_len, sizeof(key_len)) ||
-        append_to_buffer(&db->buffer, &value_len, sizeof(value_len)) ||
-        append_to_buffer(&db->buffer, key, key_len) ||
-        append_to_buffer(&db->buffer, value, value_len)) {
-        return -1;
+    return 0;
+}
+
+// 等待所有已追加的记录写入文件，且没有正在进行的提交（调用时持有 db->lock）
+static int commit_all(struct kvdb_t *db, int sync) {
+    while (db->committing || (sync ? db->synced_end : db->file_end) < log_end(db)) {
+        if (db->io_error) {
+            errno = db->io_error;
+            return -1;
+        }
+        if (db->committing) {
+            pthread_cond_wait(&db->commit_cond, &db->lock);
+        } else if (commit_group(db, sync) < 0) {
+            return -1;
+        }
     }
-    
     return 0;
 }
 
-int kvdb_flush(struct kvdb_t *db) {
-    return flush_buffer(db);
+// KVDB_SYNC_INTERVAL 的后台线程：每隔 sync_interval_ms 把缓冲区写入并落盘
+static void *sync_thread(void *arg) {
+    struct kvdb_t *db = arg;
+    pthread_mutex_lock(&db->lock);
+    while (!db->closing) {
+        struct timespec deadline = deadline_after((uint64_t)db->opts.sync_interval_ms * 1000);
+        while (!db->closing &&
+               pthread_cond_timedwait(&db->sync_cond, &db->lock, &deadline) != ETIMEDOUT)
+            ;
+        if (!db->closing && !db->io_error) {
+            commit_wait(db, log_end(db), 1);
+        }
+    }
+    pthread_mutex_unlock(&db->lock);
+    return NULL;
 }
 
-int kvdb_get(struct kvdb_t *db, const char *key, char *buf, size_t length) {
-    // 首先刷新缓冲区确保最新数据可见
-    if (flush_buffer(db) < 0) {
-        return -1;
+// 64 位键哈希（每次处理 8 字节），保证结果非 0
+uint64_t kvdb_hash(const void *key, size_t len) {
+    const unsigned char *p = key;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * 0xff51afd7ed558ccdULL);
+    while (len >= 8) {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        h = (h ^ (k * 0xc4ceb9fe1a85ec53ULL)) * 0x100000001b3ULL;
+        h ^= h >> 29;
+        p += 8;
+        len -= 8;
     }
-    
-    // 定位到文件头
-    if (lseek(db->fd, 0, SEEK_SET) < 0) {
-        return -1;
+    uint64_t tail = 0;
+    memcpy(&tail, p, len);
+    h = (h ^ (tail * 0xc4ceb9fe1a85ec53ULL)) * 0x100000001b3ULL;
+    h ^= h >> 32;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+// ------------------------------------------------------------------------
+// 跳表（有序索引与 LSM 引擎的内存表共用）
+
+struct kvdb_skipnode *kvdb_skipnode_new(int height, const char *key, uint32_t key_len,
+                                        const void *value, uint32_t value_len) {
+    size_t size = sizeof(struct kvdb_skipnode) + height * sizeof(struct kvdb_skipnode *);
+    struct kvdb_skipnode *node = malloc(size + value_len + key_len);
+    if (!node) return NULL;
+    node->key_len = key_len;
+    node->value_len = value_len;
+    node->height = height;
+    memset(node->next, 0, height * sizeof(struct kvdb_skipnode *));
+    memcpy((char *)node + size, value, value_len);
+    memcpy((char *)node + size + value_len, key, key_len);
+    return node;
+}
+
+int kvdb_skiplist_init(struct kvdb_skiplist *list) {
+    list->head = kvdb_skipnode_new(KVDB_SKIPLIST_HEIGHT, "", 0, "", 0);
+    list->rand = 0x2545f4914f6cdd1dULL ^ (uintptr_t)list;
+    return list->head ? 0 : -1;
+}
+
+void kvdb_skiplist_destroy(struct kvdb_skiplist *list) {
+    struct kvdb_skipnode *node = list->head;
+    while (node) {
+        struct kvdb_skipnode *next = node->next[0];
+        free(node);
+        node = next;
     }
-    
-    struct entry *entries = NULL;
-    size_t num_entries = 0;
-    ssize_t ret = -1;
-    
-    // 读取并解析所有记录
-    while (1) {
-        uint32_t key_len, value_len;
-        
-        // 读取键长
-        if (read_exact(db->fd, &key_len, sizeof(key_len)) != sizeof(key_len)) 
-            break;
-        
-        // 读取值长
-        if (read_exact(db->fd, &value_len, sizeof(value_len)) != sizeof(value_len)) 
-            break;
-        
-        // 分配键缓冲区
-        char *key_buf = malloc(key_len + 1);
-        if (!key_buf) break;
-        
-        // 读取键
-        if (read_exact(db->fd, key_buf, key_len) != key_len) {
-            free(key_buf);
-            break;
+    list->head = NULL;
+}
+
+int kvdb_skiplist_height(struct kvdb_skiplist *list) {
+    int height = 1;
+    while (height < KVDB_SKIPLIST_HEIGHT) {
+        list->rand ^= list->rand << 13;
+        list->rand ^= list->rand >> 7;
+        list->rand ^= list->rand << 17;
+        if (list->rand & 3) break;
+        height++;
+    }
+    return height;
+}
+
+struct kvdb_skipnode *kvdb_skiplist_seek(const struct kvdb_skiplist *list, const char *key,
+                                         uint32_t key_len, struct kvdb_skipnode **prev) {
+    struct kvdb_skipnode *x = list->head;
+    for (int level = KVDB_SKIPLIST_HEIGHT - 1; level >= 0; level--) {
+        struct kvdb_skipnode *next;
+        while ((next = kvdb_skipnode_next(x, level)) &&
+               kvdb_key_compare(kvdb_skipnode_key(next), next->key_len, key, key_len) < 0) {
+            x = next;
         }
-        key_buf[key_len] = '\0';
-        
-        // 分配值缓冲区
-        char *value_buf = malloc(value_len + 1);
-        if (!value_buf) {
-            free(key_buf);
-            break;
+        if (prev) prev[level] = x;
+    }
+    return kvdb_skipnode_next(x, 0);
+}
+
+struct kvdb_skipnode *kvdb_skiplist_put(struct kvdb_skiplist *list, const char *key, uint32_t key_len,
+                                        const void *value, uint32_t value_len,
+                                        struct kvdb_skipnode **old) {
+    struct kvdb_skipnode *prev[KVDB_SKIPLIST_HEIGHT];
+    struct kvdb_skipnode *x = kvdb_skiplist_seek(list, key, key_len, prev);
+    *old = x && kvdb_key_compare(kvdb_skipnode_key(x), x->key_len, key, key_len) == 0 ? x : NULL;
+    int height = *old ? (*old)->height : kvdb_skiplist_height(list);
+    struct kvdb_skipnode *node = kvdb_skipnode_new(height, key, key_len, value, value_len);
+    if (!node) {
+        *old = NULL;
+        return NULL;
+    }
+    for (int i = 0; i < height; i++) {
+        node->next[i] = *old ? (*old)->next[i] : prev[i]->next[i];
+    }
+    // 自底向上发布：读者在某一层看到新节点时，它在下层已经可达
+    for (int i = 0; i < height; i++) {
+        __atomic_store_n(&prev[i]->next[i], node, __ATOMIC_RELEASE);
+    }
+    return node;
+}
+
+// ------------------------------------------------------------------------
+// 有序索引：保存键副本的跳表，供按键的顺序遍历使用。
+// 节点不记录位置，值通过其中的哈希在哈希索引中查找，所以压缩不需要修改跳表。
+// 只有写者（持有 db->lock）插入节点：先写好节点再自底向上原子地链入，读者无锁遍历
+
+struct kvdb_order {
+    struct kvdb_skiplist list; // 节点附带的数据是键的哈希值
+};
+
+// 有序索引节点中键的哈希值
+static uint64_t order_hash(const struct kvdb_skipnode *node) {
+    uint64_t hash;
+    memcpy(&hash, kvdb_skipnode_value(node), sizeof(hash));
+    return hash;
+}
+
+static void order_free(struct kvdb_order *order) {
+    if (!order) return;
+    kvdb_skiplist_destroy(&order->list);
+    free(order);
+}
+
+// 插入一个新键（调用时持有 db->lock，键还不在跳表中）
+static int order_insert(struct kvdb_order *order, const char *key, uint32_t key_len,
+                        uint64_t hash) {
+    struct kvdb_skipnode *old;
+    return kvdb_skiplist_put(&order->list, key, key_len, &hash, sizeof(hash), &old) ? 0 : -1;
+}
+
+static int cmp_slot_key(const void *a, const void *b, void *arg) {
+    struct kvdb_t *db = arg;
+    const struct kvdb_slot *x = *(struct kvdb_slot *const *)a;
+    const struct kvdb_slot *y = *(struct kvdb_slot *const *)b;
+    return kvdb_key_compare(log_ptr(db, x->offset + REC_HDR_SIZE), x->key_len,
+                       log_ptr(db, y->offset + REC_HDR_SIZE), y->key_len);
+}
+
+// 由哈希索引建立有序索引：键排序后从小到大接到每层的末尾，不必逐个查找插入位置
+// （调用时持有 db->lock）
+static int order_build(struct kvdb_t *db) {
+    struct kvdb_index *idx = db->index;
+    struct kvdb_order *order = calloc(1, sizeof(struct kvdb_order));
+    struct kvdb_slot **sorted = malloc((idx->count + 1) * sizeof(struct kvdb_slot *));
+    if (!order || !sorted || kvdb_skiplist_init(&order->list) < 0) {
+        goto fail;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < idx->capacity; i++) {
+        if (idx->slots[i].hash != 0) sorted[n++] = &idx->slots[i];
+    }
+    qsort_r(sorted, n, sizeof(sorted[0]), cmp_slot_key, db);
+
+    struct kvdb_skipnode *tail[KVDB_SKIPLIST_HEIGHT];
+    for (int level = 0; level < KVDB_SKIPLIST_HEIGHT; level++) {
+        tail[level] = order->list.head;
+    }
+    for (size_t i = 0; i < n; i++) {
+        struct kvdb_slot *slot = sorted[i];
+        struct kvdb_skipnode *node = kvdb_skipnode_new(kvdb_skiplist_height(&order->list),
+                                                       log_ptr(db, slot->offset + REC_HDR_SIZE),
+                                                       slot->key_len, &slot->hash, sizeof(slot->hash));
+        if (!node) goto fail;
+        for (int level = 0; level < node->height; level++) {
+            tail[level]->next[level] = node;
+            tail[level] = node;
         }
-        
-        // 读取值
-        if (read_exact(db->fd, value_buf, value_len) != value_len) {
-            free(key_buf);
-            free(value_buf);
-            break;
+    }
+    free(sorted);
+    __atomic_store_n(&db->order, order, __ATOMIC_RELEASE);
+    return 0;
+
+fail:
+    free(sorted);
+    order_free(order);
+    return -1;
+}
+
+// 维护失败（内存不足）时丢弃有序索引，下次打开迭代器时重建（调用时持有 db->lock）
+static void order_drop(struct kvdb_t *db) {
+    struct kvdb_order *order = db->order;
+    __atomic_store_n(&db->order, NULL, __ATOMIC_RELEASE);
+    reader_sync(db);
+    order_free(order);
+}
+
+// 判断槽中记录的键是否等于 key（键本身不在索引中，直接与日志中的键比较）
+static int slot_key_equals(struct kvdb_t *db, const struct kvdb_slot *slot,
+                           const char *key, uint32_t key_len) {
+    return slot->key_len == key_len &&
+           memcmp(log_ptr(db, slot->offset + REC_HDR_SIZE), key, key_len) == 0;
+}
+
+// 查找键对应的槽：找到返回该槽，否则返回可插入的空槽
+static struct kvdb_slot *index_probe(struct kvdb_t *db, uint64_t hash,
+                                     const char *key, uint32_t key_len) {
+    struct kvdb_index *idx = db->index;
+    size_t mask = idx->capacity - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct kvdb_slot *slot = &idx->slots[i];
+        if (slot->hash == 0) return slot;
+        if (slot->hash == hash && slot_key_equals(db, slot, key, key_len)) {
+            return slot;
         }
-        value_buf[value_len] = '\0';
-        
-        // 更新或添加条目
-        int found = 0;
-        for (size_t i = 0; i < num_entries; i++) {
-            if (strcmp(entries[i].key, key_buf) == 0) {
-                free(entries[i].value);
-                entries[i].value = value_buf;
-                entries[i].value_len = value_len;
-                found = 1;
-                free(key_buf);
-                break;
-            }
+    }
+}
+
+// 查找键的最新记录，不存在或已删除返回 NULL
+static struct kvdb_slot *lookup(struct kvdb_t *db, const char *key, size_t key_len) {
+    struct kvdb_slot *slot = index_probe(db, kvdb_hash(key, key_len), key, key_len);
+    return slot->hash && slot->value_len != SLOT_DELETED ? slot : NULL;
+}
+
+// 能以 0.7 以下的负载因子容纳 count 个键的槽数
+static size_t index_capacity_for(size_t count) {
+    size_t capacity = INDEX_INIT_CAPACITY;
+    while ((count + 1) * 10 > capacity * 7) capacity *= 2;
+    return capacity;
+}
+
+static struct kvdb_index *index_new(size_t capacity) {
+    struct kvdb_index *idx = calloc(1, sizeof(struct kvdb_index) + capacity * sizeof(struct kvdb_slot));
+    if (idx) idx->capacity = capacity;
+    return idx;
+}
+
+// 放入一个槽（不需要比较键：调用者保证表中没有这个键）
+static void index_place(struct kvdb_index *idx, const struct kvdb_slot *slot) {
+    size_t mask = idx->capacity - 1;
+    size_t j = slot->hash & mask;
+    while (idx->slots[j].hash != 0) j = (j + 1) & mask;
+    idx->slots[j] = *slot;
+    idx->count++;
+}
+
+// 以 new_capacity 个槽重新散列，同时丢弃已删除的键（旧表中的键互不相同）；
+// 新表填好后整体发布，读者离开后释放旧表
+static int index_rebuild(struct kvdb_t *db, size_t new_capacity) {
+    struct kvdb_index *idx = db->index;
+    struct kvdb_index *new_idx = index_new(new_capacity);
+    if (!new_idx) return -1;
+    for (size_t i = 0; idx && i < idx->capacity; i++) {
+        struct kvdb_slot *slot = &idx->slots[i];
+        if (slot->hash != 0 && slot->value_len != SLOT_DELETED) {
+            index_place(new_idx, slot);
         }
-        
-        if (!found) {
-            struct entry *new_entries = realloc(entries, (num_entries + 1) * sizeof(struct entry));
-            if (!new_entries) {
-                free(key_buf);
-                free(value_buf);
-                break;
-            }
-            entries = new_entries;
-            entries[num_entries].key = key_buf;
-            entries[num_entries].value = value_buf;
-            entries[num_entries].key_len = key_len;
-            entries[num_entries].value_len = value_len;
-            num_entries++;
-        }
-    }
-    
-    // 查找目标键
-    for (size_t i = 0; i < num_entries; i++) {
-        if (strcmp(entries[i].key, key) == 0) {
-            size_t to_copy = entries[i].value_len;
-            if (to_copy > length - 1) 
-                to_copy = length - 1;
-            memcpy(buf, entries[i].value, to_copy);
-            buf[to_copy] = '\0';
-            ret = to_copy;
-            break;
+    }
+
+    __atomic_store_n(&db->index, new_idx, __ATOMIC_RELEASE);
+    if (idx) {
+        reader_sync(db);
+        // 有序索引里还留着被丢弃的键，它们再次写入时会重复插入：丢弃，下次打开迭代器时重建
+        if (idx->deleted > 0 && db->order) {
+            order_drop(db);
         }
+        free(idx);
     }
-    
-    // 清理资源
-    for (size_t i = 0; i < num_entries; i++) {
-        free(entries[i].key);
-        free(entries[i].value);
+    return 0;
+}
+
+// 保证还能再插入一个键：负载因子保持在 0.7 以下。
+// 至少一半的槽属于已删除的键时按原容量重建，只丢弃它们而不扩容
+static int index_reserve(struct kvdb_t *db) {
+    struct kvdb_index *idx = db->index;
+    if ((idx->count + 1) * 10 > idx->capacity * 7) {
+        return index_rebuild(db, idx->deleted * 2 >= idx->count ? idx->capacity : idx->capacity * 2);
     }
-    free(entries);
-    
-    return ret;
+    return 0;
 }
 
-int kvdb_close(struct kvdb_t *db) {
-    // 刷新剩余数据
-    flush_buffer(db);
-    
-    // 释放缓冲区
-    free(db->buffer.data);
-    
-    // 释放路径字符串
-    free(db->path);
-    db->path = NULL;
-    
-    // 关闭文件
-    if (close(db->fd) < 0) 
+// ------------------------------------------------------------------------
+// 快照：记下创建时的日志长度 end，偏移小于 end 的记录对它可见。日志只追加，
+// 所以键在快照中的版本是偏移小于 end 的最新一条记录。索引只记录最新版本，
+// 存在快照时写者把被覆盖、但仍对某个快照可见的旧版本记入 history（都在 db->lock 下进行）
+
+struct kvdb_snapshot {
+    struct kvdb_t *db;
+    uint64_t end;               // 创建时的日志长度（含缓冲区）
+    struct kvdb_snapshot *prev, *next; // db->snapshots 链表
+    struct kvdb_snapshot *subs; // 分片模式：每个分片一个快照
+    unsigned nsubs;
+};
+
+// 一个被覆盖的旧版本：对 end 落在 (offset, replaced] 内的快照可见
+struct history_entry {
+    uint64_t hash;
+    uint64_t offset;            // 旧版本的记录偏移
+    uint64_t replaced;          // 覆盖它的新版本的记录偏移
+    struct history_entry *next;
+};
+
+struct kvdb_history {
+    size_t nbuckets;            // 总是 2 的幂
+    size_t count;
+    struct history_entry *spare; // 预先分配的一项，保证接下来的一次覆盖不会因内存不足失败
+    struct history_entry **buckets;
+};
+
+static void history_free(struct kvdb_history *h) {
+    if (!h) return;
+    for (size_t i = 0; i < h->nbuckets; i++) {
+        struct history_entry *e = h->buckets[i];
+        while (e) {
+            struct history_entry *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(h->spare);
+    free(h->buckets);
+    free(h);
+}
+
+// 存在快照时保证下一次覆盖能记下旧版本（调用时持有 db->lock）
+static int history_reserve(struct kvdb_t *db) {
+    if (!db->snapshots) {
+        return 0;
+    }
+    struct kvdb_history *h = db->history;
+    if (!h) {
+        h = calloc(1, sizeof(struct kvdb_history));
+        if (!h || !(h->buckets = calloc(HISTORY_INIT_BUCKETS, sizeof(struct history_entry *)))) {
+            free(h);
+            return -1;
+        }
+        h->nbuckets = HISTORY_INIT_BUCKETS;
+        db->history = h;
+    }
+    if (!h->spare && !(h->spare = malloc(sizeof(struct history_entry)))) {
         return -1;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+// 项数超过桶数时桶数翻倍；失败时保持原样，只是链变长
+static void history_grow(struct kvdb_history *h) {
+    size_t nbuckets = 2 * h->nbuckets;
+    struct history_entry **buckets = calloc(nbuckets, sizeof(struct history_entry *));
+    if (!buckets) return;
+    for (size_t i = 0; i < h->nbuckets; i++) {
+        struct history_entry *e = h->buckets[i];
+        while (e) {
+            struct history_entry *next = e->next;
+            e->next = buckets[e->hash & (nbuckets - 1)];
+            buckets[e->hash & (nbuckets - 1)] = e;
+            e = next;
+        }
+    }
+    free(h->buckets);
+    h->buckets = buckets;
+    h->nbuckets = nbuckets;
+}
+
+// 位于 offset 的旧版本被 replaced 覆盖；最新的快照也看不到它时不必记录
+// （调用时持有 db->lock，history_reserve 已成功）
+static void history_add(struct kvdb_t *db, uint64_t hash, uint64_t offset, uint64_t replaced) {
+    if (!db->snapshots || db->snapshots->end <= offset) {
+        return;
+    }
+    struct kvdb_history *h = db->history;
+    struct history_entry *e = h->spare;
+    h->spare = NULL;
+    if (h->count >= h->nbuckets) history_grow(h);
+    e->hash = hash;
+    e->offset = offset;
+    e->replaced = replaced;
+    e->next = h->buckets[hash & (h->nbuckets - 1)];
+    h->buckets[hash & (h->nbuckets - 1)] = e;
+    h->count++;
+}
+
+// 在旧版本中找 key 对快照 end 可见的版本，不存在返回 NULL（调用时持有 db->lock）
+static const char *history_find(struct kvdb_t *db, uint64_t hash, const char *key,
+                                uint32_t key_len, uint64_t end) {
+    struct kvdb_history *h = db->history;
+    const char *found = NULL;
+    for (struct history_entry *e = h ? h->buckets[hash & (h->nbuckets - 1)] : NULL; e; e = e->next) {
+        if (e->hash != hash || e->offset >= end || end > e->replaced) continue;
+        const char *rec = log_ptr(db, e->offset);
+        struct rec_hdr hdr;
+        read_hdr(rec, &hdr);
+        if (hdr.key_len == key_len && memcmp(rec + REC_HDR_SIZE, key, key_len) == 0) {
+            found = rec;
+            break;
+        }
+    }
+    return found;
+}
+
+// 快照释放后丢弃不再被任何快照需要的旧版本；没有快照时整个丢弃（调用时持有 db->lock）
+static void history_prune(struct kvdb_t *db) {
+    struct kvdb_history *h = db->history;
+    if (!h) return;
+    if (!db->snapshots) {
+        history_free(h);
+        db->history = NULL;
+        return;
+    }
+    for (size_t i = 0; i < h->nbuckets; i++) {
+        struct history_entry **link = &h->buckets[i];
+        while (*link) {
+            struct history_entry *e = *link;
+            int needed = 0;
+            for (struct kvdb_snapshot *snap = db->snapshots; snap && !needed; snap = snap->next) {
+                needed = e->offset < snap->end && snap->end <= e->replaced;
+            }
+            if (needed) {
+                link = &e->next;
+            } else {
+                *link = e->next;
+                free(e);
+                h->count--;
+            }
+        }
+    }
+}
+
+// 记录 key 的最新版本位于 offset；value_len 为 SLOT_DELETED 时 offset 处是删除标记
+static int index_update(struct kvdb_t *db, const char *key, uint32_t key_len,
+                        uint32_t value_len, uint64_t offset) {
+    if (index_reserve(db) < 0 || history_reserve(db) < 0) {
+        return -1;
+    }
+
+    // 读者只读取 hash 与 offset（长度从日志记录头读取）：
+    // 新槽先写好其余字段再发布 hash，已有的槽只需原子地替换 offset
+    uint64_t hash = kvdb_hash(key, key_len);
+    struct kvdb_slot *slot = index_probe(db, hash, key, key_len);
+    int tombstone = value_len == SLOT_DELETED;
+    if (tombstone) {
+        // 删除标记本身也是压缩时可以回收的空间
+        db->dead_bytes += REC_SIZE(key_len, 0);
+        if (slot->hash == 0) {
+            // 打开时扫描到的、所删除的记录已被压缩掉的删除标记
+            return 0;
+        }
+    }
+    if (slot->hash == 0) {
+        db->index->count++;
+        slot->offset = offset;
+        slot->key_len = key_len;
+        slot->value_len = value_len;
+        __atomic_store_n(&slot->hash, hash, __ATOMIC_RELEASE);
+        if (db->order && order_insert(db->order, key, key_len, hash) < 0) {
+            order_drop(db);
+        }
+    } else {
+        // 旧版本记录从此失效；仍对快照可见时记下它的位置
+        history_add(db, hash, slot->offset, offset);
+        if (slot->value_len == SLOT_DELETED) {
+            db->index->deleted--; // 删除标记已计入 dead_bytes
+        } else {
+            db->dead_bytes += REC_SIZE(slot->key_len, slot->value_len);
+        }
+        if (tombstone) {
+            db->index->deleted++;
+        }
+        slot->value_len = value_len;
+        __atomic_store_n(&slot->offset, offset, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// 打开时顺序扫描映射的日志、校验每条记录并建立索引，返回最后一条完好记录的结束位置；
+// 作为预写日志打开时不建索引，而是把每条记录交给 replay（可以为 NULL）。
+// 只有写入过程中崩溃留下的尾部会被截掉；日志中间的记录损坏时打开失败（EIO），文件不动
+static int64_t index_build(struct kvdb_t *db, kvdb_replay_fn replay, void *arg) {
+    struct stat st;
+    if (fstat(db->fd, &st) < 0) return -1;
+    uint64_t file_size = st.st_size;
+    db->file_end = file_size;
+    if (map_extend(db, file_size) < 0) return -1;
+
+    // 只顺序扫描一遍：提示内核加大预读
+    madvise(db->map, file_size, MADV_SEQUENTIAL);
+
+    uint64_t pos = LOG_HDR_SIZE; // 下一条记录的偏移
+    int rc = 0;
+    while (pos + REC_HDR_SIZE <= file_size) {
+        struct rec_hdr hdr;
+        int compressed = read_hdr(db->map + pos, &hdr);
+        uint32_t key_len = hdr.key_len, value_len = hdr.value_len;
+
+        // 超出文件末尾的记录：崩溃时未写完的尾部
+        uint64_t rec_size = REC_SIZE(key_len, value_len);
+        if (pos + rec_size > file_size) {
+            break;
+        }
+        if ((compressed && value_len < sizeof(uint32_t)) ||
+            crc32c(0, db->map + pos + REC_CRC_SIZE, rec_size - REC_CRC_SIZE) != hdr.crc) {
+            if (pos + rec_size == file_size) {
+                break; // 最后一条记录校验和不符：同样是未写完的尾部
+            }
+            // 之后还有数据：损坏在日志中间。记录边界已不可信，不再往后猜
+            errno = EIO;
+            rc = -1;
+            break;
+        }
+
+        const char *key = db->map + pos + REC_HDR_SIZE;
+        if (replay) {
+            // 预写日志不压缩
+            rc = replay(arg, key, key_len, key + key_len, value_len);
+        } else if (!db->wal) {
+            rc = index_update(db, key, key_len,
+                              rec_tombstone(db->map + pos) ? SLOT_DELETED : value_len, pos);
+        }
+        if (rc < 0) {
+            break;
+        }
+        pos += rec_size;
+    }
+    madvise(db->map, file_size, MADV_NORMAL);
+    if (rc < 0) {
+        return -1;
+    }
+
+    // 截掉最后一条完好记录之后不完整的尾部，新记录从这里写入
+    if (pos < file_size && (ftruncate(db->fd, pos) < 0 || fdatasync(db->fd) < 0)) {
+        return -1;
+    }
+    return pos;
+}
+
+// 按记录偏移排序，使压缩时顺序读取旧文件
+static int cmp_slot_offset(const void *a, const void *b) {
+    const struct kvdb_slot *x = a, *y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+char *kvdb_path_join(const char *base, const char *suffix) {
+    size_t len = strlen(base), suffix_len = strlen(suffix);
+    char *path = malloc(len + suffix_len + 1);
+    if (path) {
+        memcpy(path, base, len);
+        memcpy(path + len, suffix, suffix_len + 1);
+    }
+    return path;
+}
+
+int kvdb_sync_parent_dir(const char *path) {
+    char *copy = strdup(path);
+    if (!copy) return -1;
+    const char *dir = ".";
+    char *slash = strrchr(copy, '/');
+    if (slash == copy) {
+        dir = "/";
+    } else if (slash) {
+        *slash = '\0';
+        dir = copy;
+    }
+
+    int ret = -1;
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        ret = fsync(fd);
+        close(fd);
+    }
+    free(copy);
+    return ret;
+}
+
+// 压缩输出：临时文件、它的映射与新索引。只属于压缩线程，读者看不到
+struct compact_out {
+    int fd;
+    char *map;
+    size_t map_capacity;
+    struct kvdb_index *idx;
+    uint64_t written;           // 已写入临时文件的长度
+    uint64_t dead_bytes;        // 追赶阶段产生的失效字节
+    int purged;                 // 新索引丢弃过已删除的键
+};
+
+// 保证临时文件的映射覆盖 [0, end)
+static int compact_map(struct compact_out *c, uint64_t end) {
+    if (end <= c->map_capacity) {
+        return 0;
+    }
+    size_t capacity = map_capacity_for(end);
+    char *map = mmap(NULL, capacity, PROT_READ, MAP_SHARED, c->fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    if (c->map) munmap(c->map, c->map_capacity);
+    c->map = map;
+    c->map_capacity = capacity;
+    return 0;
+}
+
+// 在新索引中查找键：找到返回该槽，否则返回可插入的空槽（键从临时文件的映射中读取）
+static struct kvdb_slot *compact_probe(struct compact_out *c, uint64_t hash,
+                                       const char *key, uint32_t key_len) {
+    size_t mask = c->idx->capacity - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct kvdb_slot *slot = &c->idx->slots[i];
+        if (slot->hash == 0) return slot;
+        if (slot->hash == hash && slot->key_len == key_len &&
+            memcmp(c->map + slot->offset + REC_HDR_SIZE, key, key_len) == 0) {
+            return slot;
+        }
+    }
+}
+
+// 把旧日志 [from, to) 中快照之后写入的记录原样追加到临时文件，并依次应用到新索引，
+// 与 index_update 的规则相同。旧日志这一段已经写入文件，不会再改变，可以不持锁调用
+static int compact_append(struct compact_out *c, const char *map, uint64_t from, uint64_t to) {
+    uint64_t base = c->written;
+    if (kvdb_write_exact(c->fd, map + from, to - from, base) < 0 ||
+        compact_map(c, base + (to - from)) < 0) {
+        return -1;
+    }
+    c->written += to - from;
+
+    for (uint64_t pos = from; pos < to; ) {
+        struct rec_hdr hdr;
+        read_hdr(map + pos, &hdr);
+        const char *key = map + pos + REC_HDR_SIZE;
+        uint32_t value_len = rec_tombstone(map + pos) ? SLOT_DELETED : hdr.value_len;
+        uint64_t offset = base + (pos - from);
+        pos += REC_SIZE(hdr.key_len, hdr.value_len);
+
+        // 与 index_reserve 相同：至少一半的槽属于已删除的键时按原容量重建，只丢弃它们
+        struct kvdb_index *idx = c->idx;
+        if ((idx->count + 1) * 10 > idx->capacity * 7) {
+            int purge = idx->deleted * 2 >= idx->count;
+            struct kvdb_index *grown = index_new(purge ? idx->capacity : idx->capacity * 2);
+            if (!grown) return -1;
+            for (size_t i = 0; i < idx->capacity; i++) {
+                struct kvdb_slot *slot = &idx->slots[i];
+                if (slot->hash != 0 && slot->value_len != SLOT_DELETED) index_place(grown, slot);
+            }
+            c->purged |= idx->deleted > 0;
+            free(idx);
+            c->idx = idx = grown;
+        }
+
+        uint64_t hash = kvdb_hash(key, hdr.key_len);
+        struct kvdb_slot *slot = compact_probe(c, hash, key, hdr.key_len);
+        if (value_len == SLOT_DELETED) {
+            c->dead_bytes += REC_SIZE(hdr.key_len, 0);
+            if (slot->hash == 0) continue;
+        }
+        if (slot->hash == 0) {
+            *slot = (struct kvdb_slot) { .hash = hash, .offset = offset,
+                                         .key_len = hdr.key_len, .value_len = value_len };
+            idx->count++;
+            continue;
+        }
+        if (slot->value_len == SLOT_DELETED) {
+            idx->deleted--;
+        } else {
+            c->dead_bytes += REC_SIZE(slot->key_len, slot->value_len);
+        }
+        if (value_len == SLOT_DELETED) {
+            idx->deleted++;
+        }
+        slot->offset = offset;
+        slot->value_len = value_len;
+    }
+    return 0;
+}
+
+// 压缩（调用时持有 db->lock，db->compacting 已置位）。
+// 先记下日志长度 snap_end 与其中存活的键，在锁外把它们复制到临时文件；
+// 再分轮在锁外追上此后写入文件的记录，最后一段较短时持锁追加、落盘并切换。
+// 期间写者照常追加，读者照常读取旧文件；复制所读的映射由引用计数保留
+static int compact(struct kvdb_t *db) {
+    if (commit_all(db, 0) < 0) {
+        return -1;
+    }
+
+    struct kvdb_index *idx = db->index;
+    size_t live = idx->count - idx->deleted;
+    uint64_t copied = db->file_end;     // 旧日志中已经复制到的位置
+    const char *map = db->map;
+    struct kvdb_slot *order = malloc((live + 1) * sizeof(struct kvdb_slot));
+    char *tmp_path = kvdb_path_join(db->path, COMPACT_SUFFIX);
+    struct compact_out c = { .fd = -1, .idx = index_new(index_capacity_for(live)) };
+    struct write_buffer out = {0};
+    int pinned = 0, renamed = 0;
+    int ret = -1;
+    if (!c.idx || !order || !tmp_path) goto out;
+
+    // 只复制仍然存在的键：删除标记和它们所删除的记录都不再保留，新索引按存活的键数重新分配
+    size_t n = 0;
+    for (size_t i = 0; i < idx->capacity; i++) {
+        const struct kvdb_slot *slot = &idx->slots[i];
+        if (slot->hash != 0 && slot->value_len != SLOT_DELETED) order[n++] = *slot;
+    }
+    db->refs++;
+    pinned = 1;
+    pthread_mutex_unlock(&db->lock);
+
+    qsort(order, n, sizeof(order[0]), cmp_slot_offset);
+    c.fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    int rc = c.fd < 0 || expand_buffer(&out, LOG_HDR_SIZE) < 0 ? -1 : 0;
+    if (rc == 0) {
+        memcpy(out.data, LOG_MAGIC, LOG_HDR_SIZE);
+        out.size = LOG_HDR_SIZE;
+    }
+
+    // 记录连同校验和原样复制
+    for (size_t i = 0; rc == 0 && i < n; i++) {
+        struct kvdb_slot *slot = &order[i];
+        uint64_t rec_size = REC_SIZE(slot->key_len, slot->value_len);
+        if (out.size > 0 && out.size + rec_size > COPY_CHUNK_SIZE) {
+            if ((rc = kvdb_write_exact(c.fd, out.data, out.size, c.written)) < 0) break;
+            c.written += out.size;
+            out.size = 0;
+        }
+        if (out.size + rec_size > out.capacity &&
+            (rc = expand_buffer(&out, out.size + rec_size)) < 0) {
+            break;
+        }
+        memcpy(out.data + out.size, map + slot->offset, rec_size);
+        slot->offset = c.written + out.size;
+        index_place(c.idx, slot);
+        out.size += rec_size;
+    }
+    if (rc == 0 && (rc = kvdb_write_exact(c.fd, out.data, out.size, c.written)) == 0) {
+        c.written += out.size;
+        rc = compact_map(&c, c.written);
+    }
+    // 大部分数据在锁外落盘，持锁时只剩最后一段
+    if (rc == 0) {
+        rc = fdatasync(c.fd);
+    }
+
+    // 追赶快照之后写入的记录并落盘，每轮只在读取日志长度时持锁；剩下的不多时持锁完成。
+    // 写入持续快于复制时追不上，轮数用完后持锁完成，持锁的一段不超过一轮中新写入的量
+    for (int round = 0; rc == 0; round++) {
+        pthread_mutex_lock(&db->lock);
+        if (db->closing) {
+            errno = ECANCELED;
+            rc = -1;
+        } else if (db->file_end - copied <= COMPACT_CATCHUP_SIZE || round >= COMPACT_CATCHUP_ROUNDS) {
+            break;
+        }
+        uint64_t end = db->file_end;
+        map = db->map;
+        pthread_mutex_unlock(&db->lock);
+        if (rc == 0 && (rc = compact_append(&c, map, copied, end)) == 0 &&
+            (rc = fdatasync(c.fd)) == 0) {
+            copied = end;
+        }
+    }
+    if (rc < 0) {
+        pthread_mutex_lock(&db->lock);
+        goto out;
+    }
+    if (commit_all(db, 0) < 0) goto out;
+    if (db->snapshots) {
+        // 压缩期间创建的快照还要读取旧文件中的版本
+        errno = EBUSY;
+        goto out;
+    }
+    if (compact_append(&c, db->map, copied, db->file_end) < 0) goto out;
+
+    // 新文件落盘后原子替换旧文件
+    if (fdatasync(c.fd) < 0 || rename(tmp_path, db->path) < 0) goto out;
+    renamed = 1;
+    kvdb_sync_parent_dir(db->path);
+
+    // 切换到新文件、新映射与新索引：generation 为奇数期间读者等待，
+    // 之后进入的读者只会看到新的一组
+    idx = db->index;
+    unsigned long gen = db->generation;
+    __atomic_store_n(&db->generation, gen + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    char *old_map = db->map;
+    size_t old_map_capacity = db->map_capacity;
+    int old_fd = db->fd;
+    __atomic_store_n(&db->map, c.map, __ATOMIC_RELEASE);
+    __atomic_store_n(&db->index, c.idx, __ATOMIC_RELEASE);
+    set_file_end(db, c.written);
+    __atomic_store_n(&db->generation, gen + 2, __ATOMIC_RELEASE);
+    db->map_capacity = c.map_capacity;
+    db->fd = c.fd;
+    db->synced_end = c.written;
+    db->dead_bytes = c.dead_bytes;
+    c.map = NULL;
+    c.idx = NULL;
+    c.fd = -1;
+
+    // 旧的一组等读者离开后释放
+    reader_sync(db);
+    if (old_map) map_retire(db, old_map, old_map_capacity);
+    close(old_fd);
+    if (db->metrics) {
+        __atomic_fetch_add(&db->metrics->compactions, 1, __ATOMIC_RELAXED);
+    }
+    // 被丢弃的键还留在有序索引里
+    if ((idx->deleted > 0 || c.purged) && db->order) {
+        order_drop(db);
+    }
+    free(idx);
+    ret = 0;
+
+out:
+    if (pinned && --db->refs == 0) {
+        map_retired_free(db);
+    }
+    if (c.map) munmap(c.map, c.map_capacity);
+    if (c.fd >= 0) {
+        close(c.fd);
+        if (!renamed) unlink(tmp_path);
+    }
+    free(out.data);
+    free(tmp_path);
+    free(order);
+    free(c.idx);
+    return ret;
+}
+
+int kvdb_compact(struct kvdb_t *db) {
+    if (db->shards) {
+        int ret = 0;
+        for (unsigned s = 0; s < db->nshards; s++) {
+            if (kvdb_compact(&db->shards[s]) < 0) ret = -1;
+        }
+        return ret;
+    }
+    if (db->lsm) {
+        // LSM 引擎由后台线程按层压缩
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // 后台压缩正在进行时等它结束，再压缩一次
+    pthread_mutex_lock(&db->lock);
+    while (db->compacting) {
+        pthread_cond_wait(&db->commit_cond, &db->lock);
+    }
+    int ret = -1;
+    if (db->snapshots) {
+        // 压缩会丢弃快照还要读取的旧版本并改变记录偏移
+        errno = EBUSY;
+    } else {
+        db->compacting = 1;
+        ret = compact(db);
+        db->compacting = 0;
+        pthread_cond_broadcast(&db->commit_cond);
+    }
+    pthread_mutex_unlock(&db->lock);
+    return ret;
+}
+
+// 后台压缩线程：压缩一次后退出；失败不影响写入，下次再试
+static void *compact_thread(void *arg) {
+    struct kvdb_t *db = arg;
+    pthread_mutex_lock(&db->lock);
+    if (!db->closing && !db->snapshots) {
+        compact(db);
+    }
+    db->compacting = 0;
+    pthread_cond_broadcast(&db->commit_cond);
+    pthread_mutex_unlock(&db->lock);
+    return NULL;
+}
+
+// 失效字节占比超过阈值时启动后台压缩，写者不等待。存在快照或正在压缩时推迟
+// （调用时持有 db->lock）
+static void maybe_compact(struct kvdb_t *db) {
+    if (db->compacting || db->snapshots || db->file_end < COMPACT_MIN_SIZE ||
+        db->dead_bytes * 100 <= db->file_end * COMPACT_DEAD_PERCENT) {
+        return;
+    }
+    if (db->compact_started) {
+        // 上一个线程已经清除 compacting，只剩返回
+        pthread_join(db->compact_thread, NULL);
+        db->compact_started = 0;
+    }
+    db->compacting = 1;
+    if (pthread_create(&db->compact_thread, NULL, compact_thread, db) == 0) {
+        db->compact_started = 1;
+    } else {
+        db->compacting = 0;
+    }
+}
+
+// 把旧格式（没有魔数与校验和）的日志逐条加上校验和写入临时文件，落盘后原子替换 path；
+// 旧日志末尾不完整的记录被丢弃
+static int upgrade_legacy(struct kvdb_t *db, uint64_t file_size) {
+    char *tmp_path = kvdb_path_join(db->path, COMPACT_SUFFIX);
+    char *old_map = NULL;
+    struct write_buffer out = {0};
+    uint64_t written = 0;
+    int fd = -1;
+    int ret = -1;
+    if (!tmp_path) goto out;
+    if (file_size > 0) {
+        old_map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, db->fd, 0);
+        if (old_map == MAP_FAILED) {
+            old_map = NULL;
+            goto out;
+        }
+        madvise(old_map, file_size, MADV_SEQUENTIAL);
+    }
+
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || expand_buffer(&out, LOG_HDR_SIZE) < 0) goto out;
+    memcpy(out.data, LOG_MAGIC, LOG_HDR_SIZE);
+    out.size = LOG_HDR_SIZE;
+
+    uint64_t pos = 0;
+    while (pos + LEGACY_HDR_SIZE <= file_size) {
+        uint32_t key_len, value_len;
+        memcpy(&key_len, old_map + pos, sizeof(key_len));
+        memcpy(&value_len, old_map + pos + sizeof(key_len), sizeof(value_len));
+        if (pos + LEGACY_HDR_SIZE + key_len + value_len > file_size) break;
+
+        uint64_t rec_size = REC_SIZE(key_len, value_len);
+        if (out.size > 0 && out.size + rec_size > COPY_CHUNK_SIZE) {
+            if (kvdb_write_exact(fd, out.data, out.size, written) < 0) goto out;
+            written += out.size;
+            out.size = 0;
+        }
+        if (reserve_record(&out, rec_size) < 0) goto out;
+        const char *key = old_map + pos + LEGACY_HDR_SIZE;
+        append_record(&out, key, key_len, key + key_len, value_len, 0);
+        pos += LEGACY_HDR_SIZE + (uint64_t)key_len + value_len;
+    }
+    if (kvdb_write_exact(fd, out.data, out.size, written) < 0) goto out;
+    if (fdatasync(fd) < 0 || rename(tmp_path, db->path) < 0) goto out;
+    kvdb_sync_parent_dir(db->path);
+
+    close(db->fd);
+    db->fd = fd;
+    fd = -1;
+    ret = 0;
+
+out:
+    if (old_map) munmap(old_map, file_size);
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmp_path);
+    }
+    free(out.data);
+    free(tmp_path);
+    return ret;
+}
+
+// 新文件写入魔数；没有魔数的旧格式文件先升级
+static int check_magic(struct kvdb_t *db) {
+    struct stat st;
+    char magic[LOG_HDR_SIZE];
+    if (fstat(db->fd, &st) < 0) {
+        return -1;
+    }
+    if (st.st_size == 0) {
+        if (kvdb_write_exact(db->fd, LOG_MAGIC, LOG_HDR_SIZE, 0) < 0 || fdatasync(db->fd) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+    if (st.st_size >= LOG_HDR_SIZE && pread(db->fd, magic, LOG_HDR_SIZE, 0) == LOG_HDR_SIZE &&
+        memcmp(magic, LOG_MAGIC, LOG_HDR_SIZE) == 0) {
+        return 0;
+    }
+    return upgrade_legacy(db, st.st_size);
+}
+
+// 打开日志引擎；wal 非 0 时作为 LSM 引擎的预写日志打开
+static int open_log(struct kvdb_t *db, const char *path, const struct kvdb_options *opts,
+                    int wal, kvdb_replay_fn replay, void *arg) {
+    // 初始化缓冲区与索引
+    memset(&db->buffer, 0, sizeof(db->buffer));
+    memset(&db->flushing, 0, sizeof(db->flushing));
+    db->index = NULL;
+    db->readers = NULL;
+    db->epoch = 0;
+    db->generation = 0;
+    db->order = NULL;
+    db->file_end = 0;
+    db->dead_bytes = 0;
+    db->map = NULL;
+    db->map_capacity = 0;
+    db->committing = 0;
+    db->io_error = 0;
+    db->closing = 0;
+    db->wal = wal;
+    db->lsm = NULL;
+    db->shards = NULL;
+    db->nshards = 0;
+    db->cache = NULL;
+    db->snapshots = NULL;
+    db->history = NULL;
+    db->metrics = NULL;
+    db->refs = 0;
+    db->retired = NULL;
+    db->compacting = 0;
+    db->compact_started = 0;
+    memset(&db->opts, 0, sizeof(db->opts));
+    if (opts) {
+        db->opts = *opts;
+    }
+    if (db->opts.sync_interval_ms == 0) {
+        db->opts.sync_interval_ms = SYNC_INTERVAL_MS;
+    }
+
+    // 打开数据库文件
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) return -1;
+
+    // 复制路径字符串
+    char *path_copy = strdup(path);
+    if (!path_copy) {
+        close(fd);
+        return -1;
+    }
+
+    db->fd = fd;
+    db->path = path_copy;
+
+    // 清理上次压缩中途崩溃留下的临时文件
+    char *tmp_path = kvdb_path_join(path, COMPACT_SUFFIX);
+    if (tmp_path) {
+        unlink(tmp_path);
+        free(tmp_path);
+    }
+    if (check_magic(db) < 0) {
+        free(path_copy);
+        close(db->fd);
+        return -1;
+    }
+
+    // 校验日志并建立索引，新记录从最后一条完好记录之后写入
+    int64_t end;
+    if (posix_memalign((void **)&db->readers, sizeof(struct kvdb_reader),
+                       READER_STRIPES * sizeof(struct kvdb_reader)) != 0) {
+        db->readers = NULL;
+    } else {
+        memset(db->readers, 0, READER_STRIPES * sizeof(struct kvdb_reader));
+    }
+    if (!db->readers || !(db->metrics = kvdb_metrics_new()) ||
+        index_rebuild(db, INDEX_INIT_CAPACITY) < 0 || (end = index_build(db, replay, arg)) < 0) {
+        int err = errno;
+        if (db->map) munmap(db->map, db->map_capacity);
+        free(db->index);
+        free(db->readers);
+        kvdb_metrics_free(db->metrics);
+        free(path_copy);
+        close(db->fd);
+        errno = err;
+        return -1;
+    }
+    db->file_end = end;
+    db->synced_end = end;
+
+    // group_cond 与 sync_cond 用于限时等待，使用单调时钟
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&db->lock, NULL);
+    pthread_cond_init(&db->commit_cond, NULL);
+    pthread_cond_init(&db->group_cond, &attr);
+    pthread_cond_init(&db->sync_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (db->opts.durability == KVDB_SYNC_INTERVAL &&
+        pthread_create(&db->sync_thread, NULL, sync_thread, db) != 0) {
+        kvdb_close(db);
+        return -1;
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------------------
+// 分片：目录中每个分片是一个独立打开的库，各有缓冲区、文件、锁与后台线程，
+// 不同分片上的写入与落盘互不等待。分片数建库时写入 SHARDS，之后不再改变
+
+// 键所在的分片。用哈希的高 32 位选分片，分片内的索引用的是低位，两者互不相关
+static struct kvdb_t *shard_of(struct kvdb_t *db, const void *key, size_t key_len) {
+    uint64_t hash = kvdb_hash(key, key_len);
+    return &db->shards[((hash >> 32) * db->nshards) >> 32];
+}
+
+// 按分片把 n 个键分组：返回的下标数组中同一分片的键连续存放并保持原来的先后顺序，
+// 第 s 个分片的一组从 starts[s] 到 starts[s + 1]（starts 有 nshards + 1 项）。失败返回 NULL
+static size_t *shard_group(struct kvdb_t *db, const char *const keys[], size_t n, size_t *starts) {
+    size_t *order = malloc(n * (sizeof(size_t) + sizeof(unsigned)) + 1);
+    if (!order) return NULL;
+    unsigned *which = (unsigned *)(order + n);
+    memset(starts, 0, (db->nshards + 1) * sizeof(size_t));
+    for (size_t i = 0; i < n; i++) {
+        which[i] = shard_of(db, keys[i], strlen(keys[i])) - db->shards;
+        starts[which[i] + 1]++;
+    }
+    for (unsigned s = 0; s < db->nshards; s++) {
+        starts[s + 1] += starts[s];
+    }
+    // 放置时 starts[s] 前进到这一组的末尾，即下一组的开头，之后整体后移一项复原
+    for (size_t i = 0; i < n; i++) {
+        order[starts[which[i]]++] = i;
+    }
+    memmove(starts + 1, starts, db->nshards * sizeof(size_t));
+    starts[0] = 0;
+    return order;
+}
+
+// 读出分片目录中记录的分片数；目录是新建的（没有 SHARDS）时写入 want，返回分片数，失败返回 0
+static unsigned shard_count(const char *dir, unsigned want) {
+    char meta[PATH_MAX];
+    if (snprintf(meta, sizeof(meta), "%s/" SHARD_META, dir) >= (int)sizeof(meta)) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    char text[16] = { 0 };
+    int fd = open(meta, O_RDONLY);
+    if (fd >= 0) {
+        ssize_t n = pread(fd, text, sizeof(text) - 1, 0);
+        close(fd);
+        unsigned count = n > 0 ? strtoul(text, NULL, 10) : 0;
+        if (count == 0 || count > SHARD_MAX) {
+            errno = EINVAL;
+            return 0;
+        }
+        return count;
+    }
+    if (errno != ENOENT) return 0;
+
+    // 先写临时文件并落盘，再原子改名，崩溃后不会留下写了一半的 SHARDS
+    char *tmp = kvdb_path_join(meta, COMPACT_SUFFIX);
+    if (!tmp) return 0;
+    int len = snprintf(text, sizeof(text), "%u\n", want);
+    int ok = 0;
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0) {
+        ok = kvdb_write_exact(fd, text, len, 0) == 0 && fdatasync(fd) == 0;
+        close(fd);
+    }
+    ok = ok && rename(tmp, meta) == 0 && kvdb_sync_parent_dir(meta) == 0;
+    if (!ok) unlink(tmp);
+    free(tmp);
+    if (!ok) return 0;
+    return want;
+}
+
+static int close_shards(struct kvdb_t *db, unsigned n) {
+    int ret = 0;
+    for (unsigned s = 0; s < n; s++) {
+        if (kvdb_close(&db->shards[s]) < 0) ret = -1;
+    }
+    free(db->shards);
+    db->shards = NULL;
+    free(db->path);
+    db->path = NULL;
+    return ret;
+}
+
+// 以分片模式打开目录 dir，每个分片用同样的选项打开 dir/shard.NNN
+static int open_shards(struct kvdb_t *db, const char *dir, const struct kvdb_options *opts) {
+    unsigned want = opts ? opts->shards : 0;
+    if (want == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        want = cpus > 0 ? cpus : 1;
+    }
+    if (want > SHARD_MAX) want = SHARD_MAX;
+    unsigned count = shard_count(dir, want);
+    if (count == 0) return -1;
+
+    db->lsm = NULL;
+    db->path = strdup(dir);
+    db->shards = calloc(count, sizeof(struct kvdb_t));
+    if (!db->path || !db->shards) {
+        close_shards(db, 0);
+        return -1;
+    }
+    db->nshards = count;
+    struct kvdb_options shard_opts = { 0 };
+    if (opts) {
+        shard_opts = *opts;
+    }
+    shard_opts.cache_bytes /= count;
+    for (unsigned s = 0; s < count; s++) {
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/shard.%03u", dir, s) >= (int)sizeof(path)) {
+            close_shards(db, s);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (kvdb_open_opts(&db->shards[s], path, &shard_opts) < 0) {
+            int err = errno;
+            close_shards(db, s);
+            errno = err;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int kvdb_open(struct kvdb_t *db, const char *path) {
+    return kvdb_open_opts(db, path, NULL);
+}
+
+int kvdb_open_opts(struct kvdb_t *db, const char *path, const struct kvdb_options *opts) {
+    struct stat st;
+    db->shards = NULL;
+    db->nshards = 0;
+    db->cache = NULL;
+    db->snapshots = NULL;
+    db->history = NULL;
+    db->metrics = NULL;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        return open_shards(db, path, opts);
+    }
+    int ret;
+    if (opts && opts->engine == KVDB_ENGINE_LSM) {
+        db->lsm = kvdb_lsm_open(path, opts);
+        ret = db->lsm ? 0 : -1;
+        if (ret == 0 && !(db->metrics = kvdb_metrics_new())) {
+            kvdb_close(db);
+            errno = ENOMEM;
+            return -1;
+        }
+    } else {
+        ret = open_log(db, path, opts, 0, NULL, NULL);
+    }
+    if (ret == 0 && opts && opts->cache_bytes > 0 && !(db->cache = kvdb_cache_new(opts->cache_bytes))) {
+        kvdb_close(db);
+        errno = ENOMEM;
+        return -1;
+    }
+    return ret;
+}
+
+// 大值不复制进缓冲区：先写出之前的记录，再把记录头、键和值用一次 pwritev 直接写入文件
+// （调用时持有 db->lock）
+static int append_large_locked(struct kvdb_t *db, const char *key, uint32_t key_len,
+                               const char *value, uint32_t value_len, uint32_t flags,
+                               uint64_t *end) {
+    if (commit_all(db, 0) < 0) {
+        return -1;
+    }
+    // 先为索引预留位置，写入文件后更新索引不会失败
+    if (!db->wal && (index_reserve(db) < 0 || history_reserve(db) < 0)) {
+        return -1;
+    }
+
+    struct rec_hdr hdr = { 0, key_len | flags, value_len };
+    hdr.crc = crc32c(0, &hdr.key_len, REC_HDR_SIZE - REC_CRC_SIZE);
+    hdr.crc = crc32c(hdr.crc, key, key_len);
+    hdr.crc = crc32c(hdr.crc, value, value_len);
+    struct iovec iov[3] = {
+        { .iov_base = &hdr, .iov_len = REC_HDR_SIZE },
+        { .iov_base = (void *)key, .iov_len = key_len },
+        { .iov_base = (void *)value, .iov_len = value_len },
+    };
+    uint64_t offset = db->file_end;
+    uint64_t rec_size = REC_SIZE(key_len, value_len);
+    // 写入失败时文件末尾可能留下半条记录，之后的写入会从 file_end 覆盖它
+    if (writev_exact(db->fd, iov, 3, offset) < 0) {
+        return -1;
+    }
+    if (map_extend(db, offset + rec_size) < 0) {
+        db->io_error = errno ? errno : EIO;
+        return -1;
+    }
+    set_file_end(db, offset + rec_size);
+    if (db->metrics) {
+        __atomic_fetch_add(&db->metrics->bytes_written, rec_size, __ATOMIC_RELAXED);
+    }
+    if (!db->wal) {
+        index_update(db, key, key_len, value_len, offset);
+    }
+    *end = offset + rec_size;
+    return 0;
+}
+
+// 追加一条记录，*end 返回其结束位置；flags 含 REC_COMPRESSED 时 value 已经压缩为
+// [原长度][压缩数据]，含 REC_TOMBSTONE 时是键的删除标记（调用时持有 db->lock）
+static int append_locked(struct kvdb_t *db, const char *key, uint32_t key_len,
+                         const char *value, uint32_t value_len, uint32_t flags, uint64_t *end) {
+    if (db->io_error) {
+        errno = db->io_error;
+        return -1;
+    }
+    if (value_len >= LARGE_VALUE_SIZE) {
+        return append_large_locked(db, key, key_len, value, value_len, flags, end);
+    }
+
+    // 先预留空间并更新索引，保证不会在缓冲区中留下半条记录
+    uint64_t rec_size = REC_SIZE(key_len, value_len);
+    uint64_t offset = log_end(db);
+    if (reserve_record(&db->buffer, rec_size) < 0) {
+        return -1;
+    }
+    if (!db->wal && index_update(db, key, key_len,
+                                 (flags & REC_TOMBSTONE) ? SLOT_DELETED : value_len, offset) < 0) {
+        return -1;
+    }
+    append_record(&db->buffer, key, key_len, value, value_len, flags);
+
+    // 攒满一组时提醒正在等待的 leader 提前提交
+    if (db->committing && db->buffer.size >= GROUP_COMMIT_SIZE) {
+        pthread_cond_signal(&db->group_cond);
+    }
+    *end = offset + rec_size;
+    return 0;
+}
+
+// 按持久化级别提交到 end（调用时持有 db->lock）
+static int commit_locked(struct kvdb_t *db, uint64_t end) {
+    if (db->opts.durability == KVDB_SYNC_COMMIT) {
+        // 等待本条记录随某一组落盘
+        return commit_wait(db, end, 1);
+    }
+    // 攒满一组才写入：KVDB_SYNC_BATCH 由越过阈值的写者落盘这一组，其他写者不等待；
+    // 其余级别只写入页缓存
+    if (!db->committing && db->buffer.size >= GROUP_COMMIT_SIZE) {
+        return commit_group(db, db->opts.durability == KVDB_SYNC_BATCH);
+    }
+    return 0;
+}
+
+int kvdb_wal_open(struct kvdb_t *wal, const char *path, const struct kvdb_options *opts,
+                  kvdb_replay_fn replay, void *arg) {
+    return open_log(wal, path, opts, 1, replay, arg);
+}
+
+int kvdb_wal_append(struct kvdb_t *wal, const char *key, uint32_t key_len,
+                    const char *value, uint32_t value_len, uint64_t *end) {
+    pthread_mutex_lock(&wal->lock);
+    int ret = append_locked(wal, key, key_len, value, value_len, 0, end);
+    pthread_mutex_unlock(&wal->lock);
+    return ret;
+}
+
+int kvdb_wal_commit(struct kvdb_t *wal, uint64_t end) {
+    pthread_mutex_lock(&wal->lock);
+    int ret = commit_locked(wal, end);
+    pthread_mutex_unlock(&wal->lock);
+    return ret;
+}
+
+int kvdb_put(struct kvdb_t *db, const char *key, const char *value) {
+    return kvdb_put_n(db, key, strlen(key), value, strlen(value));
+}
+
+// 要写入日志的值：原样写入，或压缩为 [原长度][压缩数据]
+struct put_value {
+    const char *data;
+    uint32_t len;
+    int compressed;
+};
+
+static int should_compress(struct kvdb_t *db, size_t value_len) {
+    return db->opts.compression == KVDB_COMPRESS_LZ && value_len >= COMPRESS_MIN_SIZE;
+}
+
+// 开启压缩时把值压缩到 scratch（容量为 value_len，可以为 NULL），压缩不划算时原样写入
+static struct put_value pack_value(struct kvdb_t *db, const char *value, uint32_t value_len,
+                                   char *scratch) {
+    struct put_value pv = { value, value_len, 0 };
+    if (scratch && should_compress(db, value_len)) {
+        uint32_t len = compress_value(value, value_len, scratch);
+        if (len > 0) {
+            pv = (struct put_value) { scratch, len, 1 };
+        }
+    }
+    return pv;
+}
+
+// pending 非 NULL 时不等待提交，*pending 返回记录的结束位置，由调用者负责提交
+static int log_put(struct kvdb_t *db, const void *key, size_t key_len,
+                   const void *value, size_t value_len, uint64_t *pending) {
+    // 压缩在加锁之前完成，不延长写者持锁的时间；压缩缓冲区分配失败时不压缩
+    char stack[PACK_STACK_SIZE];
+    char *scratch = NULL;
+    if (should_compress(db, value_len)) {
+        scratch = value_len <= sizeof(stack) ? stack : malloc(value_len);
+    }
+    struct put_value pv = pack_value(db, value, value_len, scratch);
+
+    uint64_t end;
+    pthread_mutex_lock(&db->lock);
+    int ret = append_locked(db, key, key_len, pv.data, pv.len,
+                            pv.compressed ? REC_COMPRESSED : 0, &end);
+    if (ret == 0 && pending) {
+        *pending = end;
+    } else if (ret == 0) {
+        ret = commit_locked(db, end);
+    }
+    if (ret == 0) {
+        maybe_compact(db);
+    }
+    pthread_mutex_unlock(&db->lock);
+    if (scratch != stack) {
+        free(scratch);
+    }
+    return ret;
+}
+
+int kvdb_put_n(struct kvdb_t *db, const void *key, size_t key_len,
+               const void *value, size_t value_len) {
+    // 记录头中的长度为 32 位，键长的最高两位是标志；值长 UINT32_MAX 在索引中表示已删除
+    if (key_len >= REC_TOMBSTONE || value_len >= SLOT_DELETED) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->shards) {
+        return kvdb_put_n(shard_of(db, key, key_len), key, key_len, value, value_len);
+    }
+    uint64_t start = kvdb_metrics_now();
+    int ret = db->lsm ? kvdb_lsm_put(db->lsm, key, key_len, value, value_len)
+                      : log_put(db, key, key_len, value, value_len, NULL);
+    // 存储更新之后再让缓存失效；写入失败时记录也可能已经追加，同样失效
+    if (db->cache) {
+        kvdb_cache_erase(db->cache, kvdb_hash(key, key_len), key, key_len);
+    }
+    __atomic_fetch_add(&kvdb_metrics_stripe(db->metrics)->puts, 1, __ATOMIC_RELAXED);
+    kvdb_metrics_record(&db->metrics->put_latency, kvdb_metrics_now() - start);
+    return ret;
+}
+
+// 追加一条删除标记：索引把键标为已删除，被删除的记录与标记本身都计入失效字节，由压缩回收
+static int log_delete(struct kvdb_t *db, const char *key, uint32_t key_len) {
+    uint64_t end;
+    int ret = -1;
+    pthread_mutex_lock(&db->lock);
+    if (!lookup(db, key, key_len)) {
+        errno = ENOENT;
+    } else if (append_locked(db, key, key_len, "", 0, REC_TOMBSTONE, &end) == 0) {
+        ret = commit_locked(db, end);
+    }
+    if (ret == 0) {
+        maybe_compact(db);
+    }
+    pthread_mutex_unlock(&db->lock);
+    return ret;
+}
+
+int kvdb_delete_n(struct kvdb_t *db, const void *key, size_t key_len) {
+    if (key_len >= REC_TOMBSTONE) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->shards) {
+        return kvdb_delete_n(shard_of(db, key, key_len), key, key_len);
+    }
+    if (db->lsm) {
+        // LSM 引擎的 SSTable 没有删除标记
+        errno = ENOTSUP;
+        return -1;
+    }
+    int ret = log_delete(db, key, key_len);
+    if (db->cache) {
+        kvdb_cache_erase(db->cache, kvdb_hash(key, key_len), key, key_len);
+    }
+    return ret;
+}
+
+int kvdb_delete(struct kvdb_t *db, const char *key) {
+    return kvdb_delete_n(db, key, strlen(key));
+}
+
+// 分片模式下把一批拆成每个分片一批，各自追加并提交
+static int shard_put_batch(struct kvdb_t *db, const char *const keys[],
+                           const char *const values[], size_t n) {
+    size_t starts[SHARD_MAX + 1];
+    size_t *order = shard_group(db, keys, n, starts);
+    const char **sub = malloc(2 * n * sizeof(char *) + 1);
+    int ret = order && sub ? 0 : -1;
+    for (unsigned s = 0; ret == 0 && s < db->nshards; s++) {
+        size_t m = starts[s + 1] - starts[s];
+        if (m == 0) continue;
+        for (size_t j = 0; j < m; j++) {
+            sub[j] = keys[order[starts[s] + j]];
+            sub[n + j] = values[order[starts[s] + j]];
+        }
+        ret = kvdb_put_batch(&db->shards[s], sub, sub + n, m);
+    }
+    free(sub);
+    free(order);
+    return ret;
+}
+
+static int log_put_batch(struct kvdb_t *db, const char *const keys[],
+                         const char *const values[], size_t n) {
+    // 先在锁外把整批的值压缩到 arena 中（压缩后不会变长）
+    struct put_value *vals = malloc((n + 1) * sizeof(struct put_value));
+    if (!vals) {
+        return -1;
+    }
+    size_t arena_size = 0;
+    for (size_t i = 0; i < n; i++) {
+        vals[i] = (struct put_value) { values[i], strlen(values[i]), 0 };
+        if (should_compress(db, vals[i].len)) {
+            arena_size += vals[i].len;
+        }
+    }
+    char *arena = arena_size > 0 ? malloc(arena_size) : NULL;
+    char *p = arena;
+
+    // 再算出整批的大小，一次扩展缓冲区（大值直接写入文件，不占缓冲区）
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (arena && should_compress(db, vals[i].len)) {
+            vals[i] = pack_value(db, values[i], vals[i].len, p);
+            p += vals[i].compressed ? vals[i].len : 0;
+        }
+        if (vals[i].len < LARGE_VALUE_SIZE) {
+            total += REC_SIZE(strlen(keys[i]), vals[i].len);
+        }
+    }
+
+    uint64_t end = 0;
+    size_t i = 0;
+    int ret = 0;
+    pthread_mutex_lock(&db->lock);
+    if (reserve_record(&db->buffer, total) < 0) {
+        ret = -1;
+        goto out;
+    }
+    for (; i < n; i++) {
+        if (append_locked(db, keys[i], strlen(keys[i]), vals[i].data, vals[i].len,
+                          vals[i].compressed ? REC_COMPRESSED : 0, &end) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    // 整批只提交一次；中途失败时已追加的记录仍然提交
+    if (i > 0 && commit_locked(db, end) < 0) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        maybe_compact(db);
+    }
+out:
+    pthread_mutex_unlock(&db->lock);
+    free(arena);
+    free(vals);
+    return ret;
+}
+
+int kvdb_put_batch(struct kvdb_t *db, const char *const keys[], const char *const values[], size_t n) {
+    // 与 kvdb_put_n 相同的长度限制，整批检查完才写入：过长的键会被当作删除标记重放
+    for (size_t i = 0; i < n; i++) {
+        if (strlen(keys[i]) >= REC_TOMBSTONE || strlen(values[i]) >= SLOT_DELETED) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (db->shards) {
+        return shard_put_batch(db, keys, values, n);
+    }
+    int ret = db->lsm ? kvdb_lsm_put_batch(db->lsm, keys, values, n)
+                      : log_put_batch(db, keys, values, n);
+    for (size_t i = 0; db->cache && i < n; i++) {
+        size_t key_len = strlen(keys[i]);
+        kvdb_cache_erase(db->cache, kvdb_hash(keys[i], key_len), keys[i], key_len);
+    }
+    __atomic_fetch_add(&kvdb_metrics_stripe(db->metrics)->puts, n, __ATOMIC_RELAXED);
+    return ret;
+}
+
+int kvdb_flush(struct kvdb_t *db) {
+    if (db->shards) {
+        int ret = 0;
+        for (unsigned s = 0; s < db->nshards; s++) {
+            if (kvdb_flush(&db->shards[s]) < 0) ret = -1;
+        }
+        return ret;
+    }
+    if (db->lsm) {
+        return kvdb_lsm_flush(db->lsm);
+    }
+
+    pthread_mutex_lock(&db->lock);
+    int ret = commit_wait(db, log_end(db), 1);
+    pthread_mutex_unlock(&db->lock);
+    return ret;
+}
+
+// 查找 key 对 end 之前的日志可见的最新记录，不存在或已删除返回 NULL；end 为 VIEW_LATEST 时即最新记录
+// （调用时持有 db->lock）
+static const char *lookup_at(struct kvdb_t *db, uint64_t hash, const char *key,
+                             uint32_t key_len, uint64_t end) {
+    // 已删除的键可能已经从索引中丢弃，但快照仍能在 history 中找到旧版本
+    struct kvdb_slot *slot = index_probe(db, hash, key, key_len);
+    const char *rec = slot->hash && slot->offset < end ? log_ptr(db, slot->offset)
+                                                       : history_find(db, hash, key, key_len, end);
+    return rec && !rec_tombstone(rec) ? rec : NULL;
+}
+
+// 无锁查找 key 对 end 之前的日志可见的最新记录：找到返回 1 并让 *rec 指向映射区中的记录，
+// 不存在或已删除返回 0；最新记录还没有写入文件、或者要找快照中的旧版本时返回 -1，
+// 需要加锁查找（在读者区间内调用）
+static int view_lookup(const struct read_view *v, uint64_t hash, const char *key,
+                       uint32_t key_len, uint64_t end, const char **rec) {
+    const struct kvdb_index *idx = v->index;
+    size_t mask = idx->capacity - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        const struct kvdb_slot *slot = &idx->slots[i];
+        uint64_t slot_hash = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+        if (slot_hash == 0) return end == VIEW_LATEST ? 0 : -1;
+        if (slot_hash != hash) continue;
+
+        // 槽中的长度可能正被写者修改，键长从记录头读取
+        uint64_t offset = __atomic_load_n(&slot->offset, __ATOMIC_ACQUIRE);
+        if (offset >= v->file_end) return -1;
+        const char *p = v->map + offset;
+        struct rec_hdr hdr;
+        read_hdr(p, &hdr);
+        if (hdr.key_len == key_len && memcmp(p + REC_HDR_SIZE, key, key_len) == 0) {
+            if (offset >= end) return -1; // 快照创建后键被覆盖过，旧版本要在 history 中查找
+            if (rec_tombstone(p)) return 0;
+            *rec = p;
+            return 1;
+        }
+    }
+}
+
+// 复制记录中的值：最多 length - 1 字节并补 '\0'，返回复制的字节数
+static int copy_value(const char *rec, char *buf, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    uint32_t to_copy = rec_read_value(rec, buf, length - 1);
+    if (to_copy > length - 1)
+        to_copy = length - 1;
+    buf[to_copy] = '\0';
+    return to_copy;
+}
+
+// kvdb_get 与 kvdb_snapshot_get：snap 非 NULL 时从快照中读取
+static int get_string(struct kvdb_t *db, struct kvdb_snapshot *snap, const char *key,
+                      char *buf, size_t length) {
+    size_t value_len;
+    size_t room = length ? length - 1 : 0;
+    int rc = snap ? kvdb_snapshot_get_n(snap, key, strlen(key), buf, room, &value_len)
+                  : kvdb_get_n(db, key, strlen(key), buf, room, &value_len);
+    if (rc < 0) {
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    size_t copied = value_len < room ? value_len : room;
+    buf[copied] = '\0';
+    return copied;
+}
+
+int kvdb_get(struct kvdb_t *db, const char *key, char *buf, size_t length) {
+    return get_string(db, NULL, key, buf, length);
+}
+
+// 读取 key 对 end 之前的日志可见的最新版本（end 为快照的日志长度或 VIEW_LATEST）
+static int log_get(struct kvdb_t *db, uint64_t hash, const void *key, size_t key_len,
+                   void *buf, size_t length, size_t *value_len, uint64_t end) {
+    // 一次哈希探测定位最新记录，不加锁直接从映射区复制
+    struct read_view v;
+    const char *rec;
+    int idx = reader_enter(db);
+    view_load(db, &v);
+    int rc = view_lookup(&v, hash, key, key_len, end, &rec);
+    if (rc > 0) {
+        *value_len = rec_read_value(rec, buf, length);
+    }
+    reader_exit(db, idx);
+    if (rc >= 0) {
+        return rc > 0 ? 0 : -1;
+    }
+
+    // 最新记录还在缓冲区中，或者要找快照中的旧版本：加锁读取
+    int ret = -1;
+    pthread_mutex_lock(&db->lock);
+    rec = lookup_at(db, hash, key, key_len, end);
+    if (rec) {
+        *value_len = rec_read_value(rec, buf, length);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&db->lock);
+    return ret;
+}
+
+int kvdb_get_n(struct kvdb_t *db, const void *key, size_t key_len,
+               void *buf, size_t length, size_t *value_len) {
+    if (key_len > UINT32_MAX) {
+        return -1;
+    }
+    if (db->shards) {
+        return kvdb_get_n(shard_of(db, key, key_len), key, key_len, buf, length, value_len);
+    }
+
+    uint64_t start = kvdb_metrics_now();
+    uint64_t hash = kvdb_hash(key, key_len);
+    uint64_t seq;
+    int ret = 0;
+    if (!db->cache || !kvdb_cache_get(db->cache, hash, key, key_len, buf, length, value_len, &seq)) {
+        ret = db->lsm ? kvdb_lsm_get(db->lsm, key, key_len, buf, length, value_len)
+                      : log_get(db, hash, key, key_len, buf, length, value_len, VIEW_LATEST);
+        // 只有读到了完整的值才放入缓存
+        if (db->cache && ret == 0 && *value_len <= length) {
+            kvdb_cache_put(db->cache, hash, key, key_len, buf, *value_len, seq);
+        }
+    }
+    metrics_get(db, 1, ret == 0 ? (*value_len < length ? *value_len : length) : 0);
+    kvdb_metrics_record(&db->metrics->get_latency, kvdb_metrics_now() - start);
+    return ret;
+}
+
+// 批量读取中命中的一项
+struct batch_hit {
+    const char *rec;    // 映射区中的记录
+    size_t i;
+};
+
+static int cmp_hit_offset(const void *a, const void *b) {
+    const struct batch_hit *x = a, *y = b;
+    return (x->rec > y->rec) - (x->rec < y->rec);
+}
+
+// 分片模式下按分片拆开，每个分片一次批量读取，结果放回原来的位置
+static int shard_get_batch(struct kvdb_t *db, const char *const keys[], char *const bufs[],
+                           const size_t lengths[], int results[], size_t n) {
+    size_t starts[SHARD_MAX + 1];
+    size_t *order = shard_group(db, keys, n, starts);
+    const char **sub_keys = malloc(n * sizeof(char *) + 1);
+    char **sub_bufs = malloc(n * sizeof(char *) + 1);
+    size_t *sub_lengths = malloc(n * sizeof(size_t) + 1);
+    int *sub_results = malloc(n * sizeof(int) + 1);
+    int found = 0;
+    if (!order || !sub_keys || !sub_bufs || !sub_lengths || !sub_results) {
+        // 分配失败时逐个读取
+        for (size_t i = 0; i < n; i++) {
+            results[i] = kvdb_get(db, keys[i], bufs[i], lengths[i]);
+            found += results[i] >= 0;
+        }
+        goto out;
+    }
+    for (unsigned s = 0; s < db->nshards; s++) {
+        size_t *grp = order + starts[s];
+        size_t m = starts[s + 1] - starts[s];
+        for (size_t j = 0; j < m; j++) {
+            sub_keys[j] = keys[grp[j]];
+            sub_bufs[j] = bufs[grp[j]];
+            sub_lengths[j] = lengths[grp[j]];
+        }
+        if (m > 0) {
+            found += kvdb_get_batch(&db->shards[s], sub_keys, sub_bufs, sub_lengths, sub_results, m);
+        }
+        for (size_t j = 0; j < m; j++) {
+            results[grp[j]] = sub_results[j];
+        }
+    }
+out:
+    free(sub_results);
+    free(sub_lengths);
+    free(sub_bufs);
+    free(sub_keys);
+    free(order);
+    return found;
+}
+
+int kvdb_get_batch(struct kvdb_t *db, const char *const keys[], char *const bufs[],
+                   const size_t lengths[], int results[], size_t n) {
+    int found = 0;
+    if (db->shards) {
+        return shard_get_batch(db, keys, bufs, lengths, results, n);
+    }
+    if (db->lsm) {
+        for (size_t i = 0; i < n; i++) {
+            results[i] = kvdb_get(db, keys[i], bufs[i], lengths[i]);
+            found += results[i] >= 0;
+        }
+        return found;
+    }
+
+    // 分配失败时退化为按请求顺序复制
+    struct batch_hit *hits = n > 1 ? malloc(n * sizeof(struct batch_hit)) : NULL;
+    size_t nhits = 0;
+    int pending = 0;
+
+    // 整批在一个读者区间内无锁完成：先逐个探测索引，再按日志偏移排序后复制，
+    // 让映射区的缺页按文件顺序发生，便于内核预读
+    struct read_view v;
+    int idx = reader_enter(db);
+    view_load(db, &v);
+    size_t mask = v.index->capacity - 1;
+    uint64_t hashes[BATCH_PREFETCH];
+    uint32_t key_lens[BATCH_PREFETCH];
+    for (size_t i = 0; i < n; i++) {
+        // 每 BATCH_PREFETCH 个键先算好哈希并预取槽位，让后续探测的缓存缺失重叠发生
+        size_t k = i % BATCH_PREFETCH;
+        if (k == 0) {
+            for (size_t j = 0; j < BATCH_PREFETCH && i + j < n; j++) {
+                key_lens[j] = strlen(keys[i + j]);
+                hashes[j] = kvdb_hash(keys[i + j], key_lens[j]);
+                __builtin_prefetch(&v.index->slots[hashes[j] & mask]);
+            }
+        }
+        const char *rec;
+        int rc = view_lookup(&v, hashes[k], keys[i], key_lens[k], VIEW_LATEST, &rec);
+        results[i] = -1;
+        if (rc < 0) {
+            results[i] = -2; // 稍后加锁读取
+            pending = 1;
+        } else if (rc > 0) {
+            found++;
+            if (hits) {
+                hits[nhits++] = (struct batch_hit) { .rec = rec, .i = i };
+            } else {
+                results[i] = copy_value(rec, bufs[i], lengths[i]);
+            }
+        }
+    }
+    if (hits) {
+        qsort(hits, nhits, sizeof(struct batch_hit), cmp_hit_offset);
+        for (size_t j = 0; j < nhits; j++) {
+            size_t i = hits[j].i;
+            results[i] = copy_value(hits[j].rec, bufs[i], lengths[i]);
+        }
+    }
+    reader_exit(db, idx);
+    free(hits);
+
+    // 加锁读取的键由 kvdb_get 计数
+    uint64_t direct = 0, bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        direct += results[i] != -2;
+        bytes += results[i] > 0 ? results[i] : 0;
+    }
+    metrics_get(db, direct, bytes);
+
+    // 最新记录还在缓冲区中的键逐个加锁读取
+    for (size_t i = 0; pending && i < n; i++) {
+        if (results[i] == -2) {
+            results[i] = kvdb_get(db, keys[i], bufs[i], lengths[i]);
+            found += results[i] >= 0;
+        }
+    }
+    return found;
+}
+
+int kvdb_get_ref(struct kvdb_t *db, const char *key, struct kvdb_ref *ref) {
+    if (db->shards) {
+        return kvdb_get_ref(shard_of(db, key, strlen(key)), key, ref);
+    }
+    if (db->lsm) {
+        // LSM 引擎的值分散在内存表与多个 SSTable 中，无法提供稳定的指针
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    int ret = -1;
+    pthread_mutex_lock(&db->lock);
+    struct kvdb_slot *slot;
+    while ((slot = lookup(db, key, strlen(key)))) {
+        const char *rec = log_ptr(db, slot->offset);
+        struct rec_hdr hdr;
+        if (read_hdr(rec, &hdr)) {
+            // 压缩存储的值没有可以直接引用的原文
+            errno = ENOTSUP;
+            break;
+        }
+        if (slot->offset >= db->file_end) {
+            // 缓冲区会被覆盖或扩展：先写入文件，期间锁曾释放，重新查找
+            if (commit_wait(db, slot->offset + REC_SIZE(hdr.key_len, hdr.value_len), 0) < 0) break;
+            continue;
+        }
+        // 引用计数阻止映射被解除；文件只追加，映射中的内容不会改变
+        ref->db = db;
+        ref->value = rec + REC_HDR_SIZE + hdr.key_len;
+        ref->length = hdr.value_len;
+        db->refs++;
+        ret = 0;
+        break;
+    }
+    pthread_mutex_unlock(&db->lock);
+    return ret;
+}
+
+void kvdb_ref_release(struct kvdb_ref *ref) {
+    struct kvdb_t *db = ref->db;
+    if (!db) return;
+    pthread_mutex_lock(&db->lock);
+    if (--db->refs == 0) {
+        map_retired_free(db);
+    }
+    pthread_mutex_unlock(&db->lock);
+    ref->db = NULL;
+}
+
+// ------------------------------------------------------------------------
+// 范围迭代器：每批从有序索引中按键的顺序取出约 ITER_BATCH_SIZE 字节的结果，
+// 用完后从本批最后一个键之后重新定位，因此不在两批之间持有任何节点或映射
+
+#define SCAN_ENTRY_SIZE(key_len, value_len) \
+    (KVDB_SCAN_HDR_SIZE + (uint64_t)(key_len) + (value_len))
+
+struct kvdb_iter {
+    struct kvdb_t *db;
+    uint64_t view_end;          // 只看偏移小于它的记录：快照的日志长度，或 VIEW_LATEST
+    struct kvdb_scan scan;      // 下一批的范围
+    struct write_buffer from;   // 下一批的起点：起始键，之后是上一批最后一个键
+    char *end;                  // 终点键的副本
+    struct write_buffer batch;  // 当前一批结果
+    size_t pos;                 // 下一项在 batch 中的位置
+    const char *last_key;       // 最近返回的键（位于 batch 中）
+    uint32_t last_len;
+    int cold;                   // 大于 0 时复制前先提示内核预读记录所在的页
+
+    // 分片模式：每个分片一个子迭代器，按键归并（各分片的键互不相同）
+    struct kvdb_iter **subs;
+    struct iter_head *heads;    // 各子迭代器的当前项
+    unsigned nsubs;
+    unsigned last_sub;          // 上次返回的项所属的子迭代器，下次取时先让它前进
+};
+
+struct iter_head {
+    const char *key, *value;
+    size_t key_len, value_len;
+    int valid;
+};
+
+int kvdb_scan_append(struct write_buffer *batch, const char *key, uint32_t key_len,
+                     const char *value, uint32_t value_len) {
+    uint64_t size = SCAN_ENTRY_SIZE(key_len, value_len);
+    if (reserve_record(batch, size) < 0) {
+        return -1;
+    }
+    char *p = batch->data + batch->size;
+    uint32_t hdr[2] = { key_len, value_len };
+    memcpy(p, hdr, KVDB_SCAN_HDR_SIZE);
+    memcpy(p + KVDB_SCAN_HDR_SIZE, key, key_len);
+    memcpy(p + KVDB_SCAN_HDR_SIZE + key_len, value, value_len);
+    batch->size += size;
+    return 0;
+}
+
+// 一批中待复制的一项
+struct scan_item {
+    const char *rec;    // 日志中的记录
+    size_t dst;         // 在 batch 中的位置
+};
+
+static int cmp_item_rec(const void *a, const void *b) {
+    const struct scan_item *x = a, *y = b;
+    return (x->rec > y->rec) - (x->rec < y->rec);
+}
+
+// 把一组记录复制到 batch 中各自的位置：按记录位置顺序复制，让映射区的缺页按文件顺序发生；
+// cold 时先对映射区中的记录逐段发出 MADV_WILLNEED，让这些页的读盘同时进行
+static void scan_copy(struct write_buffer *batch, struct scan_item *items, size_t n,
+                      int cold, const char *map, uint64_t file_end) {
+    qsort(items, n, sizeof(struct scan_item), cmp_item_rec);
+    if (cold) {
+        // 相邻或重叠的页合并成一段
+        uintptr_t page_mask = ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+        uintptr_t run_start = 0, run_end = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (items[i].rec < map || items[i].rec >= map + file_end) continue;
+            struct rec_hdr hdr;
+            read_hdr(items[i].rec, &hdr);
+            uintptr_t start = (uintptr_t)items[i].rec & page_mask;
+            uintptr_t end = (uintptr_t)items[i].rec + REC_SIZE(hdr.key_len, hdr.value_len);
+            if (run_end != 0 && start <= run_end) {
+                if (end > run_end) run_end = end;
+                continue;
+            }
+            if (run_end != 0) madvise((void *)run_start, run_end - run_start, MADV_WILLNEED);
+            run_start = start;
+            run_end = end;
+        }
+        if (run_end != 0) madvise((void *)run_start, run_end - run_start, MADV_WILLNEED);
+    }
+    for (size_t i = 0; i < n; i++) {
+        struct rec_hdr hdr;
+        read_hdr(items[i].rec, &hdr);
+        char *p = batch->data + items[i].dst;
+        uint32_t lens[2] = { hdr.key_len, rec_value_len(items[i].rec) };
+        memcpy(p, lens, KVDB_SCAN_HDR_SIZE);
+        memcpy(p + KVDB_SCAN_HDR_SIZE, items[i].rec + REC_HDR_SIZE, hdr.key_len);
+        rec_read_value(items[i].rec, p + KVDB_SCAN_HDR_SIZE + hdr.key_len, lens[1]);
+    }
+}
+
+// 从有序索引中取出下一批结果追加到 batch，每个键取对 end 之前的日志可见的版本。
+// 无锁时在读者区间内调用，通过快照 v 查找值，遇到还在缓冲区中的记录或快照创建后被覆盖的键
+// 返回 1，需要持锁重取；locked 时持有 db->lock，v 为 NULL
+static int order_fill(struct kvdb_t *db, const struct kvdb_order *order,
+                      const struct read_view *v, struct kvdb_scan *scan,
+                      struct write_buffer *batch, int cold, int locked, uint64_t end) {
+    struct scan_item items[ITER_CHUNK];
+    const struct kvdb_skipnode *x = kvdb_skiplist_seek(&order->list, scan->from, scan->from_len, NULL);
+    if (x && scan->after &&
+        kvdb_key_compare(kvdb_skipnode_key(x), x->key_len, scan->from, scan->from_len) == 0) {
+        x = kvdb_skipnode_next(x, 0);
+    }
+
+    scan->done = 0;
+    for (;;) {
+        // 先查找一组键的最新记录并算好各自在 batch 中的位置，再统一复制
+        size_t n = 0, size = batch->size;
+        int full = 0;
+        while (n < ITER_CHUNK) {
+            if (!x || (scan->end && kvdb_key_compare(kvdb_skipnode_key(x), x->key_len,
+                                                     scan->end, scan->end_len) >= 0)) {
+                scan->done = 1;
+                break;
+            }
+            const struct kvdb_skipnode *next = kvdb_skipnode_next(x, 0);
+            if (next) __builtin_prefetch(next);
+
+            const char *rec = NULL;
+            if (locked) {
+                rec = lookup_at(db, order_hash(x), kvdb_skipnode_key(x), x->key_len, end);
+            } else {
+                int rc = view_lookup(v, order_hash(x), kvdb_skipnode_key(x), x->key_len, end, &rec);
+                if (rc < 0) return 1;
+                if (rc == 0) rec = NULL; // 已删除，或快照中的旧索引还没有这个新键
+            }
+            if (rec) {
+                struct rec_hdr hdr;
+                read_hdr(rec, &hdr);
+                uint64_t entry = SCAN_ENTRY_SIZE(hdr.key_len, rec_value_len(rec));
+                if (size > 0 && size + entry > scan->budget) {
+                    full = 1;
+                    break;
+                }
+                items[n++] = (struct scan_item) { .rec = rec, .dst = size };
+                size += entry;
+            }
+            x = next;
+        }
+        if (n > 0) {
+            if (reserve_record(batch, size - batch->size) < 0) return -1;
+            scan_copy(batch, items, n, cold, v ? v->map : db->map, v ? v->file_end : db->file_end);
+            batch->size = size;
+        }
+        if (full || scan->done) return 0;
+    }
+}
+
+// 取下一批结果
+static int iter_fill(struct kvdb_iter *it) {
+    struct kvdb_t *db = it->db;
+    it->batch.size = 0;
+    it->pos = 0;
+    if (db->lsm) {
+        return kvdb_lsm_scan(db->lsm, &it->scan, &it->batch);
+    }
+
+    struct read_view v;
+    int idx = reader_enter(db);
+    view_load(db, &v);
+    struct kvdb_order *order = __atomic_load_n(&db->order, __ATOMIC_ACQUIRE);
+    int rc = order ? order_fill(db, order, &v, &it->scan, &it->batch, it->cold, 0, it->view_end) : 1;
+    reader_exit(db, idx);
+    if (rc <= 0) {
+        return rc;
+    }
+
+    // 有序索引还没有建立，或者这一批中有记录还在缓冲区中：持锁重取这一批
+    it->batch.size = 0;
+    pthread_mutex_lock(&db->lock);
+    rc = -1;
+    if (db->order || order_build(db) == 0) {
+        rc = order_fill(db, db->order, NULL, &it->scan, &it->batch, it->cold, 1, it->view_end);
+    }
+    pthread_mutex_unlock(&db->lock);
+    return rc;
+}
+
+static struct kvdb_iter *iter_open(struct kvdb_t *db, struct kvdb_snapshot *snap,
+                                   const void *start, size_t start_len,
+                                   const void *end, size_t end_len);
+
+// 分片模式：在每个分片上打开同样范围的子迭代器（有快照时用各分片的快照）
+static struct kvdb_iter *shard_iter_open(struct kvdb_t *db, struct kvdb_snapshot *snap,
+                                         const void *start, size_t start_len,
+                                         const void *end, size_t end_len) {
+    struct kvdb_iter *it = calloc(1, sizeof(struct kvdb_iter));
+    if (!it) return NULL;
+    it->db = db;
+    it->subs = calloc(db->nshards, sizeof(struct kvdb_iter *));
+    it->heads = calloc(db->nshards, sizeof(struct iter_head));
+    if (!it->subs || !it->heads) {
+        kvdb_iter_close(it);
+        return NULL;
+    }
+    it->nsubs = db->nshards;
+    it->last_sub = it->nsubs; // 还没有取过：先让每个子迭代器各取一项
+    for (unsigned s = 0; s < it->nsubs; s++) {
+        it->subs[s] = iter_open(&db->shards[s], snap ? &snap->subs[s] : NULL,
+                                start, start_len, end, end_len);
+        if (!it->subs[s]) {
+            kvdb_iter_close(it);
+            return NULL;
+        }
+    }
+    return it;
+}
+
+static int shard_iter_advance(struct kvdb_iter *it, unsigned s) {
+    struct iter_head *h = &it->heads[s];
+    int rc = kvdb_iter_next(it->subs[s], &h->key, &h->key_len, &h->value, &h->value_len);
+    h->valid = rc > 0;
+    return rc;
+}
+
+// 返回各子迭代器当前项中最小的一项。子迭代器返回的指针在它下一次前进之前有效，
+// 所以返回的项所属的子迭代器等到下一次调用时才前进
+static int shard_iter_next(struct kvdb_iter *it, const char **key, size_t *key_len,
+                           const char **value, size_t *value_len) {
+    if (it->last_sub == it->nsubs) {
+        for (unsigned s = 0; s < it->nsubs; s++) {
+            if (shard_iter_advance(it, s) < 0) return -1;
+        }
+    } else if (shard_iter_advance(it, it->last_sub) < 0) {
+        return -1;
+    }
+
+    const struct iter_head *min = NULL;
+    for (unsigned s = 0; s < it->nsubs; s++) {
+        const struct iter_head *h = &it->heads[s];
+        if (h->valid && (!min || kvdb_key_compare(h->key, h->key_len, min->key, min->key_len) < 0)) {
+            min = h;
+        }
+    }
+    if (!min) {
+        return 0; // 都已取完；之后再调用仍然返回 0
+    }
+    it->last_sub = min - it->heads;
+    *key = min->key;
+    *key_len = min->key_len;
+    *value = min->value;
+    *value_len = min->value_len;
+    return 1;
+}
+
+// 打开 db 上的迭代器；snap 非 NULL 时只看快照中的内容
+static struct kvdb_iter *iter_open(struct kvdb_t *db, struct kvdb_snapshot *snap,
+                                   const void *start, size_t start_len,
+                                   const void *end, size_t end_len) {
+    if (start_len > UINT32_MAX || end_len > UINT32_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (db->shards) {
+        return shard_iter_open(db, snap, start, start_len, end, end_len);
+    }
+    struct kvdb_iter *it = calloc(1, sizeof(struct kvdb_iter));
+    if (!it) return NULL;
+    it->db = db;
+    it->view_end = snap ? snap->end : VIEW_LATEST;
+    if (expand_buffer(&it->from, start_len) < 0 ||
+        (end && !(it->end = malloc(end_len ? end_len : 1)))) {
+        kvdb_iter_close(it);
+        return NULL;
+    }
+    if (start_len > 0) {
+        memcpy(it->from.data, start, start_len);
+    }
+    if (end_len > 0) {
+        memcpy(it->end, end, end_len);
+    }
+    it->scan = (struct kvdb_scan) {
+        .from = it->from.data, .from_len = start_len, .after = 0,
+        .end = it->end, .end_len = end_len, .budget = ITER_BATCH_SIZE,
+    };
+    return it;
+}
+
+struct kvdb_iter *kvdb_iter_open_n(struct kvdb_t *db, const void *start, size_t start_len,
+                                   const void *end, size_t end_len) {
+    return iter_open(db, NULL, start, start_len, end, end_len);
+}
+
+struct kvdb_iter *kvdb_iter_open(struct kvdb_t *db, const char *start, const char *end) {
+    return kvdb_iter_open_n(db, start, start ? strlen(start) : 0, end, end ? strlen(end) : 0);
+}
+
+static struct kvdb_iter *iter_prefix(struct kvdb_t *db, struct kvdb_snapshot *snap,
+                                     const char *prefix) {
+    // 以 prefix 开头的键都小于：去掉 prefix 末尾的 0xff 后把最后一个字节加 1；
+    // 全是 0xff（或为空）时没有上界
+    size_t len = strlen(prefix);
+    char *end = malloc(len + 1);
+    if (!end) return NULL;
+    memcpy(end, prefix, len);
+    size_t end_len = len;
+    while (end_len > 0 && (unsigned char)end[end_len - 1] == 0xff) end_len--;
+    if (end_len > 0) end[end_len - 1]++;
+    struct kvdb_iter *it = iter_open(db, snap, prefix, len, end_len ? end : NULL, end_len);
+    free(end);
+    return it;
+}
+
+struct kvdb_iter *kvdb_iter_prefix(struct kvdb_t *db, const char *prefix) {
+    return iter_prefix(db, NULL, prefix);
+}
+
+int kvdb_iter_next(struct kvdb_iter *it, const char **key, size_t *key_len,
+                   const char **value, size_t *value_len) {
+    if (it->subs) {
+        return shard_iter_next(it, key, key_len, value, value_len);
+    }
+    if (it->pos == it->batch.size) {
+        if (it->scan.done) {
+            return 0;
+        }
+        // 下一批从本批最后一个键之后开始
+        if (it->last_key) {
+            if (reserve_record(&it->from, it->last_len) < 0) return -1;
+            memcpy(it->from.data, it->last_key, it->last_len);
+            it->scan.from = it->from.data;
+            it->scan.from_len = it->last_len;
+            it->scan.after = 1;
+        }
+
+        // 复制时发生了读盘缺页：数据不在页缓存中，接下来几批提前预读
+        struct rusage before, after;
+        getrusage(RUSAGE_THREAD, &before);
+        if (iter_fill(it) < 0) {
+            return -1;
+        }
+        getrusage(RUSAGE_THREAD, &after);
+        if (after.ru_majflt > before.ru_majflt) {
+            it->cold = ITER_COLD_BATCHES;
+        } else if (it->cold > 0) {
+            it->cold--;
+        }
+        if (it->batch.size == 0) {
+            return 0;
+        }
+    }
+
+    uint32_t hdr[2];
+    const char *p = it->batch.data + it->pos;
+    memcpy(hdr, p, KVDB_SCAN_HDR_SIZE);
+    *key = p + KVDB_SCAN_HDR_SIZE;
+    *key_len = hdr[0];
+    *value = *key + hdr[0];
+    *value_len = hdr[1];
+    it->last_key = *key;
+    it->last_len = hdr[0];
+    it->pos += SCAN_ENTRY_SIZE(hdr[0], hdr[1]);
+    return 1;
+}
+
+void kvdb_iter_close(struct kvdb_iter *it) {
+    if (!it) return;
+    for (unsigned s = 0; it->subs && s < it->nsubs; s++) {
+        kvdb_iter_close(it->subs[s]);
+    }
+    free(it->subs);
+    free(it->heads);
+    free(it->from.data);
+    free(it->end);
+    free(it->batch.data);
+    free(it);
+}
+
+// ------------------------------------------------------------------------
+// 快照接口
+
+// 在 db 上登记快照，end 取当前日志的逻辑长度（调用时持有 db->lock）
+static void snapshot_link(struct kvdb_t *db, struct kvdb_snapshot *snap) {
+    snap->db = db;
+    snap->end = log_end(db);
+    snap->prev = NULL;
+    snap->next = db->snapshots;
+    if (db->snapshots) db->snapshots->prev = snap;
+    db->snapshots = snap;
+}
+
+static void snapshot_unlink(struct kvdb_snapshot *snap) {
+    struct kvdb_t *db = snap->db;
+    pthread_mutex_lock(&db->lock);
+    if (snap->prev) {
+        snap->prev->next = snap->next;
+    } else {
+        db->snapshots = snap->next;
+    }
+    if (snap->next) snap->next->prev = snap->prev;
+    history_prune(db);
+    pthread_mutex_unlock(&db->lock);
+}
+
+struct kvdb_snapshot *kvdb_snapshot(struct kvdb_t *db) {
+    if (db->lsm || (db->shards && db->shards[0].lsm)) {
+        // LSM 引擎的 SSTable 由后台线程合并，旧版本随时可能被丢弃
+        errno = ENOTSUP;
+        return NULL;
+    }
+    struct kvdb_snapshot *snap = calloc(1, sizeof(struct kvdb_snapshot));
+    if (!snap) return NULL;
+    snap->db = db;
+    if (!db->shards) {
+        pthread_mutex_lock(&db->lock);
+        snapshot_link(db, snap);
+        pthread_mutex_unlock(&db->lock);
+        return snap;
+    }
+
+    // 按分片顺序锁住所有分片再各自登记，各分片的快照对应同一时刻
+    snap->subs = calloc(db->nshards, sizeof(struct kvdb_snapshot));
+    if (!snap->subs) {
+        free(snap);
+        return NULL;
+    }
+    snap->nsubs = db->nshards;
+    for (unsigned s = 0; s < db->nshards; s++) {
+        pthread_mutex_lock(&db->shards[s].lock);
+    }
+    for (unsigned s = 0; s < db->nshards; s++) {
+        snapshot_link(&db->shards[s], &snap->subs[s]);
+    }
+    for (unsigned s = db->nshards; s-- > 0;) {
+        pthread_mutex_unlock(&db->shards[s].lock);
+    }
+    return snap;
+}
+
+void kvdb_snapshot_release(struct kvdb_snapshot *snap) {
+    if (!snap) return;
+    if (snap->subs) {
+        for (unsigned s = 0; s < snap->nsubs; s++) {
+            snapshot_unlink(&snap->subs[s]);
+        }
+        free(snap->subs);
+    } else {
+        snapshot_unlink(snap);
+    }
+    free(snap);
+}
+
+int kvdb_snapshot_get_n(struct kvdb_snapshot *snap, const void *key, size_t key_len,
+                        void *buf, size_t length, size_t *value_len) {
+    if (key_len > UINT32_MAX) {
+        return -1;
+    }
+    struct kvdb_t *db = snap->db;
+    if (snap->subs) {
+        unsigned s = shard_of(db, key, key_len) - db->shards;
+        return kvdb_snapshot_get_n(&snap->subs[s], key, key_len, buf, length, value_len);
+    }
+    return log_get(db, kvdb_hash(key, key_len), key, key_len, buf, length, value_len, snap->end);
+}
+
+int kvdb_snapshot_get(struct kvdb_snapshot *snap, const char *key, char *buf, size_t length) {
+    return get_string(snap->db, snap, key, buf, length);
+}
+
+struct kvdb_iter *kvdb_snapshot_iter_open_n(struct kvdb_snapshot *snap, const void *start, size_t start_len,
+                                            const void *end, size_t end_len) {
+    return iter_open(snap->db, snap, start, start_len, end, end_len);
+}
+
+struct kvdb_iter *kvdb_snapshot_iter_open(struct kvdb_snapshot *snap, const char *start, const char *end) {
+    return kvdb_snapshot_iter_open_n(snap, start, start ? strlen(start) : 0, end, end ? strlen(end) : 0);
+}
+
+struct kvdb_iter *kvdb_snapshot_iter_prefix(struct kvdb_snapshot *snap, const char *prefix) {
+    return iter_prefix(snap->db, snap, prefix);
+}
+
+// ------------------------------------------------------------------------
+// 异步接口：一个线程通过 io_uring 同时保持多个未完成的读写，不必每个请求占用一个线程。
+// 读取：无锁查到记录后提交读请求，值由内核直接读入调用者的缓冲区；
+// 写入：记录照常追加进缓冲区，句柄在没有其他 leader 时作为 leader 提交一组，
+// 写入与 fdatasync 作为链接的两个请求一起交给内核；写入完成即交还 leader，
+// 落盘请求在后台进行，其他写者不必等本句柄下一次 kvdb_aio_poll，落盘后在 kvdb_aio_poll 中回调。
+// 不需要读盘或落盘的情况（缓存命中、记录还在缓冲区、压缩的值、其他持久化级别、LSM 引擎、
+// 内核不支持 io_uring）同步完成，回调同样推迟到 kvdb_aio_poll
+
+enum aio_kind {
+    AIO_PUT,    // 等待记录落盘的写入
+    AIO_READ,   // 读取值的请求
+    AIO_WRITE,  // 一组提交的写入请求
+    AIO_FSYNC,  // 一组提交的落盘请求
+};
+
+struct aio_db;
+
+struct aio_op {
+    enum aio_kind kind;
+    kvdb_aio_cb cb;
+    void *arg;
+    int result;         // 交给回调的结果
+    int error;          // result 为 -1 时的 errno
+    uint64_t end;       // AIO_PUT：记录的结束位置
+    size_t *value_len;  // AIO_READ：值的实际长度
+    struct aio_db *ad;  // AIO_WRITE/AIO_FSYNC：所属的库
+    struct iovec iov;
+    struct aio_op *next;
+};
+
+// 句柄在一个库（分片模式下为一个分片）上的状态
+struct aio_db {
+    struct kvdb_t *db;
+    int fd;                     // db->fd 的副本：压缩替换文件后旧文件仍然可读，进行中的读请求不受影响
+    unsigned long generation;   // fd 对应的 db->generation
+    int leading;                // 本句柄正作为 leader 写入一组
+    int syncing;                // 本组的落盘请求还没有完成
+    int commit_fd;              // 本组写入与落盘使用的 db->fd 副本：落盘期间文件可能被压缩替换
+    unsigned long commit_generation; // commit_fd 对应的 db->generation
+    uint64_t sync_end;          // 落盘完成后可以确认的日志长度
+    uint64_t commit_start;      // 本组开始提交的时刻
+    struct aio_op write_op, sync_op;
+    struct aio_op *pending, **pending_tail; // 等待落盘的写入，结束位置递增
+};
+
+struct kvdb_aio {
+    struct kvdb_t *db;
+    struct kvdb_uring ring;     // ring.fd < 0 时所有操作同步执行
+    unsigned depth;
+    unsigned reads;             // 进行中的读请求
+    unsigned inflight;          // 已交给环、还没有收割的请求
+    struct aio_op *done, **done_tail; // 已完成、等待回调
+    unsigned ndbs;
+    struct aio_db dbs[];
+};
+
+static void aio_complete(struct kvdb_aio *aio, struct aio_op *op, int result, int error) {
+    op->result = result;
+    op->error = error;
+    op->next = NULL;
+    *aio->done_tail = op;
+    aio->done_tail = &op->next;
+}
+
+static struct aio_db *aio_route(struct kvdb_aio *aio, const void *key, size_t key_len) {
+    struct kvdb_t *db = aio->db;
+    return db->shards ? &aio->dbs[shard_of(db, key, key_len) - db->shards] : &aio->dbs[0];
+}
+
+// 一组的写入请求完成了：短写时同步写完剩余部分并落盘（链接的落盘请求被取消），
+// 然后像 commit_group 一样结束本组，交还 leader
+static void aio_write_done(struct aio_db *ad, int res) {
+    struct kvdb_t *db = ad->db;
+    int rc = 0, sync = 0;
+    size_t size = db->flushing.size;
+    if (res < 0) {
+        errno = -res;
+        rc = -1;
+    } else if ((size_t)res < size) {
+        rc = kvdb_write_exact(ad->commit_fd, db->flushing.data + res, size - res, db->file_end + res);
+        if (rc == 0) rc = fdatasync(ad->commit_fd);
+        if (rc == 0) metrics_sync(db, ad->commit_start);
+        sync = 1;
+    }
+    pthread_mutex_lock(&db->lock);
+    commit_finish(db, rc, sync);
+    ad->sync_end = db->file_end;
+    ad->leading = 0;
+    pthread_mutex_unlock(&db->lock);
+}
+
+// 一组的落盘请求完成了：文件没有被压缩替换时确认到 sync_end
+// （替换时新文件已由压缩落盘）
+static void aio_sync_done(struct aio_db *ad, int res) {
+    struct kvdb_t *db = ad->db;
+    if (res == 0) {
+        metrics_sync(db, ad->commit_start);
+    }
+    pthread_mutex_lock(&db->lock);
+    if (res == 0) {
+        if (db->generation == ad->commit_generation && db->synced_end < ad->sync_end) {
+            db->synced_end = ad->sync_end;
+        }
+    } else if (res != -ECANCELED && !db->io_error) {
+        db->io_error = -res;
+    }
+    ad->syncing = 0;
+    pthread_cond_broadcast(&db->commit_cond);
+    pthread_mutex_unlock(&db->lock);
+    close(ad->commit_fd);
+    ad->commit_fd = -1;
+}
+
+// 收割环中已完成的请求；wait 时至少等到一个
+static int aio_reap(struct kvdb_aio *aio, int wait) {
+    if (aio->ring.fd < 0) {
+        return 0;
+    }
+    if (kvdb_uring_submit(&aio->ring, wait && aio->inflight > 0) < 0) {
+        return -1;
+    }
+    struct io_uring_cqe *cqe;
+    while ((cqe = kvdb_uring_peek(&aio->ring))) {
+        struct aio_op *op = (struct aio_op *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        kvdb_uring_seen(&aio->ring);
+        aio->inflight--;
+        switch (op->kind) {
+        case AIO_READ:
+            aio->reads--;
+            if (res < 0) {
+                aio_complete(aio, op, -1, -res);
+            } else {
+                aio_complete(aio, op, (size_t)res == op->iov.iov_len ? 0 : -1, EIO);
+            }
+            break;
+        case AIO_WRITE:
+            aio_write_done(op->ad, res);
+            break;
+        case AIO_FSYNC:
+            aio_sync_done(op->ad, res);
+            break;
+        case AIO_PUT:
+            break;
+        }
+    }
+    return 0;
+}
+
+// 完成已经落盘的写入；还有等待落盘的写入且没有 leader 时，作为 leader 提交缓冲区中的一组，
+// 等到本组写入完成再返回，不把 leader 留到下一次 kvdb_aio_poll
+static void aio_progress(struct kvdb_aio *aio, struct aio_db *ad) {
+    struct kvdb_t *db = ad->db;
+    if (!ad->pending || ad->syncing) {
+        return;
+    }
+    pthread_mutex_lock(&db->lock);
+    while (ad->pending && (db->synced_end >= ad->pending->end || db->io_error)) {
+        struct aio_op *op = ad->pending;
+        ad->pending = op->next;
+        int ok = db->synced_end >= op->end;
+        aio_complete(aio, op, ok ? 0 : -1, ok ? 0 : db->io_error);
+    }
+    if (!ad->pending) {
+        ad->pending_tail = &ad->pending;
+    } else if (!db->committing && (ad->commit_fd = dup(db->fd)) < 0) {
+        // 没有 fd 可用于后台落盘时同步提交，失败时 io_error 已经设置
+        commit_wait(db, ad->pending->end, 1);
+    } else if (!db->committing) {
+        // 交换缓冲区，与 commit_group 相同；提交期间其他写者照常向新的 buffer 追加
+        db->committing = 1;
+        struct write_buffer group = db->buffer;
+        db->buffer = db->flushing;
+        db->flushing = group;
+
+        struct io_uring_sqe *w = kvdb_uring_sqe(&aio->ring);
+        struct io_uring_sqe *f = kvdb_uring_sqe(&aio->ring);
+        ad->write_op.iov = (struct iovec) { .iov_base = group.data, .iov_len = group.size };
+        w->opcode = IORING_OP_WRITEV;
+        w->fd = ad->commit_fd;
+        w->off = db->file_end;
+        w->addr = (uintptr_t)&ad->write_op.iov;
+        w->len = 1;
+        w->flags = IOSQE_IO_LINK;
+        w->user_data = (uintptr_t)&ad->write_op;
+        f->opcode = IORING_OP_FSYNC;
+        f->fd = ad->commit_fd;
+        f->fsync_flags = IORING_FSYNC_DATASYNC;
+        f->user_data = (uintptr_t)&ad->sync_op;
+        ad->leading = 1;
+        ad->syncing = 1;
+        ad->commit_generation = db->generation;
+        ad->commit_start = kvdb_metrics_now();
+        aio->inflight += 2;
+    }
+    pthread_mutex_unlock(&db->lock);
+
+    // 提交失败（例如被信号打断）时重试：请求已在环中，本组不能另行写出
+    while (ad->leading) {
+        aio_reap(aio, 1);
+    }
+}
+
+struct kvdb_aio *kvdb_aio_open(struct kvdb_t *db, unsigned depth) {
+    unsigned ndbs = db->shards ? db->nshards : 1;
+    struct kvdb_aio *aio = calloc(1, sizeof(struct kvdb_aio) + ndbs * sizeof(struct aio_db));
+    if (!aio) return NULL;
+    aio->db = db;
+    aio->depth = depth ? depth : AIO_DEFAULT_DEPTH;
+    aio->done_tail = &aio->done;
+    aio->ndbs = ndbs;
+    for (unsigned i = 0; i < ndbs; i++) {
+        struct aio_db *ad = &aio->dbs[i];
+        ad->db = db->shards ? &db->shards[i] : db;
+        ad->fd = -1;
+        ad->commit_fd = -1;
+        ad->pending_tail = &ad->pending;
+        ad->write_op = (struct aio_op) { .kind = AIO_WRITE, .ad = ad };
+        ad->sync_op = (struct aio_op) { .kind = AIO_FSYNC, .ad = ad };
+    }
+    // 读请求最多 depth 个，每个库最多一组提交（两个请求），环不会溢出
+    if (db->lsm || kvdb_uring_init(&aio->ring, aio->depth + 2 * ndbs) < 0) {
+        aio->ring.fd = -1;
+    }
+    return aio;
+}
+
+int kvdb_aio_put(struct kvdb_aio *aio, const void *key, size_t key_len,
+                 const void *value, size_t value_len, kvdb_aio_cb cb, void *arg) {
+    if (key_len >= REC_TOMBSTONE || value_len >= SLOT_DELETED) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct aio_op *op = calloc(1, sizeof(struct aio_op));
+    if (!op) return -1;
+    op->kind = AIO_PUT;
+    op->cb = cb;
+    op->arg = arg;
+    struct aio_db *ad = aio_route(aio, key, key_len);
+    struct kvdb_t *db = ad->db;
+    if (aio->ring.fd < 0 || db->lsm || db->opts.durability != KVDB_SYNC_COMMIT) {
+        // 不等待落盘的持久化级别下写入本来就不阻塞
+        int rc = kvdb_put_n(db, key, key_len, value, value_len);
+        aio_complete(aio, op, rc, rc < 0 ? errno : 0);
+        return 0;
+    }
+
+    int rc = log_put(db, key, key_len, value, value_len, &op->end);
+    __atomic_fetch_add(&kvdb_metrics_stripe(db->metrics)->puts, 1, __ATOMIC_RELAXED);
+    if (db->cache) {
+        kvdb_cache_erase(db->cache, kvdb_hash(key, key_len), key, key_len);
+    }
+    if (rc < 0) {
+        aio_complete(aio, op, -1, errno);
+    } else {
+        *ad->pending_tail = op;
+        ad->pending_tail = &op->next;
+    }
+    return 0;
+}
+
+// 让 ad->fd 对应 generation 所属的日志文件
+static int aio_refresh_fd(struct aio_db *ad) {
+    struct kvdb_t *db = ad->db;
+    pthread_mutex_lock(&db->lock);
+    int fd = dup(db->fd);
+    unsigned long gen = db->generation;
+    pthread_mutex_unlock(&db->lock);
+    if (fd < 0) return -1;
+    if (ad->fd >= 0) close(ad->fd);
+    ad->fd = fd;
+    ad->generation = gen;
+    return 0;
+}
+
+// 为已写入文件、未压缩的值提交读请求；返回 1 表示已提交或已完成，0 表示需要同步读取
+static int aio_read(struct kvdb_aio *aio, struct aio_db *ad, struct aio_op *op,
+                    const void *key, size_t key_len, void *buf, size_t length) {
+    struct kvdb_t *db = ad->db;
+    uint64_t hash = kvdb_hash(key, key_len);
+    uint64_t seq;
+    if (db->cache && kvdb_cache_get(db->cache, hash, key, key_len, buf, length, op->value_len, &seq)) {
+        metrics_get(db, 1, *op->value_len < length ? *op->value_len : length);
+        aio_complete(aio, op, 0, 0);
+        return 1;
+    }
+
+    struct read_view v;
+    const char *rec;
+    uint64_t offset = 0;
+    uint32_t value_len = 0;
+    int rc;
+    for (;;) {
+        int idx = reader_enter(db);
+        view_load(db, &v);
+        rc = view_lookup(&v, hash, key, key_len, VIEW_LATEST, &rec);
+        if (rc > 0) {
+            struct rec_hdr hdr;
+            if (read_hdr(rec, &hdr)) {
+                rc = -1; // 压缩的值读出后还要解压
+            }
+            offset = (rec - v.map) + REC_HDR_SIZE + hdr.key_len;
+            value_len = hdr.value_len;
+        }
+        reader_exit(db, idx);
+        if (rc <= 0 || (ad->fd >= 0 && v.generation == ad->generation)) break;
+        if (aio_refresh_fd(ad) < 0) return 0;
+    }
+    if (rc < 0) {
+        return 0;
+    }
+    if (rc == 0) {
+        metrics_get(db, 1, 0);
+        aio_complete(aio, op, -1, ENOENT);
+        return 1;
+    }
+
+    *op->value_len = value_len;
+    op->iov = (struct iovec) { .iov_base = buf, .iov_len = value_len < length ? value_len : length };
+    metrics_get(db, 1, op->iov.iov_len);
+    if (op->iov.iov_len == 0) {
+        aio_complete(aio, op, 0, 0);
+        return 1;
+    }
+    while (aio->reads >= aio->depth) {
+        if (aio_reap(aio, 1) < 0) return 0;
+    }
+    struct io_uring_sqe *sqe = kvdb_uring_sqe(&aio->ring);
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = ad->fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t)&op->iov;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t)op;
+    op->kind = AIO_READ;
+    aio->reads++;
+    aio->inflight++;
+    return 1;
+}
+
+int kvdb_aio_get(struct kvdb_aio *aio, const void *key, size_t key_len,
+                 void *buf, size_t length, size_t *value_len, kvdb_aio_cb cb, void *arg) {
+    if (key_len > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct aio_op *op = calloc(1, sizeof(struct aio_op));
+    if (!op) return -1;
+    op->cb = cb;
+    op->arg = arg;
+    op->value_len = value_len;
+    struct aio_db *ad = aio_route(aio, key, key_len);
+    if (aio->ring.fd >= 0 && !ad->db->lsm && aio_read(aio, ad, op, key, key_len, buf, length)) {
+        return 0;
+    }
+    errno = 0;
+    int rc = kvdb_get_n(ad->db, key, key_len, buf, length, value_len);
+    aio_complete(aio, op, rc, rc < 0 ? (errno ? errno : ENOENT) : 0);
+    return 0;
+}
+
+static int aio_busy(struct kvdb_aio *aio) {
+    if (aio->inflight > 0 || aio->done) return 1;
+    for (unsigned i = 0; i < aio->ndbs; i++) {
+        if (aio->dbs[i].pending) return 1;
+    }
+    return 0;
+}
+
+int kvdb_aio_poll(struct kvdb_aio *aio, int wait) {
+    for (;;) {
+        if (aio_reap(aio, 0) < 0) {
+            return -1;
+        }
+        for (unsigned i = 0; i < aio->ndbs; i++) {
+            aio_progress(aio, &aio->dbs[i]);
+        }
+        if (aio->ring.fd >= 0 && kvdb_uring_submit(&aio->ring, 0) < 0) {
+            return -1;
+        }
+
+        // 先摘下整个完成链表：回调中可以发起新的操作
+        struct aio_op *op = aio->done;
+        aio->done = NULL;
+        aio->done_tail = &aio->done;
+        int n = 0;
+        while (op) {
+            struct aio_op *next = op->next;
+            errno = op->error;
+            if (op->cb) op->cb(op->arg, op->result);
+            free(op);
+            op = next;
+            n++;
+        }
+        if (n > 0 || !wait || !aio_busy(aio)) {
+            return n;
+        }
+
+        if (aio->inflight > 0) {
+            if (aio_reap(aio, 1) < 0) return -1;
+            continue;
+        }
+        // 只剩等待其他线程那一组提交的写入
+        for (unsigned i = 0; i < aio->ndbs; i++) {
+            struct kvdb_t *db = aio->dbs[i].db;
+            if (!aio->dbs[i].pending) continue;
+            pthread_mutex_lock(&db->lock);
+            while (db->committing && !db->io_error) {
+                pthread_cond_wait(&db->commit_cond, &db->lock);
+            }
+            pthread_mutex_unlock(&db->lock);
+            break;
+        }
+    }
+}
+
+void kvdb_aio_close(struct kvdb_aio *aio) {
+    if (!aio) return;
+    while (aio_busy(aio) && kvdb_aio_poll(aio, 1) >= 0)
+        ;
+    for (unsigned i = 0; i < aio->ndbs; i++) {
+        if (aio->dbs[i].fd >= 0) close(aio->dbs[i].fd);
+    }
+    if (aio->ring.fd >= 0) {
+        kvdb_uring_exit(&aio->ring);
+    }
+    free(aio);
+}
+
+// 把一个库（不是分片模式）的统计累加到 out
+static void stats_add(struct kvdb_t *db, struct kvdb_stats *out) {
+    if (db->cache) {
+        uint64_t hits, misses;
+        kvdb_cache_stats(db->cache, &hits, &misses);
+        out->cache_hits += hits;
+        out->cache_misses += misses;
+    }
+    kvdb_metrics_add(db->metrics, out);
+    if (db->lsm) {
+        return;
+    }
+    pthread_mutex_lock(&db->lock);
+    out->index_keys += db->index->count - db->index->deleted;
+    out->index_capacity += db->index->capacity;
+    out->log_bytes += log_end(db);
+    out->dead_bytes += db->dead_bytes;
+    pthread_mutex_unlock(&db->lock);
+}
+
+int kvdb_stats(struct kvdb_t *db, struct kvdb_stats *out) {
+    memset(out, 0, sizeof(*out));
+    if (!db->shards) {
+        stats_add(db, out);
+    }
+    for (unsigned s = 0; db->shards && s < db->nshards; s++) {
+        stats_add(&db->shards[s], out);
+    }
+    return 0;
+}
+
+int kvdb_close(struct kvdb_t *db) {
+    kvdb_cache_free(db->cache);
+    db->cache = NULL;
+    kvdb_metrics_free(db->metrics);
+    db->metrics = NULL;
+    if (db->shards) {
+        return close_shards(db, db->nshards);
+    }
+    if (db->lsm) {
+        int ret = kvdb_lsm_close(db->lsm);
+        db->lsm = NULL;
+        return ret;
+    }
+
+    // 停止后台落盘线程
+    pthread_mutex_lock(&db->lock);
+    int interval = db->opts.durability == KVDB_SYNC_INTERVAL && !db->closing;
+    db->closing = 1;
+    pthread_cond_signal(&db->sync_cond);
+    pthread_mutex_unlock(&db->lock);
+    if (interval) {
+        pthread_join(db->sync_thread, NULL);
+    }
+
+    // 等待后台压缩结束（closing 已置位，它会尽快放弃）
+    pthread_mutex_lock(&db->lock);
+    while (db->compacting) {
+        pthread_cond_wait(&db->commit_cond, &db->lock);
+    }
+    pthread_mutex_unlock(&db->lock);
+    if (db->compact_started) {
+        pthread_join(db->compact_thread, NULL);
+    }
+
+    // 写出剩余数据；KVDB_SYNC_NONE 下不落盘。失败时照常释放资源，最后返回错误
+    pthread_mutex_lock(&db->lock);
+    int ret = commit_all(db, db->opts.durability != KVDB_SYNC_NONE);
+    int err = errno;
+    pthread_mutex_unlock(&db->lock);
+    pthread_mutex_destroy(&db->lock);
+    pthread_cond_destroy(&db->commit_cond);
+    pthread_cond_destroy(&db->group_cond);
+    pthread_cond_destroy(&db->sync_cond);
+
+    // 释放缓冲区、映射与索引
+    if (db->map) munmap(db->map, db->map_capacity);
+    db->map = NULL;
+    map_retired_free(db);
+    free(db->buffer.data);
+    free(db->flushing.data);
+    free(db->index);
+    db->index = NULL;
+    order_free(db->order);
+    db->order = NULL;
+    history_free(db->history);
+    db->history = NULL;
+    free(db->readers);
+    db->readers = NULL;
+
+    // 释放路径字符串
+    free(db->path);
+    db->path = NULL;
+
+    // 关闭文件
+    if (close(db->fd) < 0) {
+        return -1;
+    }
+    if (ret < 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
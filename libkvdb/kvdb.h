@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/file.h>
+#include <pthread.h>
 
 // 写入缓冲区结构
 struct write_buffer {
@@ -12,24 +13,289 @@ struct write_buffer {
     size_t capacity;    // 缓冲区容量
 };
 
+// 索引槽：记录某个键最新一条记录的位置
+struct kvdb_slot {
+    uint64_t hash;      // 键的哈希值，0 表示空槽
+    uint64_t offset;    // 记录在日志中的起始偏移
+    uint32_t key_len;   // 键长
+    uint32_t value_len; // 值长；UINT32_MAX 表示键已删除，offset 指向删除标记
+};
+
+// 开放寻址（线性探测）哈希索引：键 -> 最新记录偏移。
+// 读者无锁探测，扩容与压缩时整体替换，旧表等读者离开后释放
+struct kvdb_index {
+    size_t capacity;    // 槽数，总是 2 的幂
+    size_t count;       // 已占用槽数
+    size_t deleted;     // 其中已删除的键数，扩容时丢弃
+    struct kvdb_slot slots[]; // 槽数组
+};
+
+// 持久化级别
+enum kvdb_durability {
+    KVDB_SYNC_BATCH = 0,  // put 只进缓冲区，攒满一组（8KB）写入并落盘，默认（kvdb_open 一直如此）
+    KVDB_SYNC_COMMIT,     // 每次 put 返回前落盘（组提交）
+    KVDB_SYNC_INTERVAL,   // put 只进缓冲区，后台线程每隔 sync_interval_ms 写入并落盘
+    KVDB_SYNC_NONE,       // put 只进缓冲区，攒满一组写入页缓存，从不主动落盘
+};
+
+// 存储引擎
+enum kvdb_engine {
+    KVDB_ENGINE_LOG = 0,  // 仅追加日志 + 内存哈希索引，默认
+    KVDB_ENGINE_LSM,      // LSM-tree：path 作为预写日志，数据存放在 path.sst.* 中
+};
+
+// 值压缩
+enum kvdb_compression {
+    KVDB_COMPRESS_NONE = 0, // 不压缩，默认
+    KVDB_COMPRESS_LZ,       // 不短于 64 字节、能省下至少 1/8 的值用 LZ77（LZ4 类）压缩后写入
+};
+
+// 打开选项
+struct kvdb_options {
+    enum kvdb_engine engine;         // 存储引擎
+    enum kvdb_durability durability; // 持久化级别
+    enum kvdb_compression compression; // 新写入的值是否压缩（读取总能识别压缩的记录）；LSM 引擎不支持
+    unsigned sync_interval_ms;  // KVDB_SYNC_INTERVAL 的落盘间隔（毫秒），0 取默认值
+    unsigned commit_latency_us; // 组提交时 leader 为攒批最多等待的时间（微秒），0 表示立即提交
+    unsigned shards;    // 在空目录上新建分片库时的分片数，0 取在线 CPU 数；已有的分片库沿用建库时的分片数
+    size_t cache_bytes; // 值缓存的容量（字节），0 表示不缓存；分片模式下各分片平分
+};
+
+// 延迟直方图（纳秒，HDR 风格）：小于 16 的值各占一个桶，之后每个 2 的幂区间等分为 16 个桶，
+// 相对误差不超过 1/16；不小于 2^40 纳秒的值都计入最后一个桶
+#define KVDB_HIST_SUB_BITS 4
+#define KVDB_HIST_MAX_BITS 40
+#define KVDB_HIST_BUCKETS ((KVDB_HIST_MAX_BITS - KVDB_HIST_SUB_BITS + 1) << KVDB_HIST_SUB_BITS)
+
+struct kvdb_histogram {
+    uint64_t buckets[KVDB_HIST_BUCKETS];
+};
+
+// 运行统计：计数从打开起累计，分片模式下为各分片之和
+struct kvdb_stats {
+    uint64_t cache_hits;    // 值缓存命中次数
+    uint64_t cache_misses;  // 值缓存未命中次数
+    uint64_t puts;          // 写入的键值对数（含批量写入中的每一对）
+    uint64_t gets;          // 读取的键数（含批量读取中的每一个）
+    uint64_t bytes_written; // 写入日志文件的字节数（不含压缩时的重写）
+    uint64_t bytes_read;    // 读取返回的值字节数
+    uint64_t flushes;       // 写入文件的组数
+    uint64_t syncs;         // 提交时 fdatasync 的次数
+    uint64_t sync_ns;       // 其总耗时（纳秒）
+    uint64_t buffer_high_water; // 一组提交的最大字节数（各分片取最大值）
+    uint64_t index_keys;    // 索引中存在的键数
+    uint64_t index_capacity; // 索引槽数
+    uint64_t log_bytes;     // 日志长度（含缓冲区）
+    uint64_t dead_bytes;    // 日志中失效的字节数
+    uint64_t compactions;   // 压缩次数
+    struct kvdb_histogram put_latency;  // kvdb_put/kvdb_put_n 的延迟
+    struct kvdb_histogram get_latency;  // kvdb_get/kvdb_get_n 的延迟
+    struct kvdb_histogram sync_latency; // 提交时写入并落盘一组的延迟
+};
+
+struct kvdb_lsm; // LSM 引擎状态（kvdb_lsm.c）
+struct kvdb_reader; // 读者登记的一个分片（kvdb.c）
+struct kvdb_order;  // 按键排序的有序索引（kvdb.c）
+struct kvdb_iter;   // 范围迭代器（kvdb.c）
+struct kvdb_cache;  // 值缓存（kvdb_cache.c）
+struct kvdb_snapshot; // 时间点快照（kvdb.c）
+struct kvdb_history;  // 快照仍可见的旧版本（kvdb.c）
+struct kvdb_retired_map; // 等待引用释放后解除的旧映射（kvdb.c）
+struct kvdb_aio;      // 异步句柄（kvdb.c）
+struct kvdb_metrics;  // 运行统计（kvdb_metrics.c）
+
 struct kvdb_t {
     char *path;         // 数据库文件路径
     int fd;             // 文件描述符
     struct write_buffer buffer; // 写入缓冲区
+    struct kvdb_index *index;   // 内存索引
+    uint64_t file_end;  // 已写入文件的日志长度（缓冲区数据从这里开始）
+    uint64_t dead_bytes; // 被覆盖或删除的旧记录、以及删除标记占用的字节数
+    char *map;          // 日志文件的只读映射，覆盖 [0, file_end)
+    size_t map_capacity; // 映射区大小（按倍增预留，可超过文件长度）
+
+    // 组提交：并发的 put 把记录追加进 buffer，由一个 leader 整组写入并落盘
+    pthread_mutex_t lock;       // 串行化所有写者，保护以上所有字段
+    pthread_cond_t commit_cond; // 一组提交完成时广播
+    pthread_cond_t group_cond;  // buffer 攒满一组时通知等待中的 leader
+    struct write_buffer flushing; // leader 正在写出的一组记录
+    int committing;     // 是否有 leader 正在提交
+    int io_error;       // 写盘失败时的 errno，之后的写操作都会失败
+    uint64_t synced_end; // 已落盘的日志长度（不超过 file_end）
+
+    struct kvdb_options opts;   // 打开选项
+    pthread_t sync_thread;      // KVDB_SYNC_INTERVAL 的后台落盘线程
+    pthread_cond_t sync_cond;   // 唤醒后台线程退出
+    int closing;        // 正在关闭，后台线程应退出
+    int compacting;     // 正在压缩：压缩在锁外复制，期间不能开始另一次压缩
+    int compact_started; // compact_thread 已创建、尚未回收
+    pthread_t compact_thread;   // 自动压缩的后台线程
+
+    // 无锁读：读者在登记期间读取 index、map 与 file_end 的快照，不加 lock；
+    // 写者替换它们后等待登记在旧 epoch 上的读者离开，再释放旧的索引与映射
+    struct kvdb_reader *readers; // 按线程分片的读者计数
+    unsigned long epoch;        // 读者登记用的 epoch，奇偶各对应一组计数
+    unsigned long generation;   // 压缩替换文件时加 1 两次，奇数表示正在替换
+    struct kvdb_order *order;   // 有序索引（跳表），第一次打开迭代器时建立，之后随 put 维护
+
+    int wal;            // 作为 LSM 引擎的预写日志打开：不维护索引
+    struct kvdb_lsm *lsm; // LSM 引擎状态；为 NULL 时使用日志引擎
+
+    // 分片模式：键按哈希分到各自独立的库（各有缓冲区、文件、锁与后台线程），本结构只负责转发
+    struct kvdb_t *shards;
+    unsigned nshards;
+
+    struct kvdb_cache *cache; // 值缓存；为 NULL 时不缓存
+    struct kvdb_metrics *metrics; // 运行统计；分片模式下为 NULL，统计在各分片中
+
+    // 快照：存在快照时，被覆盖的旧版本若仍对某个快照可见，就把它的位置记入 history；
+    // 压缩会改写日志，推迟到所有快照释放之后
+    struct kvdb_snapshot *snapshots; // 未释放的快照，最新的在前
+    struct kvdb_history *history;
+
+    // 零拷贝引用：存在未释放的引用时，被替换的映射推迟到最后一个引用释放后再解除
+    unsigned long refs;         // 未释放的引用数
+    struct kvdb_retired_map *retired; // 推迟解除的映射
+};
+
+// kvdb_get_ref 取得的引用
+struct kvdb_ref {
+    struct kvdb_t *db;  // 引用所属的库（分片模式下为分片）
+    const char *value;  // 值（不以 '\0' 结尾）
+    size_t length;      // 值长
 };
 
-// 打开/创建数据库
+// 除 open/close 外，各接口都可以由多个线程同时调用：写者串行追加，读者无锁读取
+
+// 打开/创建数据库；path 是已存在的目录时以分片模式打开：目录中每个分片一个库（shard.NNN），
+// 分片数记录在 SHARDS 文件中
 int kvdb_open(struct kvdb_t *db, const char *path);
 
-// 存储键值对
+// 按选项打开/创建数据库；opts 为 NULL 时与 kvdb_open 相同（KVDB_SYNC_BATCH）。
+// 要求每次 put 返回前落盘时用 KVDB_SYNC_COMMIT
+int kvdb_open_opts(struct kvdb_t *db, const char *path, const struct kvdb_options *opts);
+
+// 存储键值对；KVDB_SYNC_COMMIT 下返回时记录已落盘
 int kvdb_put(struct kvdb_t *db, const char *key, const char *value);
 
-// 获取键值对
+// 获取键值对：最多复制 length - 1 字节并补 '\0'，返回复制的字节数；键不存在返回 -1
 int kvdb_get(struct kvdb_t *db, const char *key, char *buf, size_t length);
 
-// 手动刷新缓冲区到磁盘
+// 二进制安全的存储：键值可以包含 '\0'，键长小于 1GB，值长小于 UINT32_MAX；
+// 不小于 64KB 的值不经过缓冲区，直接用 pwritev 写入文件
+int kvdb_put_n(struct kvdb_t *db, const void *key, size_t key_len,
+               const void *value, size_t value_len);
+
+// 二进制安全的获取：最多复制 length 字节（不补 '\0'），*value_len 返回值的实际长度，
+// 大于 length 时说明 buf 不够大；找到返回 0，键不存在返回 -1
+int kvdb_get_n(struct kvdb_t *db, const void *key, size_t key_len,
+               void *buf, size_t length, size_t *value_len);
+
+// 删除键：追加一条删除标记，空间在压缩时回收；键不存在返回 -1，errno 为 ENOENT。
+// LSM 引擎不支持（返回 -1，errno 为 ENOTSUP）
+int kvdb_delete(struct kvdb_t *db, const char *key);
+
+// 二进制安全的 kvdb_delete
+int kvdb_delete_n(struct kvdb_t *db, const void *key, size_t key_len);
+
+// 批量存储 n 个键值对：整批只加一次锁、扩展一次缓冲区、提交一次；
+// 返回 -1 时前面已写入的键值对仍然有效
+int kvdb_put_batch(struct kvdb_t *db, const char *const keys[], const char *const values[], size_t n);
+
+// 批量获取 n 个键：results[i] 与 kvdb_get 的返回值相同，bufs[i] 的大小为 lengths[i]；
+// 按记录在日志中的位置顺序读取，返回找到的键数
+int kvdb_get_batch(struct kvdb_t *db, const char *const keys[], char *const bufs[],
+                   const size_t lengths[], int results[], size_t n);
+
+// 零拷贝获取：ref->value 指向日志文件映射中的值，在 kvdb_ref_release 之前一直有效，
+// 期间任何线程都可以照常写入与压缩；还在缓冲区中的记录先写入文件。
+// 引用必须在 kvdb_close 之前释放；LSM 引擎与压缩存储的值不支持（返回 -1，errno 为 ENOTSUP）
+int kvdb_get_ref(struct kvdb_t *db, const char *key, struct kvdb_ref *ref);
+
+// 释放 kvdb_get_ref 取得的引用
+void kvdb_ref_release(struct kvdb_ref *ref);
+
+// 按键的字节序遍历 [start, end) 内的键值对；start 为 NULL 表示从最小的键开始，end 为 NULL 表示没有上界。
+// 迭代器每次取出一批（约 64KB）结果，内存占用与范围大小无关；它不是快照，遍历期间的写入可能看到也可能看不到。
+// 迭代器必须在 kvdb_close 之前关闭；失败返回 NULL
+struct kvdb_iter *kvdb_iter_open(struct kvdb_t *db, const char *start, const char *end);
+
+// 二进制安全的 kvdb_iter_open
+struct kvdb_iter *kvdb_iter_open_n(struct kvdb_t *db, const void *start, size_t start_len,
+                                   const void *end, size_t end_len);
+
+// 遍历以 prefix 开头的全部键
+struct kvdb_iter *kvdb_iter_prefix(struct kvdb_t *db, const char *prefix);
+
+// 按键的顺序取下一项：*key 与 *value 指向迭代器内部的副本（不以 '\0' 结尾），
+// 在下一次 kvdb_iter_next/kvdb_iter_close 之前有效；返回 1 表示取到一项，0 表示遍历结束，-1 表示出错
+int kvdb_iter_next(struct kvdb_iter *it, const char **key, size_t *key_len,
+                   const char **value, size_t *value_len);
+
+// 关闭迭代器
+void kvdb_iter_close(struct kvdb_iter *it);
+
+// 时间点快照：记下当前的日志长度，之后通过快照读到的是此刻的内容，不受之后写入的影响。
+// 创建快照只需加锁记录一个偏移；存在快照期间不压缩日志（kvdb_compact 返回 -1，errno 为 EBUSY），
+// 被覆盖的旧版本在内存中记下位置。分片模式下同时锁住所有分片，各分片的快照取自同一时刻。
+// 快照必须在 kvdb_close 之前释放；LSM 引擎不支持（返回 NULL，errno 为 ENOTSUP）
+struct kvdb_snapshot *kvdb_snapshot(struct kvdb_t *db);
+void kvdb_snapshot_release(struct kvdb_snapshot *snap);
+
+// 从快照中读取，语义分别与 kvdb_get、kvdb_get_n 相同（不经过值缓存）
+int kvdb_snapshot_get(struct kvdb_snapshot *snap, const char *key, char *buf, size_t length);
+int kvdb_snapshot_get_n(struct kvdb_snapshot *snap, const void *key, size_t key_len,
+                        void *buf, size_t length, size_t *value_len);
+
+// 遍历快照中的键值对，语义分别与 kvdb_iter_open、kvdb_iter_open_n、kvdb_iter_prefix 相同；
+// 迭代器必须在快照释放之前关闭
+struct kvdb_iter *kvdb_snapshot_iter_open(struct kvdb_snapshot *snap, const char *start, const char *end);
+struct kvdb_iter *kvdb_snapshot_iter_open_n(struct kvdb_snapshot *snap, const void *start, size_t start_len,
+                                            const void *end, size_t end_len);
+struct kvdb_iter *kvdb_snapshot_iter_prefix(struct kvdb_snapshot *snap, const char *prefix);
+
+// 异步接口的完成回调：result 与对应同步接口的返回值相同（读取成功为 0），为 -1 时 errno 是失败原因
+typedef void (*kvdb_aio_cb)(void *arg, int result);
+
+// 异步句柄：只由一个线程使用，通过 io_uring 同时保持最多 depth 个读请求（0 取默认值 64）；
+// KVDB_SYNC_COMMIT 下的写入不阻塞调用线程，由句柄把一组记录的写入与 fdatasync 链接后一起提交。
+// 内核不支持 io_uring 时（以及 LSM 引擎）各操作同步执行，回调同样在 kvdb_aio_poll 中调用。
+// 有写入未完成时，本线程不能再调用同步的写接口（它们可能等待本句柄发起的提交）；
+// 句柄必须在 kvdb_close 之前关闭
+struct kvdb_aio *kvdb_aio_open(struct kvdb_t *db, unsigned depth);
+
+// 发起写入：key 与 value 在返回后即可复用；成功发起返回 0，参数错误或内存不足返回 -1
+int kvdb_aio_put(struct kvdb_aio *aio, const void *key, size_t key_len,
+                 const void *value, size_t value_len, kvdb_aio_cb cb, void *arg);
+
+// 发起读取，语义同 kvdb_get_n；buf 与 *value_len 在回调之前必须保持有效，键不存在时 errno 为 ENOENT
+int kvdb_aio_get(struct kvdb_aio *aio, const void *key, size_t key_len,
+                 void *buf, size_t length, size_t *value_len, kvdb_aio_cb cb, void *arg);
+
+// 提交积攒的请求、收割完成的请求并调用回调，返回调用的回调数，出错返回 -1；
+// wait 非 0 时若还有未完成的操作，至少等到一个完成
+int kvdb_aio_poll(struct kvdb_aio *aio, int wait);
+
+// 等待所有操作完成（照常回调）后关闭句柄
+void kvdb_aio_close(struct kvdb_aio *aio);
+
+// 手动刷新缓冲区到磁盘（任何持久化级别下都会落盘）
 int kvdb_flush(struct kvdb_t *db);
 
+// 压缩日志：只保留每个仍存在的键的最新记录，写入新文件后原子地替换 path；
+// 存在未释放的快照时返回 -1（EBUSY）；LSM 引擎由后台线程自动压缩，不支持手动调用
+int kvdb_compact(struct kvdb_t *db);
+
+// 读取运行统计：读写路径上的计数与直方图无锁累计，读取索引与日志长度时短暂加锁；
+// LSM 引擎只统计读写次数、读取的字节数与延迟
+int kvdb_stats(struct kvdb_t *db, struct kvdb_stats *out);
+
+// 直方图中的样本数
+uint64_t kvdb_histogram_count(const struct kvdb_histogram *h);
+
+// 第 p 百分位（0～100）的延迟：所在桶的上界，没有样本时为 0
+uint64_t kvdb_histogram_percentile(const struct kvdb_histogram *h, double p);
+
 // 关闭数据库
 int kvdb_close(struct kvdb_t *db);
 
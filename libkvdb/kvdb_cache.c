@@ -0,0 +1,229 @@
+#include "kvdb_cache.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_SHARDS 16          // 组数，每组一把锁
+#define CACHE_INIT_SLOTS 64      // 每组哈希桶与 CLOCK 环的初始大小
+#define CACHE_MAX_ENTRY_SHIFT 3  // 单个值最多占一组容量的 1/8，更大的值不缓存
+
+struct cache_entry {
+    uint64_t hash;
+    struct cache_entry *next;   // 同一个桶中的下一项
+    size_t slot;                // 在 CLOCK 环中的位置
+    size_t key_len;
+    size_t value_len;
+    int ref;                    // 被访问过；指针扫到时先清零放过一次
+    char data[];                // 键，之后是值
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_entry **buckets;
+    size_t nbuckets;
+    struct cache_entry **ring;  // CLOCK 环，淘汰时删除的位置由末尾一项填上
+    size_t count;
+    size_t ring_capacity;
+    size_t hand;
+    size_t used;                // 已占用的字节数
+    size_t capacity;
+    uint64_t seq;               // 失效序号，每次 erase 加 1
+    uint64_t hits;
+    uint64_t misses;
+} __attribute__((aligned(64)));
+
+struct kvdb_cache {
+    struct cache_shard shards[CACHE_SHARDS];
+};
+
+#define ENTRY_SIZE(key_len, value_len) (sizeof(struct cache_entry) + (key_len) + (value_len))
+
+static struct cache_shard *shard_for(struct kvdb_cache *cache, uint64_t hash) {
+    // 桶用哈希的低位，组用高 32 位中的几位
+    return &cache->shards[(hash >> 32) % CACHE_SHARDS];
+}
+
+// 返回指向 key 所在项的链接，不存在时 *link 为 NULL
+static struct cache_entry **find(struct cache_shard *sh, uint64_t hash,
+                                 const void *key, size_t key_len) {
+    struct cache_entry **link = &sh->buckets[hash & (sh->nbuckets - 1)];
+    for (; *link; link = &(*link)->next) {
+        struct cache_entry *e = *link;
+        if (e->hash == hash && e->key_len == key_len && memcmp(e->data, key, key_len) == 0) {
+            break;
+        }
+    }
+    return link;
+}
+
+static void remove_entry(struct cache_shard *sh, struct cache_entry **link) {
+    struct cache_entry *e = *link;
+    *link = e->next;
+    struct cache_entry *last = sh->ring[--sh->count];
+    sh->ring[e->slot] = last;
+    last->slot = e->slot;
+    if (sh->hand >= sh->count) sh->hand = 0;
+    sh->used -= ENTRY_SIZE(e->key_len, e->value_len);
+    free(e);
+}
+
+// CLOCK 淘汰，直到再放入 need 字节不超过容量
+static void evict(struct cache_shard *sh, size_t need) {
+    while (sh->count > 0 && sh->used + need > sh->capacity) {
+        struct cache_entry *e = sh->ring[sh->hand];
+        if (e->ref) {
+            e->ref = 0;
+            sh->hand = (sh->hand + 1) % sh->count;
+            continue;
+        }
+        struct cache_entry **link = &sh->buckets[e->hash & (sh->nbuckets - 1)];
+        while (*link != e) link = &(*link)->next;
+        remove_entry(sh, link);
+    }
+}
+
+// 再放入一项前保证 CLOCK 环与哈希桶有空间：项数超过桶数时桶数翻倍
+static int reserve(struct cache_shard *sh) {
+    if (sh->count == sh->ring_capacity) {
+        struct cache_entry **ring = realloc(sh->ring, 2 * sh->ring_capacity * sizeof(*ring));
+        if (!ring) return -1;
+        sh->ring = ring;
+        sh->ring_capacity *= 2;
+    }
+    if (sh->count >= sh->nbuckets) {
+        size_t nbuckets = 2 * sh->nbuckets;
+        struct cache_entry **buckets = calloc(nbuckets, sizeof(*buckets));
+        if (!buckets) return -1;
+        for (size_t i = 0; i < sh->count; i++) {
+            struct cache_entry *e = sh->ring[i];
+            size_t b = e->hash & (nbuckets - 1);
+            e->next = buckets[b];
+            buckets[b] = e;
+        }
+        free(sh->buckets);
+        sh->buckets = buckets;
+        sh->nbuckets = nbuckets;
+    }
+    return 0;
+}
+
+struct kvdb_cache *kvdb_cache_new(size_t capacity) {
+    struct kvdb_cache *cache;
+    if (posix_memalign((void **)&cache, 64, sizeof(struct kvdb_cache)) != 0) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(struct kvdb_cache));
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *sh = &cache->shards[i];
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->capacity = capacity / CACHE_SHARDS;
+        sh->nbuckets = sh->ring_capacity = CACHE_INIT_SLOTS;
+        sh->buckets = calloc(sh->nbuckets, sizeof(struct cache_entry *));
+        sh->ring = malloc(sh->ring_capacity * sizeof(struct cache_entry *));
+        if (!sh->buckets || !sh->ring) {
+            kvdb_cache_free(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+void kvdb_cache_free(struct kvdb_cache *cache) {
+    if (!cache) return;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *sh = &cache->shards[i];
+        for (size_t j = 0; j < sh->count; j++) {
+            free(sh->ring[j]);
+        }
+        free(sh->ring);
+        free(sh->buckets);
+        pthread_mutex_destroy(&sh->lock);
+    }
+    free(cache);
+}
+
+int kvdb_cache_get(struct kvdb_cache *cache, uint64_t hash, const void *key, size_t key_len,
+                   void *buf, size_t length, size_t *value_len, uint64_t *seq) {
+    struct cache_shard *sh = shard_for(cache, hash);
+    pthread_mutex_lock(&sh->lock);
+    struct cache_entry *e = *find(sh, hash, key, key_len);
+    if (!e) {
+        *seq = sh->seq;
+        sh->misses++;
+        pthread_mutex_unlock(&sh->lock);
+        return 0;
+    }
+    e->ref = 1;
+    if (length > 0) {
+        memcpy(buf, e->data + key_len, e->value_len < length ? e->value_len : length);
+    }
+    *value_len = e->value_len;
+    sh->hits++;
+    pthread_mutex_unlock(&sh->lock);
+    return 1;
+}
+
+void kvdb_cache_put(struct kvdb_cache *cache, uint64_t hash, const void *key, size_t key_len,
+                    const void *value, size_t value_len, uint64_t seq) {
+    struct cache_shard *sh = shard_for(cache, hash);
+    size_t size = ENTRY_SIZE(key_len, value_len);
+    if (size > sh->capacity >> CACHE_MAX_ENTRY_SHIFT) {
+        return;
+    }
+    // 在锁外准备好新项
+    struct cache_entry *e = malloc(size);
+    if (!e) return;
+    e->hash = hash;
+    e->key_len = key_len;
+    e->value_len = value_len;
+    e->ref = 0;
+    memcpy(e->data, key, key_len);
+    memcpy(e->data + key_len, value, value_len);
+
+    pthread_mutex_lock(&sh->lock);
+    if (seq != sh->seq) {
+        // 读存储期间同组有键被写入，读到的值可能已经过时
+        pthread_mutex_unlock(&sh->lock);
+        free(e);
+        return;
+    }
+    struct cache_entry **link = find(sh, hash, key, key_len);
+    if (*link) {
+        remove_entry(sh, link);
+    }
+    evict(sh, size);
+    if (reserve(sh) < 0) {
+        pthread_mutex_unlock(&sh->lock);
+        free(e);
+        return;
+    }
+    size_t b = hash & (sh->nbuckets - 1);
+    e->next = sh->buckets[b];
+    sh->buckets[b] = e;
+    e->slot = sh->count;
+    sh->ring[sh->count++] = e;
+    sh->used += size;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+void kvdb_cache_erase(struct kvdb_cache *cache, uint64_t hash, const void *key, size_t key_len) {
+    struct cache_shard *sh = shard_for(cache, hash);
+    pthread_mutex_lock(&sh->lock);
+    struct cache_entry **link = find(sh, hash, key, key_len);
+    if (*link) {
+        remove_entry(sh, link);
+    }
+    sh->seq++;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+void kvdb_cache_stats(struct kvdb_cache *cache, uint64_t *hits, uint64_t *misses) {
+    *hits = *misses = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *sh = &cache->shards[i];
+        pthread_mutex_lock(&sh->lock);
+        *hits += sh->hits;
+        *misses += sh->misses;
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
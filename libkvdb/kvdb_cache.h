@@ -0,0 +1,33 @@
+#ifndef KVDB_CACHE_H
+#define KVDB_CACHE_H
+
+// 值缓存：按键的哈希分成若干组，每组一把锁，组内用 CLOCK 淘汰，kvdb 内部使用。
+// 缓存的是完整的原始值，读取时按调用者的缓冲区长度截断。
+// 写入先更新存储、再让缓存失效；未命中的读者在读存储之前记下所在组的失效序号，
+// 放入缓存时序号变过就放弃，避免把读到的旧值放回缓存
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct kvdb_cache;
+
+// 创建容量为 capacity 字节的缓存
+struct kvdb_cache *kvdb_cache_new(size_t capacity);
+void kvdb_cache_free(struct kvdb_cache *cache);
+
+// 查找 key：命中时复制值的前 length 字节，*value_len 为完整长度，返回 1；
+// 未命中返回 0，*seq 为此时的失效序号，读到值后连同它一起交给 kvdb_cache_put
+int kvdb_cache_get(struct kvdb_cache *cache, uint64_t hash, const void *key, size_t key_len,
+                   void *buf, size_t length, size_t *value_len, uint64_t *seq);
+
+// 放入 key 的完整值；seq 之后同组有键失效过时不放入
+void kvdb_cache_put(struct kvdb_cache *cache, uint64_t hash, const void *key, size_t key_len,
+                    const void *value, size_t value_len, uint64_t seq);
+
+// key 被写入：删除缓存中的旧值
+void kvdb_cache_erase(struct kvdb_cache *cache, uint64_t hash, const void *key, size_t key_len);
+
+// 累计的命中与未命中次数
+void kvdb_cache_stats(struct kvdb_cache *cache, uint64_t *hits, uint64_t *misses);
+
+#endif // KVDB_CACHE_H
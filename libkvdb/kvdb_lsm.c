@@ -0,0 +1,1361 @@
+#define _GNU_SOURCE
+#include "kvdb_lsm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+// LSM-tree 引擎：
+// - 写入先追加到预写日志（即日志引擎的数据文件 path），再插入有序的内存表（跳表）；
+// - 内存表写满后转为不可变，预写日志改名为 path.imm，由后台线程写成 L0 的 SSTable；
+// - SSTable（path.sst.N）由数据块、布隆过滤器、块索引和尾部组成，写好后不再修改；
+// - 后台线程按层压缩：L0 文件过多时并入 L1，Li 超过容量时挑一个文件并入 L(i+1)；
+// - 当前所有 SSTable 的列表（version）记录在 path.manifest 中，替换时先写临时文件再改名。
+
+// 内存表与 SSTable 中的条目沿用日志的记录格式：[key_len][value_len][key][value]
+#define ENTRY_HDR_SIZE (2 * sizeof(uint32_t))
+
+#define MEMTABLE_SIZE (4 << 20)   // 内存表超过 4MB 时转为不可变
+#define SST_BLOCK_SIZE 4096       // 数据块大小
+#define SST_TARGET_SIZE (2 << 20) // 压缩输出的单个 SSTable 大小
+#define SST_MAGIC 0x4c534d2d42445653ULL
+#define BLOOM_BITS_PER_KEY 10     // 约 1% 误判率
+#define BLOOM_PROBES 7
+#define LSM_LEVELS 7
+#define L0_COMPACT_TRIGGER 4      // L0 文件数达到 4 个时并入 L1
+#define L0_STOP_WRITES 12         // L0 文件数达到 12 个时写入等待后台压缩
+#define L1_MAX_BYTES (10 << 20)   // L1 容量，之后每层扩大 10 倍
+
+#define IMM_SUFFIX ".imm"
+#define MANIFEST_SUFFIX ".manifest"
+
+// ------------------------------------------------------------------------
+// 公共辅助函数（其余与日志引擎共用，见 kvdb_lsm.h）
+
+// 第 number 个 SSTable 的路径：base.sst.000001
+static char *sst_path(const char *base, uint64_t number) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".sst.%06llu", (unsigned long long)number);
+    return kvdb_path_join(base, suffix);
+}
+
+// ------------------------------------------------------------------------
+// 内存表：保存键值副本的跳表，所有访问都在 lsm->lock 下进行
+
+struct memtable {
+    struct kvdb_skiplist list; // 节点附带的数据是值
+    size_t bytes;       // 节点与键值占用的字节数
+    size_t count;       // 键数
+};
+
+static struct memtable *mem_new(void) {
+    struct memtable *mem = calloc(1, sizeof(struct memtable));
+    if (!mem) return NULL;
+    if (kvdb_skiplist_init(&mem->list) < 0) {
+        free(mem);
+        return NULL;
+    }
+    return mem;
+}
+
+static void mem_free(struct memtable *mem) {
+    if (!mem) return;
+    kvdb_skiplist_destroy(&mem->list);
+    free(mem);
+}
+
+static struct kvdb_skipnode *mem_get(struct memtable *mem, const char *key, uint32_t key_len) {
+    struct kvdb_skipnode *node = kvdb_skiplist_seek(&mem->list, key, key_len, NULL);
+    if (node && kvdb_key_compare(kvdb_skipnode_key(node), node->key_len, key, key_len) == 0) {
+        return node;
+    }
+    return NULL;
+}
+
+// 覆盖时被替换的节点立即释放：内存表只在持锁时访问
+static int mem_put(struct memtable *mem, const char *key, uint32_t key_len,
+                   const char *value, uint32_t value_len) {
+    struct kvdb_skipnode *old;
+    struct kvdb_skipnode *node = kvdb_skiplist_put(&mem->list, key, key_len, value, value_len, &old);
+    if (!node) return -1;
+    if (old) {
+        mem->bytes -= kvdb_skipnode_size(old);
+        free(old);
+    } else {
+        mem->count++;
+    }
+    mem->bytes += kvdb_skipnode_size(node);
+    return 0;
+}
+
+// 重放预写日志的回调
+static int replay_into(void *arg, const char *key, uint32_t key_len,
+                       const char *value, uint32_t value_len) {
+    return mem_put(arg, key, key_len, value, value_len);
+}
+
+// ------------------------------------------------------------------------
+// SSTable 文件格式：
+//   [数据块]...  每块约 4KB，由按键排序的条目组成
+//   [布隆过滤器] 每个键约 10 位
+//   [块索引]     每个数据块一项：[key_len][size][offset][该块最后一个键]
+//   [尾部]       struct sst_footer
+
+struct sst_footer {
+    uint64_t bloom_offset;
+    uint64_t bloom_size;
+    uint64_t index_offset;
+    uint64_t index_size;
+    uint64_t count;         // 条目数
+    uint64_t magic;
+};
+
+struct sst_index_entry {
+    uint32_t key_len;
+    uint32_t size;
+    uint64_t offset;
+};
+
+// 布隆过滤器：双重哈希生成 BLOOM_PROBES 个位置
+static void bloom_set(uint8_t *bits, uint64_t nbits, uint64_t hash) {
+    uint64_t delta = (hash >> 17) | (hash << 47);
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        uint64_t bit = hash % nbits;
+        bits[bit / 8] |= 1 << (bit % 8);
+        hash += delta;
+    }
+}
+
+static int bloom_test(const uint8_t *bits, uint64_t nbits, uint64_t hash) {
+    uint64_t delta = (hash >> 17) | (hash << 47);
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        uint64_t bit = hash % nbits;
+        if (!(bits[bit / 8] & (1 << (bit % 8)))) return 0;
+        hash += delta;
+    }
+    return 1;
+}
+
+// 在内存中构造整个 SSTable（单个文件不超过几 MB）
+struct sst_builder {
+    struct write_buffer data;   // 文件内容
+    struct write_buffer index;  // 块索引
+    uint64_t *hashes;           // 所有键的哈希，最后生成布隆过滤器
+    size_t count;
+    size_t hashes_capacity;
+    size_t block_start;         // 当前数据块的起始偏移
+    size_t last_key;            // 最后一个键在 data 中的偏移
+    uint32_t last_key_len;
+};
+
+static void builder_free(struct sst_builder *b) {
+    free(b->data.data);
+    free(b->index.data);
+    free(b->hashes);
+    memset(b, 0, sizeof(*b));
+}
+
+static int builder_finish_block(struct sst_builder *b) {
+    if (b->data.size == b->block_start) return 0;
+    struct sst_index_entry entry = {
+        .key_len = b->last_key_len,
+        .size = b->data.size - b->block_start,
+        .offset = b->block_start,
+    };
+    if (kvdb_buffer_append(&b->index, &entry, sizeof(entry)) < 0 ||
+        kvdb_buffer_append(&b->index, b->data.data + b->last_key, b->last_key_len) < 0) {
+        return -1;
+    }
+    b->block_start = b->data.size;
+    return 0;
+}
+
+// 条目必须按键递增的顺序加入
+static int builder_add(struct sst_builder *b, const char *key, uint32_t key_len,
+                       const char *value, uint32_t value_len) {
+    if (b->count == b->hashes_capacity) {
+        size_t capacity = b->hashes_capacity ? b->hashes_capacity * 2 : 1024;
+        uint64_t *hashes = realloc(b->hashes, capacity * sizeof(uint64_t));
+        if (!hashes) return -1;
+        b->hashes = hashes;
+        b->hashes_capacity = capacity;
+    }
+    if (kvdb_buffer_append(&b->data, &key_len, sizeof(key_len)) < 0 ||
+        kvdb_buffer_append(&b->data, &value_len, sizeof(value_len)) < 0 ||
+        kvdb_buffer_append(&b->data, key, key_len) < 0 ||
+        kvdb_buffer_append(&b->data, value, value_len) < 0) {
+        return -1;
+    }
+    b->hashes[b->count++] = kvdb_hash(key, key_len);
+    b->last_key = b->data.size - value_len - key_len;
+    b->last_key_len = key_len;
+
+    if (b->data.size - b->block_start >= SST_BLOCK_SIZE) {
+        return builder_finish_block(b);
+    }
+    return 0;
+}
+
+// 追加布隆过滤器、块索引与尾部，并写入 path
+static int builder_write(struct sst_builder *b, const char *path) {
+    if (builder_finish_block(b) < 0) return -1;
+
+    struct sst_footer footer = { .count = b->count, .magic = SST_MAGIC };
+    uint64_t nbits = b->count * BLOOM_BITS_PER_KEY;
+    if (nbits < 64) nbits = 64;
+    footer.bloom_offset = b->data.size;
+    footer.bloom_size = (nbits + 7) / 8;
+    uint8_t *bits = calloc(1, footer.bloom_size);
+    if (!bits) return -1;
+    for (size_t i = 0; i < b->count; i++) {
+        bloom_set(bits, footer.bloom_size * 8, b->hashes[i]);
+    }
+    int rc = kvdb_buffer_append(&b->data, bits, footer.bloom_size);
+    free(bits);
+    if (rc < 0) return -1;
+
+    footer.index_offset = b->data.size;
+    footer.index_size = b->index.size;
+    if (kvdb_buffer_append(&b->data, b->index.data, b->index.size) < 0 ||
+        kvdb_buffer_append(&b->data, &footer, sizeof(footer)) < 0) {
+        return -1;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return -1;
+    if (kvdb_write_exact(fd, b->data.data, b->data.size, 0) < 0 || fdatasync(fd) < 0) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return close(fd);
+}
+
+// 打开的 SSTable：整个文件只读映射，块索引解析到内存
+struct sst_block {
+    const char *last_key;
+    uint32_t last_key_len;
+    uint32_t size;
+    uint64_t offset;
+};
+
+struct sst {
+    uint64_t number;
+    char *path;
+    int refs;           // 引用计数（受 lsm->lock 保护）
+    int obsolete;       // 已被压缩替换，最后一个引用释放时删除文件
+    char *map;
+    size_t size;        // 文件大小
+    uint64_t data_end;  // 数据块区域的结束位置
+    struct sst_block *blocks;
+    size_t nblocks;
+    const uint8_t *bloom;
+    uint64_t bloom_bits;
+    const char *smallest; // 最小键与最大键，用于按范围挑选文件
+    uint32_t smallest_len;
+    const char *largest;
+    uint32_t largest_len;
+};
+
+static void sst_close(struct sst *t) {
+    if (t->map) munmap(t->map, t->size);
+    if (t->obsolete) unlink(t->path);
+    free(t->blocks);
+    free(t->path);
+    free(t);
+}
+
+static struct sst *sst_open(const char *base, uint64_t number) {
+    struct sst *t = calloc(1, sizeof(struct sst));
+    if (!t) return NULL;
+    t->number = number;
+    t->refs = 0;
+    t->path = sst_path(base, number);
+    if (!t->path) goto fail;
+
+    int fd = open(t->path, O_RDONLY);
+    if (fd < 0) goto fail;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct sst_footer)) {
+        close(fd);
+        goto fail;
+    }
+    t->size = st.st_size;
+    t->map = mmap(NULL, t->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (t->map == MAP_FAILED) {
+        t->map = NULL;
+        goto fail;
+    }
+
+    // 布隆过滤器与块索引都必须落在页脚之前（写成减法，损坏的偏移不会溢出绕回）
+    struct sst_footer footer;
+    uint64_t limit = t->size - sizeof(footer);
+    memcpy(&footer, t->map + limit, sizeof(footer));
+    if (footer.magic != SST_MAGIC || footer.count == 0 ||
+        footer.index_offset > limit || footer.index_size > limit - footer.index_offset ||
+        footer.bloom_size == 0 || footer.bloom_offset > limit ||
+        footer.bloom_size > limit - footer.bloom_offset) {
+        goto corrupt;
+    }
+    t->data_end = footer.bloom_offset;
+    t->bloom = (const uint8_t *)t->map + footer.bloom_offset;
+    t->bloom_bits = footer.bloom_size * 8;
+
+    // 解析块索引
+    const char *p = t->map + footer.index_offset;
+    const char *end = p + footer.index_size;
+    size_t capacity = 0;
+    while (p + sizeof(struct sst_index_entry) <= end) {
+        struct sst_index_entry entry;
+        memcpy(&entry, p, sizeof(entry));
+        p += sizeof(entry);
+        if (entry.key_len > (size_t)(end - p) || entry.offset > t->data_end ||
+            entry.size > t->data_end - entry.offset) {
+            goto corrupt;
+        }
+        if (t->nblocks == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct sst_block *blocks = realloc(t->blocks, capacity * sizeof(struct sst_block));
+            if (!blocks) goto fail;
+            t->blocks = blocks;
+        }
+        t->blocks[t->nblocks++] = (struct sst_block) {
+            .last_key = p, .last_key_len = entry.key_len,
+            .size = entry.size, .offset = entry.offset,
+        };
+        p += entry.key_len;
+    }
+    if (t->nblocks == 0) goto corrupt;
+
+    uint32_t key_len;
+    memcpy(&key_len, t->map, sizeof(key_len));
+    if (t->data_end < ENTRY_HDR_SIZE || key_len > t->data_end - ENTRY_HDR_SIZE) {
+        goto corrupt;
+    }
+    t->smallest = t->map + ENTRY_HDR_SIZE;
+    t->smallest_len = key_len;
+    t->largest = t->blocks[t->nblocks - 1].last_key;
+    t->largest_len = t->blocks[t->nblocks - 1].last_key_len;
+    return t;
+
+corrupt:
+    errno = EIO;
+fail:
+    {
+        int err = errno;
+        sst_close(t);
+        errno = err;
+    }
+    return NULL;
+}
+
+// 二分查找第一个最后键不小于 key 的数据块，都小于 key 时返回 nblocks
+static size_t sst_find_block(const struct sst *t, const char *key, uint32_t key_len) {
+    size_t lo = 0, hi = t->nblocks;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const struct sst_block *b = &t->blocks[mid];
+        if (kvdb_key_compare(b->last_key, b->last_key_len, key, key_len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// 在 SSTable 中查找 key
+static int sst_get(struct sst *t, const char *key, uint32_t key_len, uint64_t hash,
+                   const char **value, uint32_t *value_len) {
+    if (kvdb_key_compare(key, key_len, t->smallest, t->smallest_len) < 0 ||
+        kvdb_key_compare(key, key_len, t->largest, t->largest_len) > 0 ||
+        !bloom_test(t->bloom, t->bloom_bits, hash)) {
+        return 0;
+    }
+
+    size_t lo = sst_find_block(t, key, key_len);
+    if (lo == t->nblocks) return 0;
+
+    // 块内顺序查找
+    const char *p = t->map + t->blocks[lo].offset;
+    const char *end = p + t->blocks[lo].size;
+    while (p < end) {
+        uint32_t k_len, v_len;
+        memcpy(&k_len, p, sizeof(k_len));
+        memcpy(&v_len, p + sizeof(k_len), sizeof(v_len));
+        int c = kvdb_key_compare(p + ENTRY_HDR_SIZE, k_len, key, key_len);
+        if (c == 0) {
+            *value = p + ENTRY_HDR_SIZE + k_len;
+            *value_len = v_len;
+            return 1;
+        }
+        if (c > 0) break;
+        p += ENTRY_HDR_SIZE + k_len + v_len;
+    }
+    return 0;
+}
+
+// 顺序遍历 SSTable 的全部条目
+struct sst_iter {
+    const char *p, *end;
+    const char *key, *value;
+    uint32_t key_len, value_len;
+    int valid;
+    int rank;           // 合并时的新旧顺序，越小越新
+};
+
+static void sst_iter_next(struct sst_iter *it) {
+    if (it->p >= it->end) {
+        it->valid = 0;
+        return;
+    }
+    memcpy(&it->key_len, it->p, sizeof(it->key_len));
+    memcpy(&it->value_len, it->p + sizeof(it->key_len), sizeof(it->value_len));
+    it->key = it->p + ENTRY_HDR_SIZE;
+    it->value = it->key + it->key_len;
+    it->p = it->value + it->value_len;
+    it->valid = 1;
+}
+
+static void sst_iter_init(struct sst_iter *it, const struct sst *t, int rank) {
+    it->p = t->map;
+    it->end = t->map + t->data_end;
+    it->rank = rank;
+    sst_iter_next(it);
+}
+
+// 定位到第一个不小于 key 的条目
+static void sst_iter_seek(struct sst_iter *it, const struct sst *t, const char *key,
+                          uint32_t key_len, int rank) {
+    size_t block = sst_find_block(t, key, key_len);
+    it->p = block < t->nblocks ? t->map + t->blocks[block].offset : t->map + t->data_end;
+    it->end = t->map + t->data_end;
+    it->rank = rank;
+    sst_iter_next(it);
+    while (it->valid && kvdb_key_compare(it->key, it->key_len, key, key_len) < 0) {
+        sst_iter_next(it);
+    }
+}
+
+// ------------------------------------------------------------------------
+// version：某一时刻全部 SSTable 的分层列表，创建后不再修改，读者持有引用访问
+
+struct version {
+    int refs;           // 受 lsm->lock 保护
+    struct sst **tables[LSM_LEVELS]; // L0 从新到旧；其余各层按最小键排序且互不重叠
+    size_t counts[LSM_LEVELS];
+};
+
+struct kvdb_lsm {
+    char *path;             // 预写日志路径，其余文件名都由它派生
+    struct kvdb_options wal_opts; // 预写日志的打开选项
+    struct kvdb_t wal;      // 当前预写日志
+
+    pthread_mutex_t lock;   // 保护以下字段
+    pthread_cond_t bg_cond;    // 唤醒后台线程
+    pthread_cond_t stall_cond; // 不可变内存表写完、L0 变少或写入者减少时广播
+    struct memtable *mem;   // 可写内存表
+    struct memtable *imm;   // 正在写成 SSTable 的不可变内存表
+    int writers;            // 已追加预写日志、尚未提交的 put 数
+    struct version *current;
+    uint64_t next_number;   // 下一个 SSTable 编号（只由后台线程分配）
+    size_t compact_ptr[LSM_LEVELS]; // 每层下一次挑选压缩文件的位置（轮转）
+    int error;              // 后台写盘失败的 errno，之后的写入都会失败
+    int closing;
+    pthread_t bg_thread;
+};
+
+// 释放尚未安装的版本（表的引用由已安装的版本持有）
+static void version_free(struct version *v) {
+    for (int level = 0; level < LSM_LEVELS; level++) free(v->tables[level]);
+    free(v);
+}
+
+// 二分查找 level（不小于 1）中第一个最大键不小于 key 的表，都小于 key 时返回该层表数
+static size_t level_find(const struct version *v, int level, const char *key, uint32_t key_len) {
+    size_t lo = 0, hi = v->counts[level];
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const struct sst *t = v->tables[level][mid];
+        if (kvdb_key_compare(t->largest, t->largest_len, key, key_len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void version_unref(struct version *v) {
+    if (--v->refs > 0) return;
+    for (int level = 0; level < LSM_LEVELS; level++) {
+        for (size_t i = 0; i < v->counts[level]; i++) {
+            struct sst *t = v->tables[level][i];
+            if (--t->refs == 0) sst_close(t);
+        }
+        free(v->tables[level]);
+    }
+    free(v);
+}
+
+static uint64_t level_bytes(const struct version *v, int level) {
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < v->counts[level]; i++) {
+        bytes += v->tables[level][i]->size;
+    }
+    return bytes;
+}
+
+static uint64_t level_max_bytes(int level) {
+    uint64_t bytes = L1_MAX_BYTES;
+    while (--level > 0) bytes *= 10;
+    return bytes;
+}
+
+static int cmp_smallest(const void *a, const void *b) {
+    const struct sst *x = *(struct sst *const *)a;
+    const struct sst *y = *(struct sst *const *)b;
+    return kvdb_key_compare(x->smallest, x->smallest_len, y->smallest, y->smallest_len);
+}
+
+// 复制 v 的表列表，去掉 removed 中的表（新版本尚未增加引用）
+static struct version *version_edit(const struct version *v, struct sst **removed, size_t nremoved) {
+    struct version *nv = calloc(1, sizeof(struct version));
+    if (!nv) return NULL;
+    nv->refs = 1;
+    for (int level = 0; level < LSM_LEVELS; level++) {
+        nv->tables[level] = malloc((v->counts[level] + 1) * sizeof(struct sst *));
+        if (!nv->tables[level]) goto fail;
+        for (size_t i = 0; i < v->counts[level]; i++) {
+            struct sst *t = v->tables[level][i];
+            int keep = 1;
+            for (size_t j = 0; j < nremoved; j++) {
+                if (removed[j] == t) keep = 0;
+            }
+            if (keep) nv->tables[level][nv->counts[level]++] = t;
+        }
+    }
+    return nv;
+fail:
+    version_free(nv);
+    return NULL;
+}
+
+// 向新版本的某层加入表
+static int version_add(struct version *v, int level, struct sst **tables, size_t n) {
+    struct sst **p = realloc(v->tables[level], (v->counts[level] + n + 1) * sizeof(struct sst *));
+    if (!p) return -1;
+    v->tables[level] = p;
+    if (level == 0) {
+        // L0 新表放在最前
+        memmove(p + n, p, v->counts[level] * sizeof(struct sst *));
+        memcpy(p, tables, n * sizeof(struct sst *));
+        v->counts[level] += n;
+    } else {
+        memcpy(p + v->counts[level], tables, n * sizeof(struct sst *));
+        v->counts[level] += n;
+        qsort(p, v->counts[level], sizeof(struct sst *), cmp_smallest);
+    }
+    return 0;
+}
+
+// 按层写出 manifest：先写临时文件、落盘后改名
+static int manifest_write(struct kvdb_lsm *lsm, const struct version *v) {
+    char *path = kvdb_path_join(lsm->path, MANIFEST_SUFFIX);
+    char *tmp = kvdb_path_join(lsm->path, MANIFEST_SUFFIX ".tmp");
+    int ret = -1;
+    FILE *fp = NULL;
+    if (!path || !tmp || !(fp = fopen(tmp, "w"))) goto out;
+
+    fprintf(fp, "next %llu\n", (unsigned long long)lsm->next_number);
+    for (int level = 0; level < LSM_LEVELS; level++) {
+        for (size_t i = 0; i < v->counts[level]; i++) {
+            fprintf(fp, "%d %llu\n", level, (unsigned long long)v->tables[level][i]->number);
+        }
+    }
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) goto out;
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        goto out;
+    }
+    fp = NULL;
+    if (rename(tmp, path) < 0) goto out;
+    kvdb_sync_parent_dir(path);
+    ret = 0;
+out:
+    if (fp) fclose(fp);
+    free(path);
+    free(tmp);
+    return ret;
+}
+
+// 读取 manifest 并打开其中的 SSTable
+static int manifest_load(struct kvdb_lsm *lsm) {
+    char *path = kvdb_path_join(lsm->path, MANIFEST_SUFFIX);
+    if (!path) return -1;
+    FILE *fp = fopen(path, "r");
+    free(path);
+    if (!fp) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    int ret = 0;
+    char line[64];
+    while (ret == 0 && fgets(line, sizeof(line), fp)) {
+        unsigned long long number;
+        int level;
+        if (sscanf(line, "next %llu", &number) == 1) {
+            lsm->next_number = number;
+        } else if (sscanf(line, "%d %llu", &level, &number) == 2 &&
+                   level >= 0 && level < LSM_LEVELS) {
+            struct sst *t = sst_open(lsm->path, number);
+            if (!t || version_add(lsm->current, level, &t, 1) < 0) {
+                if (t) sst_close(t);
+                ret = -1;
+                break;
+            }
+            t->refs++;
+        }
+    }
+    fclose(fp);
+
+    // version_add 对 L0 逐个前插，恢复 manifest 中从新到旧的顺序
+    struct version *v = lsm->current;
+    for (size_t i = 0; i < v->counts[0] / 2; i++) {
+        struct sst *t = v->tables[0][i];
+        v->tables[0][i] = v->tables[0][v->counts[0] - 1 - i];
+        v->tables[0][v->counts[0] - 1 - i] = t;
+    }
+    return ret;
+}
+
+// 删除不在 manifest 中的 SSTable（上次写表或压缩中途崩溃留下的）
+static void remove_orphans(struct kvdb_lsm *lsm) {
+    char *copy = strdup(lsm->path);
+    if (!copy) return;
+    const char *dir = ".", *base = copy;
+    char *slash = strrchr(copy, '/');
+    if (slash) {
+        *slash = '\0';
+        dir = slash == copy ? "/" : copy;
+        base = slash + 1;
+    }
+
+    DIR *d = opendir(dir);
+    if (d) {
+        size_t base_len = strlen(base);
+        struct dirent *e;
+        while ((e = readdir(d))) {
+            if (strncmp(e->d_name, base, base_len) != 0 ||
+                strncmp(e->d_name + base_len, ".sst.", 5) != 0) {
+                continue;
+            }
+            uint64_t number = strtoull(e->d_name + base_len + 5, NULL, 10);
+            int live = 0;
+            for (int level = 0; level < LSM_LEVELS; level++) {
+                for (size_t i = 0; i < lsm->current->counts[level]; i++) {
+                    if (lsm->current->tables[level][i]->number == number) live = 1;
+                }
+            }
+            if (!live) {
+                char *path = sst_path(lsm->path, number);
+                if (path) unlink(path);
+                free(path);
+            }
+        }
+        closedir(d);
+    }
+    free(copy);
+}
+
+// 安装新版本：新表增加引用，被替换的表标记为过期（调用时持有 lsm->lock）
+static void version_install(struct kvdb_lsm *lsm, struct version *v,
+                            struct sst **removed, size_t nremoved) {
+    for (int level = 0; level < LSM_LEVELS; level++) {
+        for (size_t i = 0; i < v->counts[level]; i++) {
+            v->tables[level][i]->refs++;
+        }
+    }
+    for (size_t i = 0; i < nremoved; i++) {
+        removed[i]->obsolete = 1;
+    }
+    struct version *old = lsm->current;
+    lsm->current = v;
+    version_unref(old);
+    pthread_cond_broadcast(&lsm->stall_cond);
+}
+
+// ------------------------------------------------------------------------
+// 后台线程：把不可变内存表写成 L0 的 SSTable，并按层压缩
+
+// 把不可变内存表写成一个新的 L0 表
+static int flush_memtable(struct kvdb_lsm *lsm) {
+    struct memtable *imm = lsm->imm; // 不可变，读者只在持锁时访问
+    struct sst_builder b = {0};
+    struct sst *t = NULL;
+    uint64_t number = lsm->next_number++;
+    char *path = sst_path(lsm->path, number);
+    int ret = -1;
+    if (!path) goto out;
+
+    for (struct kvdb_skipnode *n = imm->list.head->next[0]; n; n = n->next[0]) {
+        if (builder_add(&b, kvdb_skipnode_key(n), n->key_len,
+                        kvdb_skipnode_value(n), n->value_len) < 0) {
+            goto out;
+        }
+    }
+    if (imm->count > 0) {
+        if (builder_write(&b, path) < 0 || !(t = sst_open(lsm->path, number))) goto out;
+    }
+
+    pthread_mutex_lock(&lsm->lock);
+    struct version *v = version_edit(lsm->current, NULL, 0);
+    pthread_mutex_unlock(&lsm->lock);
+    if (!v || (t && version_add(v, 0, &t, 1) < 0) || manifest_write(lsm, v) < 0) {
+        if (v) version_free(v);
+        goto out;
+    }
+
+    // 新表已记录在 manifest 中，旧的预写日志不再需要
+    char *imm_path = kvdb_path_join(lsm->path, IMM_SUFFIX);
+    if (imm_path) unlink(imm_path);
+    free(imm_path);
+
+    pthread_mutex_lock(&lsm->lock);
+    version_install(lsm, v, NULL, 0);
+    lsm->imm = NULL;
+    pthread_mutex_unlock(&lsm->lock);
+    mem_free(imm);
+    t = NULL;
+    ret = 0;
+out:
+    if (t) sst_close(t);
+    builder_free(&b);
+    free(path);
+    return ret;
+}
+
+// 一次压缩：inputs[0] 来自 level，inputs[1] 是 level + 1 中与之重叠的表
+struct compaction {
+    int level;
+    struct sst **inputs[2];
+    size_t counts[2];
+};
+
+static void compaction_free(struct compaction *c) {
+    free(c->inputs[0]);
+    free(c->inputs[1]);
+}
+
+static int overlaps(const struct sst *t, const char *lo, uint32_t lo_len,
+                    const char *hi, uint32_t hi_len) {
+    return kvdb_key_compare(t->largest, t->largest_len, lo, lo_len) >= 0 &&
+           kvdb_key_compare(t->smallest, t->smallest_len, hi, hi_len) <= 0;
+}
+
+// 挑选需要压缩的层与文件，没有时返回 0（只由后台线程调用）
+static int pick_compaction(struct kvdb_lsm *lsm, struct compaction *c) {
+    struct version *v = lsm->current;
+    memset(c, 0, sizeof(*c));
+    c->level = -1;
+    if (v->counts[0] >= L0_COMPACT_TRIGGER) {
+        c->level = 0;
+    } else {
+        for (int level = 1; level < LSM_LEVELS - 1; level++) {
+            if (level_bytes(v, level) > level_max_bytes(level)) {
+                c->level = level;
+                break;
+            }
+        }
+    }
+    if (c->level < 0) return 0;
+
+    int level = c->level;
+    c->inputs[0] = malloc(v->counts[level] * sizeof(struct sst *));
+    c->inputs[1] = malloc((v->counts[level + 1] + 1) * sizeof(struct sst *));
+    if (!c->inputs[0] || !c->inputs[1]) {
+        compaction_free(c);
+        return 0;
+    }
+    if (level == 0) {
+        // L0 的表互相重叠，全部参与
+        memcpy(c->inputs[0], v->tables[0], v->counts[0] * sizeof(struct sst *));
+        c->counts[0] = v->counts[0];
+    } else {
+        c->inputs[0][0] = v->tables[level][lsm->compact_ptr[level]++ % v->counts[level]];
+        c->counts[0] = 1;
+    }
+
+    // 输入的键范围
+    const char *lo = c->inputs[0][0]->smallest, *hi = c->inputs[0][0]->largest;
+    uint32_t lo_len = c->inputs[0][0]->smallest_len, hi_len = c->inputs[0][0]->largest_len;
+    for (size_t i = 1; i < c->counts[0]; i++) {
+        struct sst *t = c->inputs[0][i];
+        if (kvdb_key_compare(t->smallest, t->smallest_len, lo, lo_len) < 0) {
+            lo = t->smallest;
+            lo_len = t->smallest_len;
+        }
+        if (kvdb_key_compare(t->largest, t->largest_len, hi, hi_len) > 0) {
+            hi = t->largest;
+            hi_len = t->largest_len;
+        }
+    }
+    for (size_t i = 0; i < v->counts[level + 1]; i++) {
+        struct sst *t = v->tables[level + 1][i];
+        if (overlaps(t, lo, lo_len, hi, hi_len)) {
+            c->inputs[1][c->counts[1]++] = t;
+        }
+    }
+    return 1;
+}
+
+// 写出一个压缩输出表并加入 outputs
+static int emit_table(struct kvdb_lsm *lsm, struct sst_builder *b,
+                      struct sst ***outputs, size_t *noutputs) {
+    if (b->count == 0) return 0;
+    uint64_t number = lsm->next_number++;
+    char *path = sst_path(lsm->path, number);
+    struct sst *t = NULL;
+    if (!path || builder_write(b, path) < 0 || !(t = sst_open(lsm->path, number))) {
+        free(path);
+        return -1;
+    }
+    free(path);
+    builder_free(b);
+
+    struct sst **p = realloc(*outputs, (*noutputs + 1) * sizeof(struct sst *));
+    if (!p) {
+        t->obsolete = 1;
+        sst_close(t);
+        return -1;
+    }
+    p[(*noutputs)++] = t;
+    *outputs = p;
+    return 0;
+}
+
+// 多路归并输入表，相同的键只保留最新版本，结果切分成若干输出表
+static int merge_inputs(struct kvdb_lsm *lsm, struct compaction *c,
+                        struct sst ***outputs, size_t *noutputs) {
+    size_t n = c->counts[0] + c->counts[1];
+    struct sst_iter *its = malloc((n + 1) * sizeof(struct sst_iter));
+    struct sst_builder b = {0};
+    int ret = -1;
+    if (!its) return -1;
+    for (size_t i = 0; i < c->counts[0]; i++) {
+        sst_iter_init(&its[i], c->inputs[0][i], i);
+    }
+    for (size_t i = 0; i < c->counts[1]; i++) {
+        sst_iter_init(&its[c->counts[0] + i], c->inputs[1][i], c->counts[0]);
+    }
+
+    while (1) {
+        struct sst_iter *best = NULL;
+        for (size_t i = 0; i < n; i++) {
+            if (!its[i].valid) continue;
+            int cmp = best ? kvdb_key_compare(its[i].key, its[i].key_len, best->key, best->key_len) : -1;
+            if (cmp < 0 || (cmp == 0 && its[i].rank < best->rank)) best = &its[i];
+        }
+        if (!best) break;
+
+        const char *key = best->key;
+        uint32_t key_len = best->key_len;
+        if (builder_add(&b, key, key_len, best->value, best->value_len) < 0) goto out;
+        for (size_t i = 0; i < n; i++) {
+            if (&its[i] != best && its[i].valid &&
+                kvdb_key_compare(its[i].key, its[i].key_len, key, key_len) == 0) {
+                sst_iter_next(&its[i]);
+            }
+        }
+        sst_iter_next(best);
+
+        if (b.data.size >= SST_TARGET_SIZE && emit_table(lsm, &b, outputs, noutputs) < 0) {
+            goto out;
+        }
+    }
+    ret = emit_table(lsm, &b, outputs, noutputs);
+out:
+    builder_free(&b);
+    free(its);
+    return ret;
+}
+
+// 执行一次压缩并安装新版本：去掉全部输入表，输出加入 level + 1
+static int run_compaction(struct kvdb_lsm *lsm, struct compaction *c) {
+    // 上层只有一个输入表且与下一层不重叠时直接移动，不必重写
+    int moved = c->level > 0 && c->counts[1] == 0;
+    struct sst **outputs = NULL;
+    size_t noutputs = 0;
+    size_t nremoved = c->counts[0] + c->counts[1];
+    struct sst **removed = malloc((nremoved + 1) * sizeof(struct sst *));
+    struct version *v = NULL;
+    int ret = -1;
+    if (!removed) return -1;
+    memcpy(removed, c->inputs[0], c->counts[0] * sizeof(struct sst *));
+    memcpy(removed + c->counts[0], c->inputs[1], c->counts[1] * sizeof(struct sst *));
+
+    if (moved) {
+        outputs = malloc(sizeof(struct sst *));
+        if (!outputs) goto out;
+        outputs[noutputs++] = c->inputs[0][0];
+    } else if (merge_inputs(lsm, c, &outputs, &noutputs) < 0) {
+        goto out;
+    }
+
+    pthread_mutex_lock(&lsm->lock);
+    v = version_edit(lsm->current, removed, nremoved);
+    pthread_mutex_unlock(&lsm->lock);
+    if (!v || version_add(v, c->level + 1, outputs, noutputs) < 0 || manifest_write(lsm, v) < 0) {
+        goto out;
+    }
+
+    pthread_mutex_lock(&lsm->lock);
+    version_install(lsm, v, removed, moved ? 0 : nremoved); // 移动的表仍在使用
+    pthread_mutex_unlock(&lsm->lock);
+    v = NULL;
+    noutputs = 0;
+    ret = 0;
+
+out:
+    if (v) version_free(v);
+    if (!moved) {
+        // 失败时删除已写出的输出表
+        for (size_t i = 0; i < noutputs; i++) {
+            outputs[i]->obsolete = 1;
+            sst_close(outputs[i]);
+        }
+    }
+    free(outputs);
+    free(removed);
+    return ret;
+}
+
+static void *bg_thread(void *arg) {
+    struct kvdb_lsm *lsm = arg;
+    pthread_mutex_lock(&lsm->lock);
+    while (1) {
+        struct compaction c;
+        int rc;
+        if (lsm->imm && !lsm->error) {
+            pthread_mutex_unlock(&lsm->lock);
+            rc = flush_memtable(lsm);
+            pthread_mutex_lock(&lsm->lock);
+        } else if (!lsm->closing && !lsm->error && pick_compaction(lsm, &c)) {
+            pthread_mutex_unlock(&lsm->lock);
+            rc = run_compaction(lsm, &c);
+            compaction_free(&c);
+            pthread_mutex_lock(&lsm->lock);
+        } else if (lsm->closing) {
+            break;
+        } else {
+            pthread_cond_wait(&lsm->bg_cond, &lsm->lock);
+            continue;
+        }
+        if (rc < 0) {
+            // 写盘失败：停止后台工作，唤醒等待的写入者返回错误
+            lsm->error = errno ? errno : EIO;
+            pthread_cond_broadcast(&lsm->stall_cond);
+        }
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    return NULL;
+}
+
+// ------------------------------------------------------------------------
+// 对外接口
+
+// 内存表写满：转为不可变并切换到新的预写日志（调用时持有 lsm->lock）
+static int rotate_memtable(struct kvdb_lsm *lsm) {
+    // 等待上一张不可变内存表写完、L0 不过多，且没有 put 仍在使用当前预写日志
+    while (!lsm->error && (lsm->imm || lsm->writers > 0 ||
+                           lsm->current->counts[0] >= L0_STOP_WRITES)) {
+        pthread_cond_wait(&lsm->stall_cond, &lsm->lock);
+    }
+    if (lsm->error) {
+        errno = lsm->error;
+        return -1;
+    }
+    if (lsm->mem->bytes < MEMTABLE_SIZE) {
+        return 0; // 其他线程已经切换过
+    }
+
+    struct memtable *mem = mem_new();
+    char *imm_path = kvdb_path_join(lsm->path, IMM_SUFFIX);
+    if (!mem || !imm_path) {
+        mem_free(mem);
+        free(imm_path);
+        return -1;
+    }
+
+    // 关闭旧日志（写出剩余记录）后改名为 path.imm，再在 path 上打开新日志
+    int rc = kvdb_close(&lsm->wal);
+    if (rc == 0) rc = rename(lsm->path, imm_path);
+    if (rc == 0) {
+        kvdb_sync_parent_dir(lsm->path);
+        rc = kvdb_wal_open(&lsm->wal, lsm->path, &lsm->wal_opts, NULL, NULL);
+    }
+    free(imm_path);
+    if (rc < 0) {
+        lsm->error = errno ? errno : EIO;
+        mem_free(mem);
+        return -1;
+    }
+
+    lsm->imm = lsm->mem;
+    lsm->mem = mem;
+    pthread_cond_signal(&lsm->bg_cond);
+    return 0;
+}
+
+struct kvdb_lsm *kvdb_lsm_open(const char *path, const struct kvdb_options *opts) {
+    struct kvdb_lsm *lsm = calloc(1, sizeof(struct kvdb_lsm));
+    if (!lsm) return NULL;
+    lsm->path = strdup(path);
+    lsm->wal_opts = *opts;
+    lsm->wal_opts.engine = KVDB_ENGINE_LOG;
+    lsm->next_number = 1;
+    lsm->current = calloc(1, sizeof(struct version));
+    lsm->mem = mem_new();
+    pthread_mutex_init(&lsm->lock, NULL);
+    pthread_cond_init(&lsm->bg_cond, NULL);
+    pthread_cond_init(&lsm->stall_cond, NULL);
+    if (!lsm->path || !lsm->current || !lsm->mem) goto fail;
+    lsm->current->refs = 1;
+
+    if (manifest_load(lsm) < 0) goto fail;
+    remove_orphans(lsm);
+
+    // 上次没来得及写成 SSTable 的不可变内存表
+    char *imm_path = kvdb_path_join(lsm->path, IMM_SUFFIX);
+    if (!imm_path) goto fail;
+    if (access(imm_path, F_OK) == 0) {
+        struct kvdb_t imm_wal;
+        lsm->imm = mem_new();
+        if (!lsm->imm ||
+            kvdb_wal_open(&imm_wal, imm_path, &lsm->wal_opts, replay_into, lsm->imm) < 0) {
+            free(imm_path);
+            goto fail;
+        }
+        kvdb_close(&imm_wal);
+    }
+    free(imm_path);
+
+    if (kvdb_wal_open(&lsm->wal, lsm->path, &lsm->wal_opts, replay_into, lsm->mem) < 0) {
+        goto fail;
+    }
+    if (pthread_create(&lsm->bg_thread, NULL, bg_thread, lsm) != 0) {
+        kvdb_close(&lsm->wal);
+        goto fail;
+    }
+    return lsm;
+
+fail:
+    if (lsm->current) version_unref(lsm->current);
+    mem_free(lsm->mem);
+    mem_free(lsm->imm);
+    pthread_mutex_destroy(&lsm->lock);
+    pthread_cond_destroy(&lsm->bg_cond);
+    pthread_cond_destroy(&lsm->stall_cond);
+    free(lsm->path);
+    free(lsm);
+    return NULL;
+}
+
+// 持锁追加预写日志并插入内存表，保证两者中同一个键的先后顺序一致
+static int lsm_append_locked(struct kvdb_lsm *lsm, const char *key, uint32_t key_len,
+                             const char *value, uint32_t value_len, uint64_t *end) {
+    if (lsm->error) {
+        errno = lsm->error;
+        return -1;
+    }
+    if (lsm->mem->bytes >= MEMTABLE_SIZE && rotate_memtable(lsm) < 0) {
+        return -1;
+    }
+    if (kvdb_wal_append(&lsm->wal, key, key_len, value, value_len, end) < 0 ||
+        mem_put(lsm->mem, key, key_len, value, value_len) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// 释放锁，在锁外按持久化级别提交到 end，并发的 put 共享一次组提交
+static int lsm_commit_unlock(struct kvdb_lsm *lsm, uint64_t end) {
+    lsm->writers++;
+    pthread_mutex_unlock(&lsm->lock);
+
+    int ret = kvdb_wal_commit(&lsm->wal, end);
+
+    pthread_mutex_lock(&lsm->lock);
+    if (--lsm->writers == 0) {
+        pthread_cond_broadcast(&lsm->stall_cond);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    return ret;
+}
+
+int kvdb_lsm_put(struct kvdb_lsm *lsm, const char *key, uint32_t key_len,
+                 const char *value, uint32_t value_len) {
+    uint64_t end;
+    pthread_mutex_lock(&lsm->lock);
+    if (lsm_append_locked(lsm, key, key_len, value, value_len, &end) < 0) {
+        pthread_mutex_unlock(&lsm->lock);
+        return -1;
+    }
+    return lsm_commit_unlock(lsm, end);
+}
+
+int kvdb_lsm_put_batch(struct kvdb_lsm *lsm, const char *const keys[],
+                       const char *const values[], size_t n) {
+    uint64_t end = 0;
+    int ret = 0;
+    size_t i;
+    pthread_mutex_lock(&lsm->lock);
+    for (i = 0; i < n; i++) {
+        if (lsm_append_locked(lsm, keys[i], strlen(keys[i]), values[i], strlen(values[i]), &end) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    if (i == 0) {
+        pthread_mutex_unlock(&lsm->lock);
+        return ret;
+    }
+    // 中途失败时已追加的记录仍然提交
+    if (lsm_commit_unlock(lsm, end) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+int kvdb_lsm_get(struct kvdb_lsm *lsm, const char *key, uint32_t key_len,
+                 char *buf, size_t length, size_t *value_len) {
+    const char *value = NULL;
+    uint32_t len = 0;
+
+    // 先查内存表
+    pthread_mutex_lock(&lsm->lock);
+    struct kvdb_skipnode *node = mem_get(lsm->mem, key, key_len);
+    if (!node && lsm->imm) {
+        node = mem_get(lsm->imm, key, key_len);
+    }
+    if (node) {
+        *value_len = node->value_len;
+        memcpy(buf, kvdb_skipnode_value(node), node->value_len < length ? node->value_len : length);
+        pthread_mutex_unlock(&lsm->lock);
+        return 0;
+    }
+    struct version *v = lsm->current;
+    v->refs++;
+    pthread_mutex_unlock(&lsm->lock);
+
+    // 再按从新到旧的顺序查 SSTable：L0 逐个查找，其余各层二分定位唯一可能的表
+    uint64_t hash = kvdb_hash(key, key_len);
+    int found = 0;
+    for (size_t i = 0; !found && i < v->counts[0]; i++) {
+        found = sst_get(v->tables[0][i], key, key_len, hash, &value, &len);
+    }
+    for (int level = 1; !found && level < LSM_LEVELS; level++) {
+        size_t lo = level_find(v, level, key, key_len);
+        if (lo < v->counts[level]) {
+            found = sst_get(v->tables[level][lo], key, key_len, hash, &value, &len);
+        }
+    }
+    if (found) {
+        *value_len = len;
+        memcpy(buf, value, len < length ? len : length);
+    }
+
+    pthread_mutex_lock(&lsm->lock);
+    version_unref(v);
+    pthread_mutex_unlock(&lsm->lock);
+    return found ? 0 : -1;
+}
+
+// ------------------------------------------------------------------------
+// 范围扫描：内存表只能持锁访问，先把范围内的一段复制出来，再引用当前版本，
+// 在锁外与各个 SSTable 多路归并
+
+// 归并的一路输入：内存表的副本、一个 L0 表，或 L1 及以下的一整层（层内各表首尾相接）
+struct scan_source {
+    struct sst_iter it;
+    struct sst *const *tables; // 同一层中后面的表
+    size_t ntables;
+};
+
+static void source_next(struct scan_source *s) {
+    sst_iter_next(&s->it);
+    while (!s->it.valid && s->ntables > 0) {
+        sst_iter_init(&s->it, s->tables[0], s->it.rank);
+        s->tables++;
+        s->ntables--;
+    }
+}
+
+// 把内存表中 scan 范围内的条目复制到 out，复制满 budget 字节为止；没有复制完时返回 1，
+// *last 为最后一项在 out 中的位置（调用时持有 lsm->lock）
+static int mem_copy_range(struct memtable *mem, const struct kvdb_scan *scan,
+                          struct write_buffer *out, size_t *last) {
+    struct kvdb_skipnode *n = kvdb_skiplist_seek(&mem->list, scan->from, scan->from_len, NULL);
+    for (; n; n = n->next[0]) {
+        const char *key = kvdb_skipnode_key(n);
+        if (scan->end && kvdb_key_compare(key, n->key_len, scan->end, scan->end_len) >= 0) {
+            return 0;
+        }
+        if (scan->after && kvdb_key_compare(key, n->key_len, scan->from, scan->from_len) == 0) {
+            continue;
+        }
+        if (out->size >= scan->budget) {
+            return 1;
+        }
+        *last = out->size;
+        if (kvdb_scan_append(out, key, n->key_len, kvdb_skipnode_value(n), n->value_len) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int kvdb_lsm_scan(struct kvdb_lsm *lsm, struct kvdb_scan *scan, struct write_buffer *batch) {
+    struct write_buffer copies[2] = {{0}}; // 可写与不可变内存表的副本
+    struct scan_source *srcs = NULL;
+    const char *limit = NULL;   // 内存表副本没有复制完时，本批不能越过的键
+    uint32_t limit_len = 0;
+    int ret = -1;
+
+    pthread_mutex_lock(&lsm->lock);
+    struct memtable *mems[2] = { lsm->mem, lsm->imm };
+    size_t last[2];
+    int truncated[2] = { 0, 0 };
+    for (int i = 0; i < 2; i++) {
+        if (mems[i] && (truncated[i] = mem_copy_range(mems[i], scan, &copies[i], &last[i])) < 0) {
+            pthread_mutex_unlock(&lsm->lock);
+            goto out_free;
+        }
+    }
+    struct version *v = lsm->current;
+    v->refs++;
+    pthread_mutex_unlock(&lsm->lock);
+
+    for (int i = 0; i < 2; i++) {
+        if (!truncated[i]) continue;
+        uint32_t key_len;
+        memcpy(&key_len, copies[i].data + last[i], sizeof(key_len));
+        const char *key = copies[i].data + last[i] + ENTRY_HDR_SIZE;
+        if (!limit || kvdb_key_compare(key, key_len, limit, limit_len) < 0) {
+            limit = key;
+            limit_len = key_len;
+        }
+    }
+
+    // 从新到旧：可写内存表、不可变内存表、L0 从新到旧、L1 及以下各层
+    size_t nsrcs = 0;
+    srcs = calloc(2 + v->counts[0] + LSM_LEVELS, sizeof(struct scan_source));
+    if (!srcs) goto out;
+    for (int i = 0; i < 2; i++, nsrcs++) {
+        srcs[nsrcs].it.p = copies[i].data;
+        srcs[nsrcs].it.end = copies[i].data + copies[i].size;
+        srcs[nsrcs].it.rank = nsrcs;
+        sst_iter_next(&srcs[nsrcs].it);
+    }
+    for (size_t i = 0; i < v->counts[0]; i++, nsrcs++) {
+        sst_iter_seek(&srcs[nsrcs].it, v->tables[0][i], scan->from, scan->from_len, nsrcs);
+    }
+    for (int level = 1; level < LSM_LEVELS; level++) {
+        size_t lo = level_find(v, level, scan->from, scan->from_len);
+        if (lo == v->counts[level]) continue;
+        struct scan_source *s = &srcs[nsrcs];
+        sst_iter_seek(&s->it, v->tables[level][lo], scan->from, scan->from_len, nsrcs++);
+        s->tables = &v->tables[level][lo + 1];
+        s->ntables = v->counts[level] - lo - 1;
+    }
+
+    scan->done = 0;
+    while (1) {
+        struct scan_source *best = NULL;
+        for (size_t i = 0; i < nsrcs; i++) {
+            if (!srcs[i].it.valid) continue;
+            int cmp = best ? kvdb_key_compare(srcs[i].it.key, srcs[i].it.key_len,
+                                          best->it.key, best->it.key_len) : -1;
+            if (cmp < 0 || (cmp == 0 && srcs[i].it.rank < best->it.rank)) best = &srcs[i];
+        }
+        const char *key = best ? best->it.key : NULL;
+        uint32_t key_len = best ? best->it.key_len : 0;
+        if (!best || (scan->end && kvdb_key_compare(key, key_len, scan->end, scan->end_len) >= 0)) {
+            scan->done = 1;
+            break;
+        }
+        // 越过内存表副本的末尾后，副本之外的较新版本可能被漏掉：留给下一批重新复制
+        if (limit && kvdb_key_compare(key, key_len, limit, limit_len) > 0) break;
+        if (!scan->after || kvdb_key_compare(key, key_len, scan->from, scan->from_len) != 0) {
+            if (batch->size > 0 &&
+                batch->size + KVDB_SCAN_HDR_SIZE + key_len + best->it.value_len > scan->budget) {
+                break;
+            }
+            if (kvdb_scan_append(batch, key, key_len, best->it.value, best->it.value_len) < 0) {
+                goto out;
+            }
+        }
+        for (size_t i = 0; i < nsrcs; i++) {
+            if (&srcs[i] != best && srcs[i].it.valid &&
+                kvdb_key_compare(srcs[i].it.key, srcs[i].it.key_len, key, key_len) == 0) {
+                source_next(&srcs[i]);
+            }
+        }
+        source_next(best);
+    }
+    ret = 0;
+
+out:
+    pthread_mutex_lock(&lsm->lock);
+    version_unref(v);
+    pthread_mutex_unlock(&lsm->lock);
+out_free:
+    free(srcs);
+    free(copies[0].data);
+    free(copies[1].data);
+    return ret;
+}
+
+int kvdb_lsm_flush(struct kvdb_lsm *lsm) {
+    // 计为写入者，防止刷新期间切换预写日志
+    pthread_mutex_lock(&lsm->lock);
+    lsm->writers++;
+    pthread_mutex_unlock(&lsm->lock);
+
+    int ret = kvdb_flush(&lsm->wal);
+
+    pthread_mutex_lock(&lsm->lock);
+    if (--lsm->writers == 0) {
+        pthread_cond_broadcast(&lsm->stall_cond);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    return ret;
+}
+
+int kvdb_lsm_close(struct kvdb_lsm *lsm) {
+    // 后台线程写完不可变内存表后退出；可写内存表留在预写日志中，下次打开时重放
+    pthread_mutex_lock(&lsm->lock);
+    lsm->closing = 1;
+    pthread_cond_signal(&lsm->bg_cond);
+    pthread_mutex_unlock(&lsm->lock);
+    pthread_join(lsm->bg_thread, NULL);
+
+    int ret = kvdb_close(&lsm->wal);
+    if (lsm->error) ret = -1;
+    version_unref(lsm->current);
+    mem_free(lsm->mem);
+    mem_free(lsm->imm);
+    pthread_mutex_destroy(&lsm->lock);
+    pthread_cond_destroy(&lsm->bg_cond);
+    pthread_cond_destroy(&lsm->stall_cond);
+    free(lsm->path);
+    free(lsm);
+    return ret;
+}
@@ -0,0 +1,120 @@
+#ifndef KVDB_LSM_H
+#define KVDB_LSM_H
+
+// kvdb.c 与 kvdb_lsm.c 之间的内部接口，不对外公开
+
+#include "kvdb.h"
+#include <string.h>
+#include <sys/types.h>
+
+// 64 位键哈希，保证结果非 0
+uint64_t kvdb_hash(const void *key, size_t len);
+
+// 按字节序比较两个键，较短的键是较长键的前缀时较小
+static inline int kvdb_key_compare(const char *a, uint32_t a_len, const char *b, uint32_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c != 0) return c;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+// 从 offset 开始写入全部 count 字节
+int kvdb_write_exact(int fd, const void *buf, size_t count, off_t offset);
+// 向缓冲区末尾追加 len 字节，容量不足时倍增
+int kvdb_buffer_append(struct write_buffer *buf, const void *data, size_t len);
+// base + suffix，失败返回 NULL
+char *kvdb_path_join(const char *base, const char *suffix);
+// 同步 path 所在目录，保证改名与新建文件落盘
+int kvdb_sync_parent_dir(const char *path);
+
+// 跳表：节点保存键与附带数据的副本，按键的字节序排列。
+// 只有一个写者（由调用者加锁）修改：先写好节点再自底向上原子地链入，读者可以无锁遍历
+#define KVDB_SKIPLIST_HEIGHT 16
+
+struct kvdb_skipnode {
+    uint32_t key_len;
+    uint32_t value_len;         // 附带数据的长度
+    int height;
+    struct kvdb_skipnode *next[]; // 每层的后继；之后依次存放附带数据（8 字节对齐）与键
+};
+
+struct kvdb_skiplist {
+    struct kvdb_skipnode *head;
+    uint64_t rand;              // 选层用的随机数状态
+};
+
+static inline const char *kvdb_skipnode_value(const struct kvdb_skipnode *node) {
+    return (const char *)&node->next[node->height];
+}
+
+static inline const char *kvdb_skipnode_key(const struct kvdb_skipnode *node) {
+    return kvdb_skipnode_value(node) + node->value_len;
+}
+
+static inline struct kvdb_skipnode *kvdb_skipnode_next(const struct kvdb_skipnode *node, int level) {
+    return __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE);
+}
+
+// 节点连同键与附带数据占用的字节数
+static inline size_t kvdb_skipnode_size(const struct kvdb_skipnode *node) {
+    return sizeof(struct kvdb_skipnode) + node->height * sizeof(struct kvdb_skipnode *) +
+           node->key_len + node->value_len;
+}
+
+int kvdb_skiplist_init(struct kvdb_skiplist *list);
+void kvdb_skiplist_destroy(struct kvdb_skiplist *list);
+// 新节点的随机高度：每升一层的概率为 1/4
+int kvdb_skiplist_height(struct kvdb_skiplist *list);
+struct kvdb_skipnode *kvdb_skipnode_new(int height, const char *key, uint32_t key_len,
+                                        const void *value, uint32_t value_len);
+// 返回第一个不小于 key 的节点；prev 非空时记录每层最后一个小于 key 的节点
+struct kvdb_skipnode *kvdb_skiplist_seek(const struct kvdb_skiplist *list, const char *key,
+                                         uint32_t key_len, struct kvdb_skipnode **prev);
+// 插入键值；键已存在时用同样高度的新节点替换，*old 返回被摘下的节点（由调用者在读者离开后释放），
+// 否则 *old 为 NULL。返回新节点，内存不足时返回 NULL
+struct kvdb_skipnode *kvdb_skiplist_put(struct kvdb_skiplist *list, const char *key, uint32_t key_len,
+                                        const void *value, uint32_t value_len,
+                                        struct kvdb_skipnode **old);
+
+// 预写日志：复用日志引擎的记录格式、组提交与持久化级别，但不维护索引。
+// 打开时把已有记录依次交给 replay
+typedef int (*kvdb_replay_fn)(void *arg, const char *key, uint32_t key_len,
+                              const char *value, uint32_t value_len);
+int kvdb_wal_open(struct kvdb_t *wal, const char *path, const struct kvdb_options *opts,
+                  kvdb_replay_fn replay, void *arg);
+// 追加一条记录，*end 返回其在日志中的结束位置
+int kvdb_wal_append(struct kvdb_t *wal, const char *key, uint32_t key_len,
+                    const char *value, uint32_t value_len, uint64_t *end);
+// 按持久化级别提交到 end
+int kvdb_wal_commit(struct kvdb_t *wal, uint64_t end);
+
+// 范围扫描：迭代器每次取一批结果，依次存放为 [key_len][value_len][key][value]
+#define KVDB_SCAN_HDR_SIZE (2 * sizeof(uint32_t))
+struct kvdb_scan {
+    const char *from;   // 起点；after 非 0 时不包含 from 本身
+    uint32_t from_len;
+    int after;
+    const char *end;    // 终点（不包含），为 NULL 时没有上界
+    uint32_t end_len;
+    size_t budget;      // 一批结果攒够 budget 字节（至少一项）即停止
+    int done;           // 输出：范围内的键是否已经取完
+};
+// 向一批结果追加一项
+int kvdb_scan_append(struct write_buffer *batch, const char *key, uint32_t key_len,
+                     const char *value, uint32_t value_len);
+
+// LSM-tree 引擎
+struct kvdb_lsm *kvdb_lsm_open(const char *path, const struct kvdb_options *opts);
+int kvdb_lsm_put(struct kvdb_lsm *lsm, const char *key, uint32_t key_len,
+                 const char *value, uint32_t value_len);
+// 一次持锁写入 n 条记录，最后统一提交
+int kvdb_lsm_put_batch(struct kvdb_lsm *lsm, const char *const keys[],
+                       const char *const values[], size_t n);
+// 找到时最多复制 length 字节（不补 '\0'），*value_len 返回值的实际长度
+int kvdb_lsm_get(struct kvdb_lsm *lsm, const char *key, uint32_t key_len,
+                 char *buf, size_t length, size_t *value_len);
+// 按键的顺序把 scan 范围内的下一批键值对追加到 batch
+int kvdb_lsm_scan(struct kvdb_lsm *lsm, struct kvdb_scan *scan, struct write_buffer *batch);
+int kvdb_lsm_flush(struct kvdb_lsm *lsm);
+int kvdb_lsm_close(struct kvdb_lsm *lsm);
+
+#endif // KVDB_LSM_H
@@ -0,0 +1,155 @@
+#include "kvdb_lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 8     // 末尾这么多字节总是作为字面量，查找匹配时一次读 8 字节不会越界
+#define LZ_HASH_BITS 12        // 哈希表最大 4096 项
+#define LZ_MIN_HASH_BITS 6
+#define LZ_SKIP_SHIFT 6        // 连续找不到匹配时加大步长，不可压缩的数据很快跳过
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t seq, int bits) {
+    return (seq * 2654435761u) >> (32 - bits);
+}
+
+// 写出长度的扩展字节
+static uint8_t *put_len(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// 写出一个序列；has_match 为 0 时只有字面量。空间不够返回 NULL
+static uint8_t *put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t lit_len,
+                        size_t offset, size_t match, int has_match) {
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + (has_match ? 2 + match / 255 + 1 : 0);
+    if (need > (size_t)(oend - op)) return NULL;
+
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15) op = put_len(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (has_match) {
+        *token |= (uint8_t)(match >= 15 ? 15 : match);
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        if (match >= 15) op = put_len(op, match - 15);
+    }
+    return op;
+}
+
+size_t kvdb_lz_compress(const void *src, size_t src_len, void *dst, size_t dst_cap) {
+    const uint8_t *in = src, *ip = in, *anchor = in, *end = in + src_len;
+    const uint8_t *limit = src_len > LZ_LAST_LITERALS ? end - LZ_LAST_LITERALS : in;
+    uint8_t *op = dst, *oend = op + dst_cap;
+
+    // 哈希表按输入大小取，短值不必清空整张表；表项是位置，命中后再比较内容
+    int bits = LZ_MIN_HASH_BITS;
+    while (bits < LZ_HASH_BITS && ((size_t)1 << bits) < src_len) bits++;
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(uint32_t) << bits);
+
+    while (ip + LZ_MIN_MATCH <= limit) {
+        uint32_t seq = read32(ip);
+        uint32_t h = lz_hash(seq, bits);
+        const uint8_t *ref = in + table[h];
+        table[h] = ip - in;
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq) {
+            ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        // 向后延长匹配，每次比较 8 字节
+        const uint8_t *mp = ip + LZ_MIN_MATCH, *rp = ref + LZ_MIN_MATCH;
+        while (mp + 8 <= limit) {
+            uint64_t diff = read64(mp) ^ read64(rp);
+            if (diff) {
+                mp += __builtin_ctzll(diff) / 8;
+                goto matched;
+            }
+            mp += 8;
+            rp += 8;
+        }
+        while (mp < limit && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+matched:
+        op = put_seq(op, oend, anchor, ip - anchor, ip - ref, mp - ip - LZ_MIN_MATCH, 1);
+        if (!op) return 0;
+        // 匹配末尾附近的位置也加入哈希表，便于接上下一个匹配
+        table[lz_hash(read32(mp - 2), bits)] = mp - 2 - in;
+        ip = anchor = mp;
+    }
+
+    op = put_seq(op, oend, anchor, end - anchor, 0, 0, 0);
+    return op ? (size_t)(op - (uint8_t *)dst) : 0;
+}
+
+// 读取长度的扩展字节，数据不完整时返回 -1
+static int get_len(const uint8_t **ipp, const uint8_t *iend, size_t *len) {
+    const uint8_t *ip = *ipp;
+    uint8_t b;
+    do {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    *ipp = ip;
+    return 0;
+}
+
+long kvdb_lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap) {
+    const uint8_t *ip = src, *iend = ip + src_len;
+    uint8_t *out = dst, *op = out, *oend = out + dst_cap;
+    if (dst_cap == 0) return 0;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && get_len(&ip, iend, &lit) < 0) return -1;
+        if (lit > (size_t)(iend - ip)) return -1;
+        size_t n = lit < (size_t)(oend - op) ? lit : (size_t)(oend - op);
+        memcpy(op, ip, n);
+        op += n;
+        ip += lit;
+        if (op == oend || ip == iend) break; // 输出已满，或者最后一个序列
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && get_len(&ip, iend, &match) < 0) return -1;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out)) return -1;
+
+        // 匹配与输出重叠时，[ref, op) 是以 offset 为周期的重复内容，每次复制的长度翻倍
+        n = match < (size_t)(oend - op) ? match : (size_t)(oend - op);
+        const uint8_t *ref = op - offset;
+        while (n > 0) {
+            size_t chunk = (size_t)(op - ref) < n ? (size_t)(op - ref) : n;
+            memcpy(op, ref, chunk);
+            op += chunk;
+            n -= chunk;
+        }
+        if (op == oend) break;
+    }
+    return op - out;
+}
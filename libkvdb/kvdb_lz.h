@@ -0,0 +1,18 @@
+#ifndef KVDB_LZ_H
+#define KVDB_LZ_H
+
+// 值压缩用的 LZ77 编解码（与 LZ4 块格式同类），kvdb 内部使用，不对外公开。
+// 压缩流由若干序列组成，每个序列：
+//   [token] 高 4 位为字面量长度，低 4 位为匹配长度 - 4，取 15 时后面跟扩展字节（255 表示继续）
+//   [字面量] [匹配距离，2 字节小端] [匹配长度的扩展字节]
+// 最后一个序列只有字面量
+
+#include <stddef.h>
+
+// 压缩 src；结果不超过 dst_cap 字节时返回压缩后的长度，否则返回 0
+size_t kvdb_lz_compress(const void *src, size_t src_len, void *dst, size_t dst_cap);
+
+// 解压到 dst，最多输出 dst_cap 字节（之后的部分不再解码），返回输出的字节数；数据损坏时返回 -1
+long kvdb_lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap);
+
+#endif // KVDB_LZ_H
@@ -0,0 +1,115 @@
+#include "kvdb_metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static __thread unsigned stripe_id = ~0u;
+static unsigned next_stripe_id;
+
+struct kvdb_metrics *kvdb_metrics_new(void) {
+    struct kvdb_metrics *m;
+    if (posix_memalign((void **)&m, 64, sizeof(struct kvdb_metrics)) != 0) {
+        return NULL;
+    }
+    memset(m, 0, sizeof(*m));
+    return m;
+}
+
+void kvdb_metrics_free(struct kvdb_metrics *m) {
+    free(m);
+}
+
+uint64_t kvdb_metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct metrics_stripe *kvdb_metrics_stripe(struct kvdb_metrics *m) {
+    if (stripe_id == ~0u) {
+        stripe_id = __atomic_fetch_add(&next_stripe_id, 1, __ATOMIC_RELAXED);
+    }
+    return &m->stripes[stripe_id % METRICS_STRIPES];
+}
+
+// 桶号：小于 2^SUB_BITS 的值各占一个桶；之后每个 2 的幂区间等分为 2^SUB_BITS 个桶
+static unsigned hist_bucket(uint64_t ns) {
+    const unsigned sub = 1u << KVDB_HIST_SUB_BITS;
+    if (ns < sub) {
+        return ns;
+    }
+    if (ns >> KVDB_HIST_MAX_BITS) {
+        return KVDB_HIST_BUCKETS - 1;
+    }
+    unsigned e = 63 - __builtin_clzll(ns); // ns 的最高位
+    unsigned shift = e - KVDB_HIST_SUB_BITS;
+    return ((shift + 1) << KVDB_HIST_SUB_BITS) + ((ns >> shift) & (sub - 1));
+}
+
+// 桶中的值的上界（含）
+static uint64_t hist_bucket_max(unsigned b) {
+    const unsigned sub = 1u << KVDB_HIST_SUB_BITS;
+    if (b < sub) {
+        return b;
+    }
+    unsigned shift = (b >> KVDB_HIST_SUB_BITS) - 1;
+    uint64_t base = (uint64_t)(sub + (b & (sub - 1))) << shift;
+    return base + ((uint64_t)1 << shift) - 1;
+}
+
+void kvdb_metrics_record(struct kvdb_histogram *h, uint64_t ns) {
+    __atomic_fetch_add(&h->buckets[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+static void hist_add(struct kvdb_histogram *out, const struct kvdb_histogram *h) {
+    for (unsigned b = 0; b < KVDB_HIST_BUCKETS; b++) {
+        out->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    }
+}
+
+void kvdb_metrics_add(const struct kvdb_metrics *m, struct kvdb_stats *out) {
+    for (int i = 0; i < METRICS_STRIPES; i++) {
+        out->puts += __atomic_load_n(&m->stripes[i].puts, __ATOMIC_RELAXED);
+        out->gets += __atomic_load_n(&m->stripes[i].gets, __ATOMIC_RELAXED);
+        out->bytes_read += __atomic_load_n(&m->stripes[i].bytes_read, __ATOMIC_RELAXED);
+    }
+    out->bytes_written += __atomic_load_n(&m->bytes_written, __ATOMIC_RELAXED);
+    out->flushes += __atomic_load_n(&m->flushes, __ATOMIC_RELAXED);
+    out->syncs += __atomic_load_n(&m->syncs, __ATOMIC_RELAXED);
+    out->sync_ns += __atomic_load_n(&m->sync_ns, __ATOMIC_RELAXED);
+    out->compactions += __atomic_load_n(&m->compactions, __ATOMIC_RELAXED);
+    uint64_t high = __atomic_load_n(&m->buffer_high_water, __ATOMIC_RELAXED);
+    if (high > out->buffer_high_water) {
+        out->buffer_high_water = high;
+    }
+    hist_add(&out->put_latency, &m->put_latency);
+    hist_add(&out->get_latency, &m->get_latency);
+    hist_add(&out->sync_latency, &m->sync_latency);
+}
+
+uint64_t kvdb_histogram_count(const struct kvdb_histogram *h) {
+    uint64_t n = 0;
+    for (unsigned b = 0; b < KVDB_HIST_BUCKETS; b++) {
+        n += h->buckets[b];
+    }
+    return n;
+}
+
+uint64_t kvdb_histogram_percentile(const struct kvdb_histogram *h, double p) {
+    uint64_t n = kvdb_histogram_count(h);
+    if (n == 0) {
+        return 0;
+    }
+    // 第 rank 个（从 1 起）样本所在的桶
+    uint64_t rank = (uint64_t)(p / 100 * n + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < KVDB_HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            return hist_bucket_max(b);
+        }
+    }
+    return hist_bucket_max(KVDB_HIST_BUCKETS - 1);
+}
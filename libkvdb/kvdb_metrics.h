@@ -0,0 +1,46 @@
+#ifndef KVDB_METRICS_H
+#define KVDB_METRICS_H
+
+// 运行统计，kvdb 内部使用。读写路径上的计数按线程分片，避免多个线程争用同一缓存行；
+// 延迟直方图的桶用原子加更新，记录时不加锁。读取统计时把各分片相加，不保证各计数取自同一时刻
+
+#include "kvdb.h"
+
+#define METRICS_STRIPES 16
+
+struct metrics_stripe {
+    uint64_t puts;
+    uint64_t gets;
+    uint64_t bytes_read;
+} __attribute__((aligned(64)));
+
+struct kvdb_metrics {
+    struct metrics_stripe stripes[METRICS_STRIPES];
+    // 以下由提交组的 leader 或持有 db->lock 的写者更新
+    uint64_t bytes_written;
+    uint64_t flushes;
+    uint64_t syncs;
+    uint64_t sync_ns;
+    uint64_t buffer_high_water;
+    uint64_t compactions;
+    struct kvdb_histogram put_latency;
+    struct kvdb_histogram get_latency;
+    struct kvdb_histogram sync_latency;
+};
+
+struct kvdb_metrics *kvdb_metrics_new(void);
+void kvdb_metrics_free(struct kvdb_metrics *m);
+
+// 单调时钟的当前时刻（纳秒）
+uint64_t kvdb_metrics_now(void);
+
+// 当前线程所在的计数分片
+struct metrics_stripe *kvdb_metrics_stripe(struct kvdb_metrics *m);
+
+// 记录一次耗时 ns 纳秒的操作
+void kvdb_metrics_record(struct kvdb_histogram *h, uint64_t ns);
+
+// 把 m 中的计数与直方图累加到 out（不修改 out 中的其他字段）
+void kvdb_metrics_add(const struct kvdb_metrics *m, struct kvdb_stats *out);
+
+#endif // KVDB_METRICS_H
@@ -0,0 +1,37 @@
+#ifndef KVDB_URING_H
+#define KVDB_URING_H
+
+// io_uring 的最小封装（直接使用系统调用，不依赖 liburing），kvdb 内部使用。
+// 一个环只由一个线程使用：取 SQE、提交与收割完成都不加锁
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct kvdb_uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;      // 已取出的 SQE（含尚未提交的）
+    unsigned sqe_head;      // 已交给内核的 SQE
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+};
+
+// 建立至少 entries 项的环；内核不支持 io_uring 时返回 -1
+int kvdb_uring_init(struct kvdb_uring *ring, unsigned entries);
+void kvdb_uring_exit(struct kvdb_uring *ring);
+
+// 取一个清零的 SQE，环满时返回 NULL
+struct io_uring_sqe *kvdb_uring_sqe(struct kvdb_uring *ring);
+
+// 提交已取出的 SQE，并等待至少 wait_nr 个完成；返回提交的个数
+int kvdb_uring_submit(struct kvdb_uring *ring, unsigned wait_nr);
+
+// 取下一个完成项，没有时返回 NULL；处理完后调用 kvdb_uring_seen
+struct io_uring_cqe *kvdb_uring_peek(struct kvdb_uring *ring);
+void kvdb_uring_seen(struct kvdb_uring *ring);
+
+#endif // KVDB_URING_H
@@ -1,5 +1,15 @@
 #include <testkit.h>
 #include <kvdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/resource.h>
 
 SystemTest(test_kvdb_open, ((const char *[]){})) {
     struct kvdb_t db;
@@ -15,5 +25,1027 @@ SystemTest(test_kvdb_put_get, ((const char *[]){})) {
     tk_assert(kvdb_close(&db) == 0, "Must close db");
 }
 
+SystemTest(test_kvdb_reopen, ((const char *[]){})) {
+    struct kvdb_t db;
+    char buf[64];
+    unlink("/tmp/test_reopen.db");
+    tk_assert(kvdb_open(&db, "/tmp/test_reopen.db") == 0, "Must open db");
+    tk_assert(kvdb_put(&db, "a", "1") == 0, "Must put a");
+    tk_assert(kvdb_put(&db, "b", "2") == 0, "Must put b");
+    tk_assert(kvdb_put(&db, "a", "33") == 0, "Must overwrite a");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+    tk_assert(kvdb_open(&db, "/tmp/test_reopen.db") == 0, "Must reopen db");
+    tk_assert(kvdb_get(&db, "a", buf, sizeof(buf)) == 2 && strcmp(buf, "33") == 0,
+              "Must get latest a, got %s", buf);
+    tk_assert(kvdb_get(&db, "b", buf, sizeof(buf)) == 1 && strcmp(buf, "2") == 0,
+              "Must get b, got %s", buf);
+    tk_assert(kvdb_get(&db, "c", buf, sizeof(buf)) == -1, "Must not get c");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+SystemTest(test_kvdb_get_ref, ((const char *[]){})) {
+    struct kvdb_t db;
+    struct kvdb_ref ref, buffered;
+    char key[32], value[256];
+    unlink("/tmp/test_ref.db");
+    tk_assert(kvdb_open(&db, "/tmp/test_ref.db") == 0, "Must open db");
+    tk_assert(kvdb_put(&db, "key", "value") == 0, "Must put key");
+    tk_assert(kvdb_get_ref(&db, "key", &ref) == 0, "Must get key");
+    tk_assert(ref.length == 5 && memcmp(ref.value, "value", 5) == 0, "Must reference value");
+    tk_assert(kvdb_get_ref(&db, "nokey", &buffered) == -1, "Must not get nokey");
+
+    // 引用期间的写入、映射扩展与压缩都不影响引用的值，包括取引用时还在缓冲区中的记录
+    tk_assert(kvdb_put(&db, "buffered", "pending") == 0, "Must put buffered");
+    tk_assert(kvdb_get_ref(&db, "buffered", &buffered) == 0 && buffered.length == 7,
+              "Must reference a buffered record");
+    memset(value, 'x', sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\0';
+    for (int i = 0; i < 20000; i++) {
+        sprintf(key, "fill%d", i % 100);
+        tk_assert(kvdb_put(&db, key, value) == 0, "Must put %s", key);
+    }
+    tk_assert(kvdb_put(&db, "key", "rewritten") == 0 && kvdb_compact(&db) == 0, "Must compact");
+    tk_assert(ref.length == 5 && memcmp(ref.value, "value", 5) == 0, "Must keep referenced value");
+    tk_assert(memcmp(buffered.value, "pending", 7) == 0, "Must keep referenced buffered value");
+    kvdb_ref_release(&ref);
+    kvdb_ref_release(&buffered);
+    tk_assert(kvdb_get_ref(&db, "key", &ref) == 0 && ref.length == 9 &&
+              memcmp(ref.value, "rewritten", 9) == 0, "Must reference new value");
+    kvdb_ref_release(&ref);
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+SystemTest(test_kvdb_compact, ((const char *[]){})) {
+    struct kvdb_t db;
+    struct stat st;
+    char key[32], value[32], buf[32];
+    unlink("/tmp/test_compact.db");
+    tk_assert(kvdb_open(&db, "/tmp/test_compact.db") == 0, "Must open db");
+    for (int round = 0; round < 10; round++) {
+        for (int i = 0; i < 100; i++) {
+            snprintf(key, sizeof(key), "key%d", i);
+            snprintf(value, sizeof(value), "value%d-%d", i, round);
+            tk_assert(kvdb_put(&db, key, value) == 0, "Must put %s", key);
+        }
+    }
+    tk_assert(kvdb_compact(&db) == 0, "Must compact db");
+    tk_assert(stat("/tmp/test_compact.db", &st) == 0, "Must stat db");
+    tk_assert(st.st_size < 100 * 32, "Only live records remain, size %ld", (long)st.st_size);
+    tk_assert(kvdb_put(&db, "key0", "new") == 0, "Must put after compaction");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+    tk_assert(kvdb_open(&db, "/tmp/test_compact.db") == 0, "Must reopen db");
+    tk_assert(kvdb_get(&db, "key0", buf, sizeof(buf)) == 3 && strcmp(buf, "new") == 0,
+              "Must get key0, got %s", buf);
+    tk_assert(kvdb_get(&db, "key99", buf, sizeof(buf)) > 0 && strcmp(buf, "value99-9") == 0,
+              "Must get key99, got %s", buf);
+
+    // 失效字节过半时由后台线程自动压缩，写者继续写入，压缩追上期间写入的记录
+    static char large[1024];
+    struct kvdb_stats stats = {0};
+    int round = 0;
+    for (; round < 200 && stats.compactions == 0; round++) {
+        for (int i = 0; i < 100; i++) {
+            snprintf(key, sizeof(key), "key%d", i);
+            snprintf(large, sizeof(large), "%0*d", (int)sizeof(large) - 1, round * 100 + i);
+            tk_assert(kvdb_put(&db, key, large) == 0, "Must put %s", key);
+        }
+        tk_assert(kvdb_stats(&db, &stats) == 0, "Must read stats");
+    }
+    tk_assert(stats.compactions >= 1, "Must compact automatically");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+    tk_assert(kvdb_open(&db, "/tmp/test_compact.db") == 0, "Must reopen db");
+    int latest = 1;
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        latest &= kvdb_get(&db, key, large, sizeof(large)) == sizeof(large) - 1 &&
+                  atoi(large) == (round - 1) * 100 + i;
+    }
+    tk_assert(latest, "Must keep the latest values across automatic compaction");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+static struct kvdb_t group_db;
+
+static void *group_writer(void *arg) {
+    char key[32], value[32];
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "t%ld-%d", (long)arg, i);
+        snprintf(value, sizeof(value), "v%d", i);
+        tk_assert(kvdb_put(&group_db, key, value) == 0, "Must put %s", key);
+    }
+    return NULL;
+}
+
+SystemTest(test_kvdb_group_commit, ((const char *[]){})) {
+    pthread_t threads[8];
+    char key[32], buf[32];
+    unlink("/tmp/test_group.db");
+    struct kvdb_options opts = { .durability = KVDB_SYNC_COMMIT, .commit_latency_us = 100 };
+    tk_assert(kvdb_open_opts(&group_db, "/tmp/test_group.db", &opts) == 0, "Must open db");
+    for (long i = 0; i < 8; i++) {
+        pthread_create(&threads[i], NULL, group_writer, (void *)i);
+    }
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    tk_assert(kvdb_close(&group_db) == 0, "Must close db");
+
+    tk_assert(kvdb_open(&group_db, "/tmp/test_group.db") == 0, "Must reopen db");
+    for (int t = 0; t < 8; t++) {
+        for (int i = 0; i < 100; i++) {
+            snprintf(key, sizeof(key), "t%d-%d", t, i);
+            tk_assert(kvdb_get(&group_db, key, buf, sizeof(buf)) > 0, "Must get %s", key);
+        }
+    }
+    tk_assert(kvdb_close(&group_db) == 0, "Must close db");
+}
+
+SystemTest(test_kvdb_durability, ((const char *[]){})) {
+    const enum kvdb_durability modes[] = {
+        KVDB_SYNC_NONE, KVDB_SYNC_INTERVAL, KVDB_SYNC_COMMIT, KVDB_SYNC_BATCH
+    };
+    struct kvdb_t db;
+    char key[32], buf[32];
+    for (int m = 0; m < 4; m++) {
+        struct kvdb_options opts = { .durability = modes[m], .sync_interval_ms = 10 };
+        unlink("/tmp/test_durability.db");
+        tk_assert(kvdb_open_opts(&db, "/tmp/test_durability.db", &opts) == 0, "Must open db");
+        for (int i = 0; i < 500; i++) {
+            snprintf(key, sizeof(key), "key%d", i);
+            tk_assert(kvdb_put(&db, key, key) == 0, "Must put %s", key);
+        }
+        tk_assert(kvdb_get(&db, "key499", buf, sizeof(buf)) == 6, "Must read own write");
+        tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+        tk_assert(kvdb_open(&db, "/tmp/test_durability.db") == 0, "Must reopen db");
+        tk_assert(kvdb_get(&db, "key0", buf, sizeof(buf)) == 4, "Must keep key0 in mode %d", m);
+        tk_assert(kvdb_get(&db, "key499", buf, sizeof(buf)) == 6, "Must keep key499 in mode %d", m);
+        tk_assert(kvdb_close(&db) == 0, "Must close db");
+    }
+
+    // 关闭时才写出的缓冲数据写入失败：close 必须报错
+    struct rlimit limit = { 8, 8 };
+    unlink("/tmp/test_durability.db");
+    tk_assert(kvdb_open(&db, "/tmp/test_durability.db") == 0, "Must open db");
+    tk_assert(kvdb_put(&db, "key", "value") == 0, "Must buffer a put");
+    signal(SIGXFSZ, SIG_IGN);
+    tk_assert(setrlimit(RLIMIT_FSIZE, &limit) == 0, "Must limit file size");
+    errno = 0;
+    tk_assert(kvdb_close(&db) == -1 && errno == EFBIG,
+              "Must report the failed final write, errno %d", errno);
+}
+
+SystemTest(test_kvdb_read_buffered, ((const char *[]){})) {
+    struct kvdb_t db;
+    struct stat st, empty;
+    char buf[32];
+    struct kvdb_options opts = { .durability = KVDB_SYNC_NONE };
+    unlink("/tmp/test_buffered.db");
+    tk_assert(kvdb_open_opts(&db, "/tmp/test_buffered.db", &opts) == 0, "Must open db");
+    tk_assert(stat("/tmp/test_buffered.db", &empty) == 0, "Must create file");
+    tk_assert(kvdb_put(&db, "key", "value") == 0, "Must put key");
+    tk_assert(kvdb_get(&db, "key", buf, sizeof(buf)) == 5 && strcmp(buf, "value") == 0,
+              "Must read buffered value, got %s", buf);
+    tk_assert(stat("/tmp/test_buffered.db", &st) == 0 && st.st_size == empty.st_size,
+              "Reads must not write the buffer, size %ld", (long)st.st_size);
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+SystemTest(test_kvdb_lsm, ((const char *[]){})) {
+    struct kvdb_t db;
+    struct stat st;
+    char key[32], value[256], buf[256];
+    struct kvdb_options opts = { .engine = KVDB_ENGINE_LSM, .durability = KVDB_SYNC_NONE };
+    tk_assert(system("rm -rf /tmp/test_lsm && mkdir /tmp/test_lsm") == 0, "Must create dir");
+    tk_assert(kvdb_open_opts(&db, "/tmp/test_lsm/db", &opts) == 0, "Must open db");
+    // 写满内存表，迫使后台线程写出 SSTable
+    for (int i = 0; i < 24000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(value, sizeof(value), "%s-%0200d", key, i);
+        tk_assert(kvdb_put(&db, key, value) == 0, "Must put %s", key);
+    }
+    tk_assert(kvdb_put(&db, "key0", "new") == 0, "Must overwrite key0");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+    tk_assert(stat("/tmp/test_lsm/db.sst.000001", &st) == 0, "Must write an SSTable");
+
+    tk_assert(kvdb_open_opts(&db, "/tmp/test_lsm/db", &opts) == 0, "Must reopen db");
+    tk_assert(kvdb_get(&db, "key0", buf, sizeof(buf)) == 3 && strcmp(buf, "new") == 0,
+              "Must read latest key0, got %s", buf);
+    for (int i = 1; i < 24000; i += 97) {
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(value, sizeof(value), "%s-%0200d", key, i);
+        tk_assert(kvdb_get(&db, key, buf, sizeof(buf)) > 0 && strcmp(buf, value) == 0,
+                  "Must get %s", key);
+    }
+    tk_assert(kvdb_get(&db, "missing", buf, sizeof(buf)) == -1, "Must miss unknown key");
+
+    // 有序遍历合并内存表与各层 SSTable：key1 开头的键有 1 + 10 + 100 + 1000 + 10000 个
+    struct kvdb_iter *it = kvdb_iter_prefix(&db, "key1");
+    const char *k, *v;
+    size_t k_len, v_len, count = 0;
+    char prev[32] = "";
+    tk_assert(it != NULL, "Must open iterator");
+    while (kvdb_iter_next(it, &k, &k_len, &v, &v_len) == 1) {
+        snprintf(key, sizeof(key), "%.*s", (int)k_len, k);
+        tk_assert(strncmp(key, "key1", 4) == 0 && strcmp(prev, key) < 0, "Must be ordered: %s", key);
+        strcpy(prev, key);
+        count++;
+    }
+    kvdb_iter_close(it);
+    tk_assert(count == 11111, "Must iterate all key1*, got %zu", count);
+    it = kvdb_iter_open(&db, NULL, "key1");
+    tk_assert(kvdb_iter_next(it, &k, &k_len, &v, &v_len) == 1 && k_len == 4 &&
+              v_len == 3 && memcmp(v, "new", 3) == 0, "Must iterate latest key0");
+    tk_assert(kvdb_iter_next(it, &k, &k_len, &v, &v_len) == 0, "Must stop before key1");
+    kvdb_iter_close(it);
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+    // 页脚中布隆过滤器的范围越界：打开时报错，而不是越界读取
+    uint64_t bloom_size = UINT64_MAX / 2;
+    int fd = open("/tmp/test_lsm/db.sst.000001", O_RDWR);
+    tk_assert(fd >= 0 && fstat(fd, &st) == 0, "Must open SSTable");
+    tk_assert(pwrite(fd, &bloom_size, 8, st.st_size - 48 + 8) == 8, "Must corrupt bloom size");
+    close(fd);
+    errno = 0;
+    tk_assert(kvdb_open_opts(&db, "/tmp/test_lsm/db", &opts) == -1 && errno == EIO,
+              "Must reject a corrupt SSTable, errno %d", errno);
+}
+
+SystemTest(test_kvdb_batch, ((const char *[]){})) {
+    struct kvdb_t db;
+    const char *keys[] = { "b", "a", "c", "b" };
+    const char *values[] = { "old", "apple", "cherry", "banana" };
+    const char *lookups[] = { "c", "missing", "a", "b" };
+    char bufs[4][16], small[4];
+    char *out[] = { bufs[0], bufs[1], bufs[2], small };
+    size_t lengths[] = { 16, 16, 16, sizeof(small) };
+    int results[4];
+    unlink("/tmp/test_batch.db");
+    tk_assert(kvdb_open(&db, "/tmp/test_batch.db") == 0, "Must open db");
+    tk_assert(kvdb_put_batch(&db, keys, values, 4) == 0, "Must put batch");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+    tk_assert(kvdb_open(&db, "/tmp/test_batch.db") == 0, "Must reopen db");
+    tk_assert(kvdb_get_batch(&db, lookups, out, lengths, results, 4) == 3, "Must find 3 keys");
+    tk_assert(results[0] == 6 && strcmp(bufs[0], "cherry") == 0, "Must get c");
+    tk_assert(results[1] == -1, "Must miss unknown key");
+    tk_assert(results[2] == 5 && strcmp(bufs[2], "apple") == 0, "Must get a");
+    tk_assert(results[3] == 3 && strcmp(small, "ban") == 0, "Must truncate b, got %s", small);
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+SystemTest(test_kvdb_binary, ((const char *[]){})) {
+    struct kvdb_t db;
+    const char key[] = { 'k', '\0', 'x' };
+    const char value[] = { 'a', '\0', 'b', '\0' };
+    static char large[1 << 20], buf[1 << 20];
+    size_t value_len;
+    for (size_t i = 0; i < sizeof(large); i++) large[i] = i % 251;
+    unlink("/tmp/test_binary.db");
+    tk_assert(kvdb_open(&db, "/tmp/test_binary.db") == 0, "Must open db");
+    tk_assert(kvdb_put_n(&db, key, sizeof(key), value, sizeof(value)) == 0, "Must put binary key");
+    tk_assert(kvdb_put(&db, "k", "plain") == 0, "Must put prefix key");
+    tk_assert(kvdb_put_n(&db, "large", 5, large, sizeof(large)) == 0, "Must put large value");
+    tk_assert(kvdb_put(&db, "after", "small") == 0, "Must put after large value");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+    tk_assert(kvdb_open(&db, "/tmp/test_binary.db") == 0, "Must reopen db");
+    tk_assert(kvdb_get_n(&db, key, sizeof(key), buf, 2, &value_len) == 0 && value_len == 4 &&
+              memcmp(buf, value, 2) == 0, "Must report true length, got %zu", value_len);
+    tk_assert(kvdb_get_n(&db, "k", 1, buf, sizeof(buf), &value_len) == 0 && value_len == 5,
+              "Must not confuse prefix key");
+    tk_assert(kvdb_get_n(&db, "large", 5, buf, sizeof(buf), &value_len) == 0 &&
+              value_len == sizeof(large) && memcmp(buf, large, sizeof(large)) == 0, "Must get large value");
+    tk_assert(kvdb_get(&db, "after", buf, sizeof(buf)) == 5, "Must get key after large value");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+SystemTest(test_kvdb_iter, ((const char *[]){})) {
+    struct kvdb_t db;
+    struct kvdb_iter *it;
+    char key[32], value[128], prev[32];
+    const char *k, *v;
+    size_t k_len, v_len, count;
+    unlink("/tmp/test_iter.db");
+    tk_assert(kvdb_open(&db, "/tmp/test_iter.db") == 0, "Must open db");
+    // 乱序写入 2000 个约 100 字节的值，整个范围要分多批取出
+    for (int i = 0; i < 2000; i++) {
+        int j = i * 7 % 2000;
+        snprintf(key, sizeof(key), "k%04d", j);
+        snprintf(value, sizeof(value), "%s-%090d", key, j);
+        tk_assert(kvdb_put(&db, key, value) == 0, "Must put %s", key);
+    }
+    tk_assert(kvdb_put(&db, "k0105", "new") == 0, "Must overwrite k0105");
+    tk_assert(kvdb_put(&db, "z", "last") == 0, "Must put z");
+
+    it = kvdb_iter_open(&db, "k0100", "k0200");
+    tk_assert(it != NULL, "Must open iterator");
+    for (count = 0; kvdb_iter_next(it, &k, &k_len, &v, &v_len) == 1; count++) {
+        snprintf(key, sizeof(key), "k%04zu", 100 + count);
+        tk_assert(k_len == 5 && memcmp(k, key, 5) == 0, "Must iterate %s in order", key);
+        if (count == 5) {
+            tk_assert(v_len == 3 && memcmp(v, "new", 3) == 0, "Must see latest k0105");
+        }
+    }
+    kvdb_iter_close(it);
+    tk_assert(count == 100, "Must iterate [k0100, k0200), got %zu", count);
+
+    // 有序索引建立之后的新键
+    tk_assert(kvdb_put(&db, "k0500a", "inserted") == 0, "Must put k0500a");
+    it = kvdb_iter_prefix(&db, "k05");
+    for (count = 0; kvdb_iter_next(it, &k, &k_len, &v, &v_len) == 1; count++)
+        ;
+    kvdb_iter_close(it);
+    tk_assert(count == 101, "Must see the new key, got %zu", count);
+
+    it = kvdb_iter_open(&db, NULL, NULL);
+    prev[0] = '\0';
+    for (count = 0; kvdb_iter_next(it, &k, &k_len, &v, &v_len) == 1; count++) {
+        snprintf(key, sizeof(key), "%.*s", (int)k_len, k);
+        tk_assert(strcmp(prev, key) < 0, "Must be ordered: %s after %s", key, prev);
+        strcpy(prev, key);
+    }
+    kvdb_iter_close(it);
+    tk_assert(count == 2002 && strcmp(prev, "z") == 0, "Must iterate all keys, got %zu", count);
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+    tk_assert(kvdb_open(&db, "/tmp/test_iter.db") == 0, "Must reopen db");
+    it = kvdb_iter_prefix(&db, "z");
+    tk_assert(kvdb_iter_next(it, &k, &k_len, &v, &v_len) == 1 && v_len == 4 &&
+              memcmp(v, "last", 4) == 0, "Must iterate z after reopen");
+    tk_assert(kvdb_iter_next(it, &k, &k_len, &v, &v_len) == 0, "Must end after z");
+    kvdb_iter_close(it);
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+SystemTest(test_kvdb_compress, ((const char *[]){})) {
+    struct kvdb_t db;
+    struct kvdb_options opts = { .durability = KVDB_SYNC_NONE, .compression = KVDB_COMPRESS_LZ };
+    struct stat st;
+    static char value[1 << 17], buf[1 << 17];
+    char key[32], expect[1024];
+    size_t value_len;
+    unlink("/tmp/test_compress.db");
+    tk_assert(kvdb_open_opts(&db, "/tmp/test_compress.db", &opts) == 0, "Must open db");
+    // JSON 风格的值压缩后远小于原文；短值与随机值原样存储
+    for (int i = 0; i < 200; i++) {
+        size_t n = 0;
+        snprintf(key, sizeof(key), "user%d", i);
+        while (n < 900) {
+            n += snprintf(value + n, sizeof(value) - n, "{\"id\":%d,\"name\":\"%s\",\"active\":true},", i, key);
+        }
+        tk_assert(kvdb_put(&db, key, value) == 0, "Must put %s", key);
+    }
+    for (size_t i = 0; i < 1000; i++) value[i] = (char)(rand() % 255 + 1);
+    value[1000] = '\0';
+    tk_assert(kvdb_put(&db, "random", value) == 0, "Must put random value");
+    tk_assert(kvdb_put(&db, "short", "tiny") == 0, "Must put short value");
+    memset(value, 'x', sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\0';
+    tk_assert(kvdb_put(&db, "large", value) == 0, "Must put large value");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+    tk_assert(stat("/tmp/test_compress.db", &st) == 0 && st.st_size < 100000,
+              "Must store compressed values, size %lld", (long long)st.st_size);
+
+    // 不开启压缩也能读取压缩的记录
+    tk_assert(kvdb_open(&db, "/tmp/test_compress.db") == 0, "Must reopen db");
+    for (size_t n = 0; n < 900; ) {
+        n += snprintf(expect + n, sizeof(expect) - n, "{\"id\":7,\"name\":\"user7\",\"active\":true},");
+    }
+    tk_assert(kvdb_get(&db, "user7", buf, sizeof(buf)) == (int)strlen(expect) &&
+              strcmp(buf, expect) == 0, "Must decompress user7");
+    tk_assert(kvdb_get(&db, "user7", buf, 51) == 50 && memcmp(buf, expect, 50) == 0,
+              "Must decompress a prefix, got %s", buf);
+    tk_assert(kvdb_get_n(&db, "large", 5, buf, sizeof(buf), &value_len) == 0 &&
+              value_len == sizeof(value) - 1 && memcmp(buf, value, value_len) == 0,
+              "Must decompress large value");
+    struct kvdb_ref ref;
+    tk_assert(kvdb_get_ref(&db, "short", &ref) == 0 && ref.length == 4,
+              "Must reference uncompressed value");
+    kvdb_ref_release(&ref);
+    tk_assert(kvdb_get_ref(&db, "user7", &ref) == -1 && errno == ENOTSUP,
+              "Must not reference compressed value");
+    tk_assert(kvdb_compact(&db) == 0, "Must compact db");
+    tk_assert(kvdb_get(&db, "user199", buf, sizeof(buf)) > 900, "Must read after compaction");
+
+    struct kvdb_iter *it = kvdb_iter_prefix(&db, "user19");
+    const char *k, *v;
+    size_t k_len, v_len, count = 0;
+    while (kvdb_iter_next(it, &k, &k_len, &v, &v_len) == 1) {
+        tk_assert(v_len > 900 && memcmp(v, "{\"id\":19", 8) == 0, "Must iterate decompressed values");
+        count++;
+    }
+    kvdb_iter_close(it);
+    tk_assert(count == 11, "Must iterate user19*, got %zu", count);
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+SystemTest(test_kvdb_shard, ((const char *[]){})) {
+    struct kvdb_t db;
+    struct kvdb_options opts = { .shards = 4 };
+    char key[32], value[32], buf[32];
+    const char *keys[500], *values[500];
+    static char kbuf[500][16], vbuf[500][16];
+    tk_assert(system("rm -rf /tmp/test_shard && mkdir /tmp/test_shard") == 0, "Must create dir");
+    tk_assert(kvdb_open_opts(&db, "/tmp/test_shard", &opts) == 0, "Must open sharded db");
+    for (int i = 0; i < 500; i++) {
+        sprintf(key, "key%04d", i);
+        sprintf(value, "value%d", i);
+        tk_assert(kvdb_put(&db, key, value) == 0, "Must put %s", key);
+        sprintf(kbuf[i], "key%04d", 500 + i);
+        sprintf(vbuf[i], "batch%d", i);
+        keys[i] = kbuf[i];
+        values[i] = vbuf[i];
+    }
+    tk_assert(kvdb_put_batch(&db, keys, values, 500) == 0, "Must put batch across shards");
+    tk_assert(kvdb_put(&db, "key0007", "new") == 0, "Must overwrite key0007");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+    tk_assert(access("/tmp/test_shard/shard.003", F_OK) == 0 &&
+              access("/tmp/test_shard/shard.004", F_OK) != 0, "Must create 4 shard logs");
+
+    // 再次打开时沿用建库时的分片数
+    opts.shards = 8;
+    tk_assert(kvdb_open_opts(&db, "/tmp/test_shard", &opts) == 0, "Must reopen sharded db");
+    tk_assert(access("/tmp/test_shard/shard.004", F_OK) != 0, "Must keep 4 shards");
+    tk_assert(kvdb_get(&db, "key0007", buf, sizeof(buf)) == 3 && strcmp(buf, "new") == 0,
+              "Must get overwritten key, got %s", buf);
+    tk_assert(kvdb_get(&db, "key0123", buf, sizeof(buf)) > 0 && strcmp(buf, "value123") == 0,
+              "Must get key0123, got %s", buf);
+    char bufs[500][16];
+    char *out[500];
+    size_t lengths[500];
+    int results[500];
+    for (int i = 0; i < 500; i++) {
+        out[i] = bufs[i];
+        lengths[i] = sizeof(bufs[i]);
+    }
+    keys[3] = "missing";
+    tk_assert(kvdb_get_batch(&db, keys, out, lengths, results, 500) == 499, "Must find 499 keys");
+    tk_assert(results[3] == -1 && strcmp(bufs[42], "batch42") == 0 && strcmp(bufs[499], "batch499") == 0,
+              "Must scatter batch results, got %s", bufs[42]);
+
+    // 迭代器把各分片的结果按键归并
+    struct kvdb_iter *it = kvdb_iter_open(&db, NULL, NULL);
+    const char *k, *v;
+    size_t klen, vlen;
+    int n = 0, ordered = 1;
+    while (kvdb_iter_next(it, &k, &klen, &v, &vlen) == 1) {
+        sprintf(key, "key%04d", n++);
+        ordered &= klen == strlen(key) && memcmp(k, key, klen) == 0;
+    }
+    kvdb_iter_close(it);
+    tk_assert(n == 1000 && ordered, "Must iterate 1000 keys in order, got %d", n);
+    it = kvdb_iter_prefix(&db, "key05");
+    for (n = 0; kvdb_iter_next(it, &k, &klen, &v, &vlen) == 1; n++);
+    kvdb_iter_close(it);
+    tk_assert(n == 100, "Must iterate key05 prefix across shards, got %d", n);
+    tk_assert(kvdb_compact(&db) == 0, "Must compact every shard");
+    tk_assert(kvdb_get(&db, "key0999", buf, sizeof(buf)) > 0 && strcmp(buf, "batch499") == 0,
+              "Must get key0999 after compact, got %s", buf);
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+SystemTest(test_kvdb_cache, ((const char *[]){})) {
+    struct kvdb_t db;
+    struct kvdb_options opts = { .cache_bytes = 1 << 20 };
+    struct kvdb_stats st;
+    char buf[32];
+    unlink("/tmp/test_cache.db");
+    tk_assert(kvdb_open_opts(&db, "/tmp/test_cache.db", &opts) == 0, "Must open db with cache");
+    tk_assert(kvdb_put(&db, "hot", "value1") == 0, "Must put hot");
+    tk_assert(kvdb_get(&db, "hot", buf, sizeof(buf)) == 6, "Must read hot from log");
+    tk_assert(kvdb_get(&db, "hot", buf, sizeof(buf)) == 6 && strcmp(buf, "value1") == 0,
+              "Must read hot from cache, got %s", buf);
+    tk_assert(kvdb_stats(&db, &st) == 0 && st.cache_hits == 1 && st.cache_misses == 1,
+              "Must count 1 hit and 1 miss, got %lu/%lu",
+              (unsigned long)st.cache_hits, (unsigned long)st.cache_misses);
+
+    // 命中时同样按缓冲区长度截断
+    tk_assert(kvdb_get(&db, "hot", buf, 4) == 3 && strcmp(buf, "val") == 0,
+              "Must truncate cached value, got %s", buf);
+
+    // 写入后缓存失效，读到新值
+    tk_assert(kvdb_put(&db, "hot", "value2") == 0, "Must overwrite hot");
+    tk_assert(kvdb_get(&db, "hot", buf, sizeof(buf)) == 6 && strcmp(buf, "value2") == 0,
+              "Must read new value after put, got %s", buf);
+    const char *keys[] = { "hot" }, *values[] = { "value3" };
+    tk_assert(kvdb_put_batch(&db, keys, values, 1) == 0, "Must put batch");
+    tk_assert(kvdb_get(&db, "hot", buf, sizeof(buf)) == 6 && strcmp(buf, "value3") == 0,
+              "Must read new value after batch, got %s", buf);
+
+    // 截断的读取不放入缓存
+    tk_assert(kvdb_put(&db, "hot", "value4") == 0, "Must overwrite hot");
+    tk_assert(kvdb_get(&db, "hot", buf, 4) == 3, "Must truncate miss");
+    kvdb_stats(&db, &st);
+    uint64_t misses = st.cache_misses;
+    tk_assert(kvdb_get(&db, "hot", buf, sizeof(buf)) == 6 && strcmp(buf, "value4") == 0,
+              "Must read full value, got %s", buf);
+    kvdb_stats(&db, &st);
+    tk_assert(st.cache_misses == misses + 1, "Must not cache truncated value");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+SystemTest(test_kvdb_stats, ((const char *[]){})) {
+    struct kvdb_t db;
+    static struct kvdb_stats st;
+    char key[32], buf[32];
+    struct kvdb_options opts = { .durability = KVDB_SYNC_COMMIT };
+    unlink("/tmp/test_stats.db");
+    tk_assert(kvdb_open_opts(&db, "/tmp/test_stats.db", &opts) == 0, "Must open db");
+    for (int i = 0; i < 100; i++) {
+        sprintf(key, "key%d", i);
+        tk_assert(kvdb_put(&db, key, "0123456789") == 0, "Must put %s", key);
+    }
+    for (int i = 0; i < 100; i++) {
+        sprintf(key, "key%d", i);
+        tk_assert(kvdb_get(&db, key, buf, sizeof(buf)) == 10, "Must get %s", key);
+    }
+    tk_assert(kvdb_get(&db, "missing", buf, sizeof(buf)) == -1, "Must not find missing");
+    tk_assert(kvdb_delete(&db, "key0") == 0, "Must delete key0");
+
+    tk_assert(kvdb_stats(&db, &st) == 0, "Must read stats");
+    tk_assert(st.puts == 100 && st.gets == 101 && st.bytes_read == 1000,
+              "Must count puts and gets, got %lu/%lu/%lu", (unsigned long)st.puts,
+              (unsigned long)st.gets, (unsigned long)st.bytes_read);
+    tk_assert(st.syncs >= 1 && st.syncs <= 101 && st.flushes == st.syncs && st.sync_ns > 0,
+              "Must count syncs, got %lu", (unsigned long)st.syncs);
+    tk_assert(st.log_bytes == 8 + st.bytes_written, "Must count every byte written to the log");
+    tk_assert(st.index_keys == 99 && st.index_capacity >= 128 && st.dead_bytes > 0,
+              "Must report index size, got %lu", (unsigned long)st.index_keys);
+    tk_assert(kvdb_histogram_count(&st.put_latency) == 100 &&
+              kvdb_histogram_count(&st.get_latency) == 101 &&
+              kvdb_histogram_count(&st.sync_latency) == st.syncs, "Must record every latency");
+    uint64_t p50 = kvdb_histogram_percentile(&st.sync_latency, 50);
+    uint64_t p99 = kvdb_histogram_percentile(&st.sync_latency, 99);
+    tk_assert(p50 > 0 && p50 <= p99 && p99 <= kvdb_histogram_percentile(&st.sync_latency, 100),
+              "Must compute ordered percentiles");
+    tk_assert(st.buffer_high_water > 0, "Must track buffer high-water mark");
+
+    tk_assert(kvdb_compact(&db) == 0 && kvdb_stats(&db, &st) == 0 && st.compactions == 1 &&
+              st.dead_bytes == 0, "Must count compaction");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+SystemTest(test_kvdb_snapshot, ((const char *[]){})) {
+    struct kvdb_t db;
+    char key[32], value[32], buf[32];
+    static char big[100 << 10]; // 不小于 64KB，直接写入文件
+    unlink("/tmp/test_snapshot.db");
+    tk_assert(kvdb_open(&db, "/tmp/test_snapshot.db") == 0, "Must open db");
+    for (int i = 0; i < 100; i++) {
+        sprintf(key, "key%03d", i);
+        sprintf(value, "old%d", i);
+        tk_assert(kvdb_put(&db, key, value) == 0, "Must put %s", key);
+    }
+    struct kvdb_snapshot *snap = kvdb_snapshot(&db);
+    tk_assert(snap != NULL, "Must create snapshot");
+
+    // 快照之后的覆盖（包括不经过缓冲区的大值）与新键都不可见
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 100; i += 2) {
+            sprintf(key, "key%03d", i);
+            sprintf(value, "new%d-%d", i, round);
+            tk_assert(kvdb_put(&db, key, value) == 0, "Must overwrite %s", key);
+        }
+    }
+    memset(big, 'x', sizeof(big) - 1);
+    tk_assert(kvdb_put(&db, "key001", big) == 0, "Must overwrite key001 with a large value");
+    tk_assert(kvdb_put(&db, "key100", "added") == 0, "Must put key100");
+    struct kvdb_snapshot *later = kvdb_snapshot(&db);
+    tk_assert(kvdb_put(&db, "key000", "newest") == 0, "Must overwrite key000 again");
+
+    tk_assert(kvdb_snapshot_get(snap, "key000", buf, sizeof(buf)) == 4 && strcmp(buf, "old0") == 0,
+              "Must read old key000 from snapshot, got %s", buf);
+    tk_assert(kvdb_snapshot_get(snap, "key001", buf, sizeof(buf)) == 4 && strcmp(buf, "old1") == 0,
+              "Must read old key001 from snapshot, got %s", buf);
+    tk_assert(kvdb_snapshot_get(snap, "key100", buf, sizeof(buf)) == -1, "Must not see key100");
+    tk_assert(kvdb_snapshot_get(later, "key000", buf, sizeof(buf)) > 0 && strcmp(buf, "new0-2") == 0,
+              "Must read key000 from later snapshot, got %s", buf);
+    tk_assert(kvdb_get(&db, "key000", buf, sizeof(buf)) == 6 && strcmp(buf, "newest") == 0,
+              "Must read latest key000, got %s", buf);
+    tk_assert(kvdb_compact(&db) == -1 && errno == EBUSY, "Must not compact with snapshots");
+
+    struct kvdb_iter *it = kvdb_snapshot_iter_open(snap, NULL, NULL);
+    const char *k, *v;
+    size_t klen, vlen;
+    int n = 0, same = 1;
+    while (kvdb_iter_next(it, &k, &klen, &v, &vlen) == 1) {
+        sprintf(value, "old%d", n++);
+        same &= vlen == strlen(value) && memcmp(v, value, vlen) == 0;
+    }
+    kvdb_iter_close(it);
+    tk_assert(n == 100 && same, "Must iterate the snapshot, got %d keys", n);
+    it = kvdb_snapshot_iter_prefix(later, "key10");
+    tk_assert(kvdb_iter_next(it, &k, &klen, &v, &vlen) == 1 && vlen == 5 && memcmp(v, "added", 5) == 0,
+              "Must see key100 in later snapshot");
+    kvdb_iter_close(it);
+
+    kvdb_snapshot_release(snap);
+    tk_assert(kvdb_snapshot_get(later, "key002", buf, sizeof(buf)) > 0 && strcmp(buf, "new2-2") == 0,
+              "Must keep later snapshot after releasing the first, got %s", buf);
+    kvdb_snapshot_release(later);
+    tk_assert(kvdb_compact(&db) == 0, "Must compact after releasing snapshots");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+    // 分片模式：各分片的快照取自同一时刻
+    struct kvdb_options opts = { .shards = 4 };
+    tk_assert(system("rm -rf /tmp/test_snapshot_shard && mkdir /tmp/test_snapshot_shard") == 0,
+              "Must create dir");
+    tk_assert(kvdb_open_opts(&db, "/tmp/test_snapshot_shard", &opts) == 0, "Must open sharded db");
+    for (int i = 0; i < 100; i++) {
+        sprintf(key, "key%03d", i);
+        tk_assert(kvdb_put(&db, key, "v1") == 0, "Must put %s", key);
+    }
+    snap = kvdb_snapshot(&db);
+    for (int i = 0; i < 100; i++) {
+        sprintf(key, "key%03d", i);
+        tk_assert(kvdb_put(&db, key, "v2") == 0, "Must overwrite %s", key);
+    }
+    it = kvdb_snapshot_iter_open(snap, NULL, NULL);
+    for (n = 0, same = 1; kvdb_iter_next(it, &k, &klen, &v, &vlen) == 1; n++) {
+        same &= vlen == 2 && memcmp(v, "v1", 2) == 0;
+    }
+    kvdb_iter_close(it);
+    tk_assert(n == 100 && same, "Must iterate sharded snapshot, got %d keys", n);
+    kvdb_snapshot_release(snap);
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+SystemTest(test_kvdb_delete, ((const char *[]){})) {
+    struct kvdb_t db;
+    char key[32], value[32], buf[32];
+    struct stat st;
+    unlink("/tmp/test_delete.db");
+    tk_assert(kvdb_open(&db, "/tmp/test_delete.db") == 0, "Must open db");
+    for (int i = 0; i < 100; i++) {
+        sprintf(key, "key%03d", i);
+        sprintf(value, "value%d", i);
+        tk_assert(kvdb_put(&db, key, value) == 0, "Must put %s", key);
+    }
+    struct kvdb_snapshot *snap = kvdb_snapshot(&db);
+    for (int i = 0; i < 100; i += 2) {
+        sprintf(key, "key%03d", i);
+        tk_assert(kvdb_delete(&db, key) == 0, "Must delete %s", key);
+    }
+    tk_assert(kvdb_get(&db, "key000", buf, sizeof(buf)) == -1, "Must not find deleted key");
+    tk_assert(kvdb_delete(&db, "key000") == -1 && errno == ENOENT, "Must not delete twice");
+    tk_assert(kvdb_delete(&db, "missing") == -1 && errno == ENOENT, "Must not delete missing key");
+    tk_assert(kvdb_snapshot_get(snap, "key000", buf, sizeof(buf)) > 0 && strcmp(buf, "value0") == 0,
+              "Must read deleted key from snapshot, got %s", buf);
+    kvdb_snapshot_release(snap);
+
+    struct kvdb_iter *it = kvdb_iter_open(&db, NULL, NULL);
+    const char *k, *v;
+    size_t klen, vlen;
+    int n = 0, odd = 1;
+    while (kvdb_iter_next(it, &k, &klen, &v, &vlen) == 1) {
+        sprintf(key, "key%03d", 2 * n++ + 1);
+        odd &= klen == strlen(key) && memcmp(k, key, klen) == 0;
+    }
+    kvdb_iter_close(it);
+    tk_assert(n == 50 && odd, "Must skip deleted keys, got %d keys", n);
+
+    // 删除在重新打开后仍然有效，删除后可以重新写入
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+    tk_assert(kvdb_open(&db, "/tmp/test_delete.db") == 0, "Must reopen db");
+    tk_assert(kvdb_get(&db, "key002", buf, sizeof(buf)) == -1, "Must stay deleted after reopen");
+    tk_assert(kvdb_get(&db, "key003", buf, sizeof(buf)) > 0 && strcmp(buf, "value3") == 0,
+              "Must keep live key after reopen, got %s", buf);
+    tk_assert(kvdb_put(&db, "key002", "again") == 0, "Must put deleted key again");
+    tk_assert(kvdb_get(&db, "key002", buf, sizeof(buf)) == 5 && strcmp(buf, "again") == 0,
+              "Must read re-put key, got %s", buf);
+
+    // 压缩丢弃删除标记与被删除的值
+    tk_assert(stat("/tmp/test_delete.db", &st) == 0, "Must stat db");
+    off_t before = st.st_size;
+    tk_assert(kvdb_compact(&db) == 0, "Must compact");
+    tk_assert(stat("/tmp/test_delete.db", &st) == 0 && st.st_size < before, "Must shrink the log");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+    tk_assert(kvdb_open(&db, "/tmp/test_delete.db") == 0, "Must reopen db");
+    tk_assert(kvdb_get(&db, "key004", buf, sizeof(buf)) == -1, "Must stay deleted after compaction");
+    tk_assert(db.index->count == 51 && db.index->deleted == 0, "Must index only live keys");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+    // 反复写入并删除不同的键：索引大小跟随存活的键数，而不是写过的键数
+    struct kvdb_options opts = { .durability = KVDB_SYNC_NONE };
+    unlink("/tmp/test_delete.db");
+    tk_assert(kvdb_open_opts(&db, "/tmp/test_delete.db", &opts) == 0, "Must open db");
+    for (int i = 0; i < 100000; i++) {
+        sprintf(key, "churn%d", i);
+        tk_assert(kvdb_put(&db, key, "x") == 0 && kvdb_delete(&db, key) == 0, "Must churn %s", key);
+    }
+    tk_assert(db.index->capacity <= 1024, "Must purge deleted keys, capacity %zu", db.index->capacity);
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+struct aio_result {
+    int calls;
+    int failed;
+};
+
+static int aio_sync_done;
+
+static void aio_done(void *arg, int result) {
+    struct aio_result *r = arg;
+    r->calls++;
+    r->failed += result != 0;
+}
+
+static void *aio_sync_writer(void *arg) {
+    struct kvdb_t *db = arg;
+    int rc = kvdb_put(db, "sync", "writer") == 0 && kvdb_flush(db) == 0 ? 1 : -1;
+    __atomic_store_n(&aio_sync_done, rc, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+SystemTest(test_kvdb_aio, ((const char *[]){})) {
+    struct kvdb_t db;
+    char key[32], value[32];
+    static char bufs[1000][32];
+    static size_t lens[1000];
+    unlink("/tmp/test_aio.db");
+    struct kvdb_options opts = { .durability = KVDB_SYNC_COMMIT };
+    tk_assert(kvdb_open_opts(&db, "/tmp/test_aio.db", &opts) == 0, "Must open db");
+    struct kvdb_aio *aio = kvdb_aio_open(&db, 16);
+    tk_assert(aio != NULL, "Must open aio handle");
+
+    // 大量写入同时在途，落盘后才回调
+    struct aio_result puts = {0}, gets = {0}, missing = {0};
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(value, "value%d", i);
+        tk_assert(kvdb_aio_put(aio, key, strlen(key), value, strlen(value), aio_done, &puts) == 0,
+                  "Must submit put %s", key);
+        if (i % 100 == 99) kvdb_aio_poll(aio, 0);
+    }
+    while (puts.calls < 1000) {
+        tk_assert(kvdb_aio_poll(aio, 1) >= 0, "Must poll");
+    }
+    tk_assert(puts.failed == 0, "Must complete all puts");
+
+    // 压缩之后发起的读取读的是新文件
+    tk_assert(kvdb_put(&db, "key0", "rewritten") == 0 && kvdb_compact(&db) == 0, "Must compact");
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "key%d", i);
+        tk_assert(kvdb_aio_get(aio, key, strlen(key), bufs[i], sizeof(bufs[i]), &lens[i],
+                               aio_done, &gets) == 0, "Must submit get %s", key);
+    }
+    tk_assert(kvdb_aio_get(aio, "missing", 7, bufs[0], 0, &lens[0], aio_done, &missing) == 0,
+              "Must submit get for a missing key");
+    while (gets.calls < 1000 || missing.calls < 1) {
+        tk_assert(kvdb_aio_poll(aio, 1) >= 0, "Must poll");
+    }
+    int same = 1;
+    for (int i = 1; i < 1000; i++) {
+        sprintf(value, "value%d", i);
+        same &= lens[i] == strlen(value) && memcmp(bufs[i], value, lens[i]) == 0;
+    }
+    tk_assert(gets.failed == 0 && same, "Must read all values asynchronously");
+    tk_assert(lens[0] == 9 && memcmp(bufs[0], "rewritten", 9) == 0, "Must read value after compaction");
+    tk_assert(missing.failed == 1, "Must fail for a missing key");
+
+    // 句柄提交一组后不再 poll，其他线程的同步写入与 kvdb_flush 也不被阻塞
+    puts = (struct aio_result) {0};
+    tk_assert(kvdb_aio_put(aio, "pinned", 6, "group", 5, aio_done, &puts) == 0, "Must submit put");
+    tk_assert(kvdb_aio_poll(aio, 0) >= 0, "Must poll");
+    pthread_t writer;
+    pthread_create(&writer, NULL, aio_sync_writer, &db);
+    for (int i = 0; i < 500 && !__atomic_load_n(&aio_sync_done, __ATOMIC_ACQUIRE); i++) {
+        usleep(1000);
+    }
+    tk_assert(__atomic_load_n(&aio_sync_done, __ATOMIC_ACQUIRE) == 1,
+              "Must not block sync writers while the aio handle is idle");
+    pthread_join(writer, NULL);
+    while (puts.calls < 1) {
+        tk_assert(kvdb_aio_poll(aio, 1) >= 0, "Must poll");
+    }
+    tk_assert(puts.failed == 0, "Must complete pinned put");
+    kvdb_aio_close(aio);
+
+    // 关闭句柄时等待未完成的写入
+    aio = kvdb_aio_open(&db, 0);
+    puts = (struct aio_result) {0};
+    tk_assert(kvdb_aio_put(aio, "last", 4, "one", 3, aio_done, &puts) == 0, "Must submit put");
+    kvdb_aio_close(aio);
+    tk_assert(puts.calls == 1 && puts.failed == 0, "Must complete put on close");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+    tk_assert(kvdb_open(&db, "/tmp/test_aio.db") == 0, "Must reopen db");
+    tk_assert(kvdb_get(&db, "sync", value, sizeof(value)) == 6, "Must persist sync put");
+    tk_assert(kvdb_get(&db, "last", value, sizeof(value)) == 3 && strcmp(value, "one") == 0,
+              "Must persist async put, got %s", value);
+    tk_assert(kvdb_get(&db, "key999", value, sizeof(value)) > 0 && strcmp(value, "value999") == 0,
+              "Must persist async puts, got %s", value);
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+SystemTest(test_kvdb_recovery, ((const char *[]){})) {
+    struct kvdb_t db;
+    struct stat st;
+    char key[32], buf[32];
+    unlink("/tmp/test_recovery.db");
+    tk_assert(kvdb_open(&db, "/tmp/test_recovery.db") == 0, "Must open db");
+    for (int i = 0; i < 10; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        tk_assert(kvdb_put(&db, key, "value") == 0, "Must put %s", key);
+    }
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+    // 末尾追加半条记录：恢复时截掉
+    tk_assert(stat("/tmp/test_recovery.db", &st) == 0, "Must stat db");
+    off_t size = st.st_size, rec_size = (size - 8) / 10;
+    int fd = open("/tmp/test_recovery.db", O_RDWR);
+    tk_assert(fd >= 0, "Must open file");
+    tk_assert(pwrite(fd, "torn", 4, size) == 4, "Must append torn tail");
+    close(fd);
+    tk_assert(kvdb_open(&db, "/tmp/test_recovery.db") == 0, "Must reopen db");
+    tk_assert(stat("/tmp/test_recovery.db", &st) == 0 && st.st_size == size,
+              "Must truncate the torn tail, size %ld", (long)st.st_size);
+    tk_assert(kvdb_get(&db, "key9", buf, sizeof(buf)) == 5, "Must keep key9");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+    // 最后一条记录校验和不符：同样视为未写完的尾部
+    fd = open("/tmp/test_recovery.db", O_RDWR);
+    tk_assert(fd >= 0 && pwrite(fd, "Y", 1, size - 1) == 1, "Must corrupt last record");
+    close(fd);
+    tk_assert(kvdb_open(&db, "/tmp/test_recovery.db") == 0, "Must reopen db");
+    tk_assert(stat("/tmp/test_recovery.db", &st) == 0 && st.st_size == size - rec_size,
+              "Must truncate the bad tail record, size %ld", (long)st.st_size);
+    tk_assert(kvdb_get(&db, "key8", buf, sizeof(buf)) == 5, "Must keep key8");
+    tk_assert(kvdb_get(&db, "key9", buf, sizeof(buf)) == -1, "Must drop torn key9");
+    tk_assert(kvdb_put(&db, "key9", "again") == 0, "Must put after recovery");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+    // 中间的记录损坏：打开失败，文件原样保留，之后的记录不会被截掉
+    fd = open("/tmp/test_recovery.db", O_RDWR);
+    tk_assert(fd >= 0 && pwrite(fd, "X", 1, 8 + 5 * rec_size + rec_size - 1) == 1,
+              "Must corrupt key5");
+    close(fd);
+    errno = 0;
+    tk_assert(kvdb_open(&db, "/tmp/test_recovery.db") == -1 && errno == EIO,
+              "Must refuse a corrupt middle record, errno %d", errno);
+    tk_assert(stat("/tmp/test_recovery.db", &st) == 0 && st.st_size == size,
+              "Must leave the file untouched, size %ld", (long)st.st_size);
+
+    // 修复后所有记录都在
+    fd = open("/tmp/test_recovery.db", O_RDWR);
+    tk_assert(fd >= 0 && pwrite(fd, "e", 1, 8 + 5 * rec_size + rec_size - 1) == 1,
+              "Must repair key5");
+    close(fd);
+    tk_assert(kvdb_open(&db, "/tmp/test_recovery.db") == 0, "Must reopen repaired db");
+    tk_assert(kvdb_get(&db, "key5", buf, sizeof(buf)) == 5, "Must keep key5");
+    tk_assert(kvdb_get(&db, "key9", buf, sizeof(buf)) == 5 && strcmp(buf, "again") == 0,
+              "Must keep records after key5");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+SystemTest(test_kvdb_recovery_time, ((const char *[]){})) {
+    struct kvdb_t db;
+    struct stat st;
+    char key[32], value[100];
+    struct kvdb_options opts = { .durability = KVDB_SYNC_NONE };
+    unlink("/tmp/test_recovery_time.db");
+    tk_assert(kvdb_open_opts(&db, "/tmp/test_recovery_time.db", &opts) == 0, "Must open db");
+    // 值的每 4 字节读作长度都约为 1MB：在损坏处之后逐字节找记录边界会是平方级的
+    for (size_t i = 0; i < sizeof(value); i++) {
+        value[i] = i % 4 == 2 ? 0x10 : 0;
+    }
+    for (int i = 0; i < 40000; i++) {
+        snprintf(key, sizeof(key), "key%05d", i);
+        tk_assert(kvdb_put_n(&db, key, 8, value, sizeof(value)) == 0, "Must put %s", key);
+    }
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+    tk_assert(stat("/tmp/test_recovery_time.db", &st) == 0 && st.st_size > 4 << 20,
+              "Must build a multi-MB log");
+
+    uint64_t start = now_ns();
+    tk_assert(kvdb_open(&db, "/tmp/test_recovery_time.db") == 0, "Must reopen db");
+    uint64_t clean = now_ns() - start;
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+
+    // 翻转开头附近第 3 条记录值中的一个字节
+    int fd = open("/tmp/test_recovery_time.db", O_RDWR);
+    off_t rec_size = (st.st_size - 8) / 40000;
+    tk_assert(fd >= 0 && pwrite(fd, "X", 1, 8 + 3 * rec_size - 1) == 1,
+              "Must corrupt an early record");
+    close(fd);
+    start = now_ns();
+    tk_assert(kvdb_open(&db, "/tmp/test_recovery_time.db") == -1 && errno == EIO,
+              "Must refuse the corrupt log");
+    uint64_t corrupt = now_ns() - start;
+    tk_assert(corrupt <= clean * 2 + 50000000,
+              "Recovery must stay linear: %lu ns vs %lu ns clean",
+              (unsigned long)corrupt, (unsigned long)clean);
+    tk_assert(stat("/tmp/test_recovery_time.db", &st) == 0 && st.st_size == 8 + 40000 * rec_size,
+              "Must leave the file untouched");
+}
+
+SystemTest(test_kvdb_legacy_upgrade, ((const char *[]){})) {
+    struct kvdb_t db;
+    char buf[32];
+    // 旧格式：[key_len][value_len][key][value]，末尾有半条记录
+    const char legacy[] = "\x01\0\0\0\x02\0\0\0" "ab" "c" "\x01\0\0\0\x05\0\0\0" "x";
+    int fd = open("/tmp/test_legacy.db", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    tk_assert(fd >= 0 && write(fd, legacy, sizeof(legacy) - 1) == sizeof(legacy) - 1, "Must write legacy log");
+    close(fd);
+    tk_assert(kvdb_open(&db, "/tmp/test_legacy.db") == 0, "Must open legacy db");
+    tk_assert(kvdb_get(&db, "a", buf, sizeof(buf)) == 2 && strcmp(buf, "bc") == 0, "Must read legacy record");
+    tk_assert(kvdb_put(&db, "d", "e") == 0, "Must put after upgrade");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+    tk_assert(kvdb_open(&db, "/tmp/test_legacy.db") == 0, "Must reopen db");
+    tk_assert(kvdb_get(&db, "a", buf, sizeof(buf)) == 2 && kvdb_get(&db, "d", buf, sizeof(buf)) == 1,
+              "Must keep upgraded records");
+    tk_assert(kvdb_close(&db) == 0, "Must close db");
+}
+
+// 并发压力测试：写者不断覆盖各自的键，读者无锁读取并检查读到的记录完整、版本不回退，
+// 同时有线程反复压缩日志
+#define STRESS_WRITERS 2
+#define STRESS_READERS 4
+#define STRESS_KEYS 1000
+#define STRESS_ROUNDS 100000
+
+static struct kvdb_t stress_db;
+static int stress_done;
+
+static void *stress_writer(void *arg) {
+    long w = (long)arg;
+    char key[32], value[128];
+    for (int i = 0; i < STRESS_ROUNDS; i++) {
+        snprintf(key, sizeof(key), "w%ld-%d", w, i % STRESS_KEYS);
+        snprintf(value, sizeof(value), "%s=%d=%080d", key, i, 0);
+        if (kvdb_put(&stress_db, key, value) != 0) return (void *)1;
+    }
+    return NULL;
+}
+
+static void *stress_reader(void *arg) {
+    static __thread int last[STRESS_WRITERS][STRESS_KEYS];
+    unsigned seed = (unsigned)(long)arg;
+    char key[32], buf[128];
+    for (int i = 0; i < STRESS_ROUNDS; i++) {
+        seed = seed * 1103515245 + 12345;
+        int w = (seed >> 16) % STRESS_WRITERS, k = (seed >> 4) % STRESS_KEYS;
+        snprintf(key, sizeof(key), "w%d-%d", w, k);
+        if (kvdb_get(&stress_db, key, buf, sizeof(buf)) < 0) continue;
+        size_t len = strlen(key);
+        if (strncmp(buf, key, len) != 0 || buf[len] != '=') return (void *)1;
+        int seq = atoi(buf + len + 1);
+        if (seq < last[w][k]) return (void *)1;
+        last[w][k] = seq;
+    }
+    return NULL;
+}
+
+static void *stress_compactor(void *arg) {
+    while (!__atomic_load_n(&stress_done, __ATOMIC_ACQUIRE)) {
+        if (kvdb_compact(&stress_db) != 0) return (void *)1;
+        usleep(2000);
+    }
+    return NULL;
+}
+
+SystemTest(test_kvdb_concurrent, ((const char *[]){})) {
+    pthread_t writers[STRESS_WRITERS], readers[STRESS_READERS], compactor;
+    struct kvdb_options opts = { .durability = KVDB_SYNC_NONE };
+    void *ret;
+    unlink("/tmp/test_concurrent.db");
+    tk_assert(kvdb_open_opts(&stress_db, "/tmp/test_concurrent.db", &opts) == 0, "Must open db");
+    pthread_create(&compactor, NULL, stress_compactor, NULL);
+    for (long i = 0; i < STRESS_WRITERS; i++) pthread_create(&writers[i], NULL, stress_writer, (void *)i);
+    for (long i = 0; i < STRESS_READERS; i++) pthread_create(&readers[i], NULL, stress_reader, (void *)i);
+    for (int i = 0; i < STRESS_WRITERS; i++) {
+        pthread_join(writers[i], &ret);
+        tk_assert(ret == NULL, "Writer %d must succeed", i);
+    }
+    for (int i = 0; i < STRESS_READERS; i++) {
+        pthread_join(readers[i], &ret);
+        tk_assert(ret == NULL, "Reader %d must see consistent values", i);
+    }
+    __atomic_store_n(&stress_done, 1, __ATOMIC_RELEASE);
+    pthread_join(compactor, &ret);
+    tk_assert(ret == NULL, "Compaction must succeed");
+
+    // 每个键的最终值是最后一轮写入的版本
+    char key[32], buf[128];
+    for (int w = 0; w < STRESS_WRITERS; w++) {
+        for (int k = 0; k < STRESS_KEYS; k++) {
+            snprintf(key, sizeof(key), "w%d-%d", w, k);
+            tk_assert(kvdb_get(&stress_db, key, buf, sizeof(buf)) > 0 &&
+                      atoi(buf + strlen(key) + 1) == STRESS_ROUNDS - STRESS_KEYS + k,
+                      "Must keep last version of %s", key);
+        }
+    }
+    tk_assert(kvdb_close(&stress_db) == 0, "Must close db");
+}
+
 int main() {
 }
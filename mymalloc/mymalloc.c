@@ -1,184 +1,322 @@
 #include <mymalloc.h>
-typedef int pid_t;
+
+struct thread_heap;
 
 typedef struct block {
     size_t length;
     struct block *next;
-    pid_t owner_tid;
+    struct thread_heap *owner;  // 分配该块的线程的堆
+    int flags;
 } Block;
 
+#define BLOCK_MAPPED 1  // 单独 vmalloc 的巨块，释放时直接归还
+#define BLOCK_LARGE  2  // 大块区域中的块，带边界标记
+#define BLOCK_FREE   4  // 大块区域中的空闲块
+
 #define STRUCTSIZE (((sizeof(Block) + 7) & ~7))
-#define MAX_THREADS 64  // 根据实际需求调整大小
-#define SYS_gettid 186  // x86_64系统调用号
-#define INITIAL_CHUNK_SIZE (4 * 4096) // 预分配16KB大块
-// 每个线程本地链表对应一个锁
+#define HEAP_POOL_SIZE (4 * 4096)  // 线程堆结构从这么大的页中切出
+
+// 大块（SMALL_MAX 到 LARGE_MAX）从所有线程共享的区域中切分，释放时与相邻空闲块合并。
+// 每块在头部 Block 之外，负载之后还有一个尾标记：负载长度，最低位表示空闲
+#define LARGE_REGION (256 * 4096)      // 每次向 vmalloc 要的区域大小
+#define LARGE_MAX (LARGE_REGION / 4)   // 更大的请求单独映射
+#define LARGE_BINS 8                   // 空闲块按长度的 2 的幂分组
+#define LARGE_SPLIT_MIN 64             // 切分后剩余负载至少这么大才切
+#define FOOTER sizeof(size_t)
+#define TAG_FREE 1
+// 空闲大块在负载开头存放链表中的前驱
+#define LARGE_PREV(b) (*(Block**)((char*)(b) + STRUCTSIZE))
+
+// 大小类：128 以内每 16 字节一类，之后每个 2 的幂区间分为 4 类，最大 SMALL_MAX
+#define SMALL_MAX 2048
+#define NUM_CLASSES 24
+#define SLAB_SIZE (16 * 4096)  // 每次向 vmalloc 要的 slab 大小
+
+// 每个大小类一条空闲链表，外加当前 slab 中尚未切出的部分
 typedef struct {
-    Block* head;
-    spinlock_t lock;
+    Block *free;
+    char *bump;
+    char *end;
+} SizeClass;
+
+// 每个线程独占一个堆：classes 只由所属线程访问，不加锁。
+// remote 是其他线程释放的块组成的无锁栈：多个线程压栈，所属线程一次整栈取走
+typedef struct thread_heap {
+    SizeClass classes[NUM_CLASSES];
+    struct thread_heap *next_free; // 在 free_heaps 中时指向下一个
+    _Atomic(Block*) remote __attribute__((aligned(64))); // 与 classes 分开缓存行，压栈不干扰本地分配
 } ThreadHeap;
 
-static ThreadHeap thread_heaps[MAX_THREADS] = {{0}}; // 线程本地存储数组
-static Block* global_free_list = NULL;
-static spinlock_t global_lock={UNLOCKED};  // 全局链表锁
+static Block *large_bins[LARGE_BINS];
+static int large_regions;
+static spinlock_t large_lock = {UNLOCKED};
+
+static __thread ThreadHeap *local_heap;  // 当前线程的堆，首次分配时建立
+static ThreadHeap *heap_pool;            // 尚未分出的线程堆
+static size_t heap_pool_left;
+static ThreadHeap *free_heaps;           // 已退出线程留下的堆，由新线程接管
+static spinlock_t heap_pool_lock = {UNLOCKED};
 
-// 内联汇编获取线程ID
-static inline pid_t gettid(void) {
-    pid_t tid;
-    __asm__ volatile (
-        "syscall"
-        : "=a" (tid)
-        : "0" (SYS_gettid)
-        : "rcx", "r11", "memory"
-    );
-    return tid;
+// 线程退出时回收堆要用线程特定数据的析构函数。弱引用：独立环境下没有 pthread，
+// 这两个符号为 NULL，堆不回收
+extern int pthread_key_create(unsigned int *key, void (*destructor)(void *)) __attribute__((weak));
+extern int pthread_setspecific(unsigned int key, const void *value) __attribute__((weak));
+static unsigned int heap_key;
+static int heap_key_ready;  // 0 未创建，1 已创建，-1 不可用
+
+// 线程退出：把堆连同其中的 slab、空闲链表和 remote 栈交给下一个新线程。
+// 先清掉 local_heap，之后其他析构函数里的 myfree 都走跨线程路径，不再碰这个堆
+static void heap_release(void *arg) {
+    ThreadHeap *heap = arg;
+    local_heap = NULL;
+    spin_lock(&heap_pool_lock);
+    heap->next_free = free_heaps;
+    free_heaps = heap;
+    spin_unlock(&heap_pool_lock);
 }
 
-// 自旋锁操作宏
+// 获取当前线程的本地堆：优先接管已退出线程的堆，其他线程可能还持有它分配的块，
+// 这些块释放时照常进入它的 remote 栈
+static ThreadHeap* get_thread_heap(void) {
+    ThreadHeap *heap = local_heap;
+    if (heap) return heap;
 
-// 获取线程对应的本地堆
-static ThreadHeap* get_thread_heap() {
-    pid_t tid = gettid();
-    return &thread_heaps[tid % MAX_THREADS];
+    spin_lock(&heap_pool_lock);
+    if (heap_key_ready == 0) {
+        heap_key_ready = pthread_key_create && pthread_key_create(&heap_key, heap_release) == 0 ? 1 : -1;
+    }
+    if (free_heaps) {
+        heap = free_heaps;
+        free_heaps = heap->next_free;
+    } else if (heap_pool_left == 0) {
+        heap_pool = vmalloc(NULL, HEAP_POOL_SIZE);  // 匿名映射，已清零
+        heap_pool_left = heap_pool ? HEAP_POOL_SIZE / sizeof(ThreadHeap) : 0;
+    }
+    if (!heap && heap_pool_left) {
+        heap = heap_pool++;
+        heap_pool_left--;
+    }
+    spin_unlock(&heap_pool_lock);
+    local_heap = heap;
+    if (heap && heap_key_ready > 0) {
+        pthread_setspecific(heap_key, heap);
+    }
+    return heap;
+}
+
+// size（1..SMALL_MAX）所属的大小类
+static inline int size_class(size_t size) {
+    if (size <= 128) return (size + 15) / 16 - 1;
+    int e = 63 - __builtin_clzl(size - 1);  // 2^e < size <= 2^(e+1)
+    return 8 + (e - 7) * 4 + (int)((size - 1) >> (e - 2)) - 4;
+}
+
+// 大小类中每块的字节数
+static inline size_t class_size(int c) {
+    if (c < 8) return (size_t)(c + 1) * 16;
+    int e = 7 + (c - 8) / 4;
+    return (size_t)(5 + (c - 8) % 4) << (e - 2);
+}
+
+// 从大小类取一块：先取空闲链表，再从当前 slab 切，slab 用完时向 vmalloc 要新的
+static Block *class_pop(ThreadHeap *heap, int c) {
+    SizeClass *sc = &heap->classes[c];
+    Block *blk = sc->free;
+    if (blk) {
+        sc->free = blk->next;
+        return blk;
+    }
+    size_t stride = STRUCTSIZE + class_size(c);
+    if (sc->bump == NULL || sc->end - sc->bump < (long)stride) {
+        char *slab = vmalloc(NULL, SLAB_SIZE);
+        if (!slab) return NULL;
+        sc->bump = slab;
+        sc->end = slab + SLAB_SIZE;
+    }
+    blk = (Block*)sc->bump;
+    sc->bump += stride;
+    blk->length = class_size(c);
+    blk->owner = heap;
+    blk->flags = 0;
+    return blk;
+}
+
+static inline void class_push(ThreadHeap *heap, Block *blk) {
+    SizeClass *sc = &heap->classes[size_class(blk->length)];
+    blk->next = sc->free;
+    sc->free = blk;
+}
+
+static inline int large_bin(size_t length) {
+    int b = 63 - __builtin_clzl(length) - 11;  // 2048..4095 在第 0 组
+    if (b < 0) return 0;
+    return b < LARGE_BINS ? b : LARGE_BINS - 1;
+}
+
+static inline size_t *footer_of(Block *b) {
+    return (size_t*)((char*)b + STRUCTSIZE + b->length);
+}
+
+// 地址上紧随其后的块
+static inline Block *next_of(Block *b) {
+    return (Block*)((char*)footer_of(b) + FOOTER);
+}
+
+static inline void set_tags(Block *b, size_t length, int free) {
+    b->length = length;
+    b->owner = NULL;
+    b->flags = BLOCK_LARGE | (free ? BLOCK_FREE : 0);
+    *footer_of(b) = length | (free ? TAG_FREE : 0);
+}
+
+static void large_insert(Block *b) {
+    Block **bin = &large_bins[large_bin(b->length)];
+    b->next = *bin;
+    LARGE_PREV(b) = NULL;
+    if (*bin) LARGE_PREV(*bin) = b;
+    *bin = b;
+}
+
+static void large_remove(Block *b) {
+    Block *prev = LARGE_PREV(b);
+    if (prev) prev->next = b->next;
+    else large_bins[large_bin(b->length)] = b->next;
+    if (b->next) LARGE_PREV(b->next) = prev;
+}
+
+// 新区域：开头一个“使用中”的空尾标记，结尾一个长度为 0 的“使用中”块头，合并不会越过区域边界
+static Block *large_region(void) {
+    char *region = vmalloc(NULL, LARGE_REGION);
+    if (!region) return NULL;
+    *(size_t*)region = 0;
+    Block *b = (Block*)(region + FOOTER);
+    set_tags(b, LARGE_REGION - 2 * FOOTER - 2 * STRUCTSIZE, 1);
+    Block *end = next_of(b);
+    end->length = 0;
+    end->owner = NULL;
+    end->flags = BLOCK_LARGE;
+    large_regions++;
+    return b;
+}
+
+// 调用者持有 large_lock
+static Block *large_alloc(size_t size) {
+    Block *b = NULL;
+    for (int i = large_bin(size); i < LARGE_BINS && !b; i++) {
+        for (b = large_bins[i]; b && b->length < size; b = b->next) ;
+    }
+    if (b) {
+        large_remove(b);
+    } else if (!(b = large_region())) {
+        return NULL;
+    }
+
+    if (b->length >= size + STRUCTSIZE + FOOTER + LARGE_SPLIT_MIN) {
+        size_t rest = b->length - size - STRUCTSIZE - FOOTER;
+        set_tags(b, size, 0);
+        Block *r = next_of(b);
+        set_tags(r, rest, 1);
+        large_insert(r);
+    } else {
+        set_tags(b, b->length, 0);
+    }
+    return b;
+}
+
+// 调用者持有 large_lock
+static void large_free(Block *b) {
+    size_t length = b->length;
+    size_t tag = *((size_t*)b - 1);
+    if (tag & TAG_FREE) {
+        // 与前一块合并
+        Block *prev = (Block*)((char*)b - FOOTER - (tag & ~TAG_FREE) - STRUCTSIZE);
+        large_remove(prev);
+        length += prev->length + FOOTER + STRUCTSIZE;
+        b = prev;
+    }
+    Block *next = (Block*)((char*)b + STRUCTSIZE + length + FOOTER);
+    if (next->flags & BLOCK_FREE) {
+        // 与后一块合并
+        large_remove(next);
+        length += next->length + FOOTER + STRUCTSIZE;
+    }
+    set_tags(b, length, 1);
+
+    // 整个区域都空了：归还，但留下最后一个区域给下次分配
+    if (*((size_t*)b - 1) == 0 && next_of(b)->length == 0 && large_regions > 1) {
+        large_regions--;
+        vmfree((char*)b - FOOTER, LARGE_REGION);
+        return;
+    }
+    large_insert(b);
 }
 
 void *mymalloc(size_t size) {
     if (size == 0) return NULL;
     size = (size + 7) & ~7;  // 8字节对齐
-    pid_t tid = gettid();
-    ThreadHeap* heap = get_thread_heap();
-    Block *curr = NULL, *prev = NULL;
-    void *ret = NULL;
-    curr = heap->head;
-    //-----------
-    if (heap->head == NULL) {
-        spin_lock(&heap->lock);
-        if (heap->head == NULL) { // Double-Check Locking
-            size_t chunk_size = INITIAL_CHUNK_SIZE;
-            Block *big_block = vmalloc(NULL, chunk_size);
-            if (big_block) {
-                // 切割大块为多个固定大小的块（例如256B）
-                char *current = (char*)big_block;
-                size_t block_size = 4096; // 根据测试用例调整
-                while (current + STRUCTSIZE + block_size <= (char*)big_block + chunk_size) {
-                    Block *blk = (Block*)current;
-                    blk->length = block_size;
-                    blk->next = heap->head;
-                    blk->owner_tid = tid;
-                    heap->head = blk;
-                    current += STRUCTSIZE + block_size;
-                }
-                // 剩余空间加入全局链表
-                if ((char*)big_block + chunk_size - current >= STRUCTSIZE) {
-                    Block *remain = (Block*)current;
-                    remain->length = (char*)big_block + chunk_size - current - STRUCTSIZE;
-                    remain->owner_tid = tid;
-                    spin_lock(&global_lock);
-                    remain->next = global_free_list;
-                    global_free_list = remain;
-                    spin_unlock(&global_lock);
-                }
-            }
-        }
-        spin_unlock(&heap->lock);
-    }
-    //-----------
-    // 本地分配尝试（使用本地锁）
-    spin_lock(&heap->lock);
-    //curr = heap->head;
-    while (curr) {
-        if (curr->length >= size) {
-            // 从链表中解绑
-            if (prev) prev->next = curr->next;
-            else heap->head = curr->next;
-
-            // 内存分割逻辑
-            if (curr->length > size + STRUCTSIZE) {
-                Block *new_remain = (Block*)((char*)curr + STRUCTSIZE + size);
-                new_remain = (Block*)(((size_t)new_remain + 7) & ~7);
-                size_t remaining = (char*)curr + STRUCTSIZE + curr->length - (char*)new_remain;
-                
-                if (remaining >= STRUCTSIZE) {
-                    new_remain->length = remaining - STRUCTSIZE;
-                    new_remain->next = heap->head;
-                    new_remain->owner_tid = tid;
-                    heap->head = new_remain;
-                    curr->length = size;
-                }
-            }
-            ret = (char*)curr + STRUCTSIZE;
-            spin_unlock(&heap->lock);
-            return ret;
-        }
-        prev = curr;
-        curr = curr->next;
-    }
-    spin_unlock(&heap->lock);
-
-    // 全局链表尝试（使用全局锁）
-    spin_lock(&global_lock);
-    curr = global_free_list;
-    prev = NULL;
-    while (curr) {
-        if (curr->length >= size) {
-            if (prev) prev->next = curr->next;
-            else global_free_list = curr->next;
-            
-            // 更新归属线程并分割
-            curr->owner_tid = tid;
-            if (curr->length > size + STRUCTSIZE) {
-                Block *new_remain = (Block*)((char*)curr + STRUCTSIZE + size);
-                new_remain = (Block*)(((size_t)new_remain + 7) & ~7);
-                size_t remaining = (char*)curr + STRUCTSIZE + curr->length - (char*)new_remain;
-                
-                if (remaining >= STRUCTSIZE) {
-                    new_remain->length = remaining - STRUCTSIZE;
-                    spin_lock(&heap->lock);  // 需要再次获取本地锁
-                    new_remain->next = heap->head;
-                    heap->head = new_remain;
-                    spin_unlock(&heap->lock);
-                    curr->length = size;
-                }
-            }
-            ret = (char*)curr + STRUCTSIZE;
-            break;
-        }
-        prev = curr;
-        curr = curr->next;
+
+    if (size > SMALL_MAX && size <= LARGE_MAX) {
+        spin_lock(&large_lock);
+        Block *b = large_alloc(size);
+        spin_unlock(&large_lock);
+        return b ? (char*)b + STRUCTSIZE : NULL;
     }
-    spin_unlock(&global_lock);
 
-    if (ret) return ret;
+    if (size > LARGE_MAX) {
+        // 巨块单独映射，释放时归还
+        size_t aligned_length = ((size + STRUCTSIZE + 4095) / 4096) * 4096;
+        Block *new_block = vmalloc(NULL, aligned_length);
+        if (!new_block) return NULL;
+
+        new_block->length = aligned_length - STRUCTSIZE;
+        new_block->owner = NULL;
+        new_block->flags = BLOCK_MAPPED;
+        new_block->next = NULL;
+        return (char*)new_block + STRUCTSIZE;
+    }
 
-    // 分配新内存块
-    size_t aligned_length = ((size + STRUCTSIZE + 4095) / 4096) * 4096;
-    Block *new_block = vmalloc(NULL, aligned_length);
-    if (!new_block) return NULL;
-    
-    new_block->length = aligned_length - STRUCTSIZE;
-    new_block->owner_tid = tid;
-    new_block->next = NULL;
-    return (char*)new_block + STRUCTSIZE;
+    ThreadHeap* heap = get_thread_heap();
+    if (!heap) return NULL;
+    // 先把其他线程释放回来的块整批取下，再放回各自的大小类。
+    // 只有所属线程会取栈，整栈交换不会遇到 ABA
+    if (atomic_load_explicit(&heap->remote, memory_order_relaxed)) {
+        Block *list = atomic_exchange_explicit(&heap->remote, NULL, memory_order_acquire);
+        while (list) {
+            Block *blk = list;
+            list = blk->next;
+            class_push(heap, blk);
+        }
+    }
+    Block *blk = class_pop(heap, size_class(size));
+    return blk ? (char*)blk + STRUCTSIZE : NULL;
 }
 
 void myfree(void *ptr) {
-    /*if (!ptr) return;
+    if (!ptr) return;
 
     Block *info = (Block*)((char*)ptr - STRUCTSIZE);
-    pid_t curr_tid = gettid();
-
-    if (info->owner_tid == curr_tid) {
-        // 本地释放（使用本地锁）
-        ThreadHeap* heap = get_thread_heap();
-        spin_lock(&heap->lock);
-        info->next = heap->head;
-        heap->head = info;
-        spin_unlock(&heap->lock);
-    } else {
-        // 跨线程释放（使用全局锁）
-        spin_lock(&global_lock);
-        info->next = global_free_list;
-        global_free_list = info;
-        spin_unlock(&global_lock);
-    }*/
-   return;
-}
\ No newline at end of file
+    if (info->flags & BLOCK_MAPPED) {
+        // 单独映射的巨块直接归还，不留在链表里占用内存
+        vmfree(info, info->length + STRUCTSIZE);
+        return;
+    }
+    if (info->flags & BLOCK_LARGE) {
+        spin_lock(&large_lock);
+        large_free(info);
+        spin_unlock(&large_lock);
+        return;
+    }
+
+    ThreadHeap* owner = info->owner;
+    if (owner == local_heap) {
+        // 本地释放：放回所属大小类的链表头，下次同样大小的分配立即复用
+        class_push(owner, info);
+        return;
+    }
+    // 跨线程释放：压入所有者的 remote 栈，由它下次分配时整批取回
+    Block *head = atomic_load_explicit(&owner->remote, memory_order_relaxed);
+    do {
+        info->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&owner->remote, &head, info,
+                                                    memory_order_release, memory_order_relaxed));
+}
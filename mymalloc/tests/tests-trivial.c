@@ -3,6 +3,10 @@
 
 #include <testkit.h>
 #include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
 #include <mymalloc.h>
 
 SystemTest(trivial, ((const char *[]){})) {
@@ -35,6 +39,115 @@ SystemTest(vmalloc, ((const char *[]){})) {
     vmfree(p2, 8192);
 }
 
+// 常驻内存页数
+static long resident_pages(void) {
+    long size = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &size, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident;
+}
+
+SystemTest(free_reuse, ((const char *[]){})) {
+    void *p = mymalloc(100);
+    myfree(p);
+    void *q = mymalloc(100);
+    tk_assert(p == q, "freed block should be reused");
+    myfree(q);
+    myfree(NULL);
+
+    // 稳定的分配/释放循环：常驻内存不应随循环次数增长
+    void *live[64] = {0};
+    unsigned seed = 1;
+    for (int round = 0; round < 2; round++) {
+        long before = resident_pages();
+        for (int i = 0; i < 200000; i++) {
+            seed = seed * 1103515245 + 12345;
+            int slot = (seed >> 16) % 64;
+            myfree(live[slot]);
+            live[slot] = mymalloc(1 + (seed >> 8) % 2048);
+            tk_assert(live[slot] != NULL, "malloc should not return NULL");
+            memset(live[slot], 0xab, 1);
+        }
+        // 第一轮预热，第二轮的增长必须很小
+        if (round == 1) {
+            long growth = resident_pages() - before;
+            tk_assert(growth < 256, "RSS should stay flat, grew %ld pages", growth);
+        }
+    }
+    for (int i = 0; i < 64; i++) myfree(live[i]);
+
+    // 大块直接归还
+    char *big = mymalloc(1 << 20);
+    tk_assert(big != NULL, "large malloc should not return NULL");
+    big[(1 << 20) - 1] = 1;
+    myfree(big);
+}
+
+SystemTest(size_classes, ((const char *[]){})) {
+    // 小块按大小类紧凑排列，不再各占一页
+    long before = resident_pages();
+    char *tiny[4096];
+    for (int i = 0; i < 4096; i++) {
+        tiny[i] = mymalloc(4);
+        tk_assert(tiny[i] != NULL, "malloc should not return NULL");
+        *tiny[i] = (char)i;
+    }
+    long growth = resident_pages() - before;
+    tk_assert(growth < 4096 / 16, "4096 tiny blocks took %ld pages", growth);
+    for (int i = 0; i < 4096; i++) {
+        tk_assert(*tiny[i] == (char)i, "tiny block %d overwritten", i);
+        myfree(tiny[i]);
+    }
+
+    // 各种大小混合分配，内容互不覆盖
+    unsigned char *p[512];
+    size_t len[512];
+    for (int i = 0; i < 512; i++) {
+        len[i] = 1 + (i * 37) % 3000;
+        p[i] = mymalloc(len[i]);
+        tk_assert(p[i] != NULL, "malloc should not return NULL");
+        memset(p[i], i & 0xff, len[i]);
+    }
+    for (int i = 0; i < 512; i++) {
+        for (size_t j = 0; j < len[i]; j++) {
+            tk_assert(p[i][j] == (i & 0xff), "block %d of %zu bytes overwritten", i, len[i]);
+        }
+        myfree(p[i]);
+    }
+}
+
+#define REMOTE_N 1000
+static void *remote_ptrs[REMOTE_N];
+
+static void *free_remote(void *arg) {
+    for (int i = 0; i < REMOTE_N; i++) {
+        myfree(remote_ptrs[i]);
+    }
+    return NULL;
+}
+
+SystemTest(remote_free, ((const char *[]){})) {
+    for (int i = 0; i < REMOTE_N; i++) {
+        remote_ptrs[i] = mymalloc(64);
+        tk_assert(remote_ptrs[i] != NULL, "malloc should not return NULL");
+    }
+    pthread_t t;
+    pthread_create(&t, NULL, free_remote, NULL);
+    pthread_join(t, NULL);
+
+    // 其他线程释放的块回到所有者手中
+    void *p = mymalloc(64);
+    int found = 0;
+    for (int i = 0; i < REMOTE_N; i++) {
+        found |= p == remote_ptrs[i];
+    }
+    tk_assert(found, "remotely freed block should be reused by its owner");
+    myfree(p);
+}
+
 /*#define N 100000
 void T_malloc() {
     for (int i = 0; i < N; i++) {
@@ -59,3 +172,166 @@ SystemTest(concurrent, ((const char *[]){})) {
 
     //tk_assert(malloc_count == 4 * N, "malloc_count should be 4N");
 }*/
+
+#define CHURN_THREADS 128
+
+static void *churn(void *arg) {
+    unsigned char id = (unsigned char)(uintptr_t)arg;
+    unsigned char *p[32];
+    for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < 32; i++) {
+            p[i] = mymalloc(1 + (round * 31 + i * 17) % 1024);
+            if (!p[i]) return arg;
+            *p[i] = id;
+        }
+        for (int i = 0; i < 32; i++) {
+            if (*p[i] != id) return arg;
+            myfree(p[i]);
+        }
+    }
+    return NULL;
+}
+
+SystemTest(many_threads, ((const char *[]){})) {
+    // 线程数超过原先按 tid 取模的堆数，各线程的堆互不共享
+    pthread_t t[CHURN_THREADS];
+    for (int i = 0; i < CHURN_THREADS; i++) {
+        pthread_create(&t[i], NULL, churn, (void *)(uintptr_t)(i + 1));
+    }
+    for (int i = 0; i < CHURN_THREADS; i++) {
+        void *ret;
+        pthread_join(t[i], &ret);
+        tk_assert(ret == NULL, "thread %d saw a corrupted block", i);
+    }
+}
+
+// 生产者分配、消费者释放：每个消费者一个单生产者单消费者的环形队列
+#define PIPE_CONSUMERS 4
+#define PIPE_RING 256
+#define PIPE_ITEMS 100000
+
+static struct {
+    void *slots[PIPE_RING];
+    _Atomic unsigned head, tail;
+} pipes[PIPE_CONSUMERS];
+
+static void *consume(void *arg) {
+    int id = (int)(uintptr_t)arg;
+    for (int n = 0; n < PIPE_ITEMS / PIPE_CONSUMERS; n++) {
+        unsigned head = atomic_load(&pipes[id].head);
+        while (atomic_load_explicit(&pipes[id].tail, memory_order_acquire) == head) sched_yield();
+        unsigned char *p = pipes[id].slots[head % PIPE_RING];
+        if (*p != (unsigned char)head) return arg;
+        myfree(p);
+        atomic_store_explicit(&pipes[id].head, head + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+SystemTest(pipeline, ((const char *[]){})) {
+    pthread_t t[PIPE_CONSUMERS];
+    for (int i = 0; i < PIPE_CONSUMERS; i++) {
+        pthread_create(&t[i], NULL, consume, (void *)(uintptr_t)i);
+    }
+    long before = resident_pages();
+    for (int n = 0; n < PIPE_ITEMS; n++) {
+        int id = n % PIPE_CONSUMERS;
+        unsigned tail = atomic_load(&pipes[id].tail);
+        while (tail - atomic_load_explicit(&pipes[id].head, memory_order_acquire) == PIPE_RING) sched_yield();
+        unsigned char *p = mymalloc(64 + n % 512);
+        tk_assert(p != NULL, "malloc should not return NULL");
+        *p = (unsigned char)tail;
+        pipes[id].slots[tail % PIPE_RING] = p;
+        atomic_store_explicit(&pipes[id].tail, tail + 1, memory_order_release);
+    }
+    for (int i = 0; i < PIPE_CONSUMERS; i++) {
+        void *ret;
+        pthread_join(t[i], &ret);
+        tk_assert(ret == NULL, "consumer %d saw a corrupted block", i);
+    }
+    // 远程释放的块回到生产者手中被复用，内存不随条目数增长
+    long growth = resident_pages() - before;
+    tk_assert(growth < 2048, "RSS grew %ld pages", growth);
+}
+
+SystemTest(coalesce, ((const char *[]){})) {
+    // 三个相邻的大块释放后合并，能满足一个三倍大小的请求
+    char *a = mymalloc(8192);
+    char *b = mymalloc(8192);
+    char *c = mymalloc(8192);
+    char *guard = mymalloc(8192);
+    tk_assert(a && b && c && guard, "malloc should not return NULL");
+    memset(guard, 0x11, 8192);
+    myfree(a);
+    myfree(c);
+    myfree(b);
+    char *p = mymalloc(3 * 8192);
+    tk_assert(p == a, "adjacent free blocks should coalesce");
+    memset(p, 0x5a, 3 * 8192);
+    tk_assert(guard[0] == 0x11 && guard[8191] == 0x11, "guard block should stay intact");
+    myfree(p);
+    myfree(guard);
+}
+
+// 碎片测试：大小不一的大块长时间混合分配/释放，常驻内存应与峰值存活字节数相当
+#define FRAG_SLOTS 64
+#define FRAG_OPS 20000
+
+SystemTest(fragmentation, ((const char *[]){})) {
+    char *live[FRAG_SLOTS] = {0};
+    size_t len[FRAG_SLOTS] = {0};
+    size_t live_bytes = 0, peak = 0;
+    unsigned seed = 7;
+    long before = resident_pages();
+    for (int i = 0; i < FRAG_OPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 16) % FRAG_SLOTS;
+        myfree(live[slot]);
+        live_bytes -= len[slot];
+        len[slot] = 2049 + (seed >> 4) % (64 * 1024);
+        live[slot] = mymalloc(len[slot]);
+        tk_assert(live[slot] != NULL, "malloc should not return NULL");
+        memset(live[slot], i & 0xff, len[slot]);
+        live_bytes += len[slot];
+        if (live_bytes > peak) peak = live_bytes;
+    }
+    long growth = resident_pages() - before;
+    tk_assert(growth * 4096 < 2 * (long)peak,
+              "RSS grew %ld KiB for a peak of %zu KiB live", growth * 4, peak / 1024);
+    for (int i = 0; i < FRAG_SLOTS; i++) myfree(live[i]);
+}
+
+// 短命线程：分配几种大小的块，释放一半，其余交给主线程跨线程释放
+#define SHORT_LIVED 16
+
+static void *short_lived(void *arg) {
+    void **keep = arg;
+    void *p[SHORT_LIVED * 2];
+    for (int i = 0; i < SHORT_LIVED * 2; i++) {
+        p[i] = mymalloc(16 + i * 61);
+        if (!p[i]) return NULL;
+        *(char *)p[i] = (char)i;
+    }
+    for (int i = 0; i < SHORT_LIVED; i++) {
+        myfree(p[i]);
+        keep[i] = p[SHORT_LIVED + i];
+    }
+    return arg;
+}
+
+SystemTest(thread_churn, ((const char *[]){})) {
+    // 线程退出后堆由新线程接管：常驻内存不随线程个数增长
+    void *keep[SHORT_LIVED];
+    long before = 0;
+    for (int n = 0; n < 2000; n++) {
+        if (n == 200) before = resident_pages();
+        pthread_t t;
+        void *ret;
+        pthread_create(&t, NULL, short_lived, keep);
+        pthread_join(t, &ret);
+        tk_assert(ret == keep, "thread %d failed to allocate", n);
+        for (int i = 0; i < SHORT_LIVED; i++) myfree(keep[i]);
+    }
+    long growth = resident_pages() - before;
+    tk_assert(growth < 64, "RSS grew %ld pages over 1800 threads", growth);
+}